@@ -54,6 +54,9 @@ print_usage()
   printf ("  * create a watermarked wav file with a message\n");
   printf ("    audiowmark add <input_wav> <watermarked_wav> <message_hex>\n");
   printf ("\n");
+  printf ("  * create watermarked wav files with different messages from one input file\n");
+  printf ("    audiowmark add-batch <input_wav> <batch_file>\n");
+  printf ("\n");
   printf ("  * retrieve message\n");
   printf ("    audiowmark get <watermarked_wav>\n");
   printf ("\n");
@@ -66,16 +69,23 @@ print_usage()
   printf ("Global options:\n");
   printf ("  -q, --quiet             disable information messages\n");
   printf ("  --strict                treat (minor) problems as errors\n");
+  printf ("  --threads <n>           use <n> worker threads (default: available cpus)\n");
   printf ("\n");
   printf ("Options for get / cmp:\n");
   printf ("  --detect-speed          detect and correct replay speed difference\n");
   printf ("  --detect-speed-patient  slower, more accurate speed detection\n");
   printf ("  --json <file>           write JSON results into file\n");
+  printf ("  --max-memory <mb>       use streaming decoder for large inputs\n");
+  printf ("  --compact-spectrogram   use less memory for the sync search\n");
+  printf ("\n");
+  printf ("Options for add:\n");
+  printf ("  --jobs <n>              watermark <n> chunks of the input in parallel\n");
   printf ("\n");
   printf ("Options for add / get / cmp:\n");
   printf ("  --key <file>            load watermarking key from file\n");
   printf ("  --short <bits>          enable short payload mode\n");
   printf ("  --strength <s>          set watermark strength              [%.6g]\n", Params::water_delta * 1000);
+  printf ("  --silence-floor <db>    skip frames with a lower level (dBFS)\n");
   printf ("\n");
   printf ("  --input-format raw      use raw stream as input\n");
   printf ("  --output-format raw     use raw stream as output\n");
@@ -184,7 +194,7 @@ gentest (const string& infile, const string& outfile)
       error ("audiowmark: error loading %s: %s\n", infile.c_str(), err.message());
       return 1;
     }
-  const vector<float>& in_signal = wav_data.samples();
+  const auto& in_signal = wav_data.samples();
   vector<float> out_signal;
 
   /* 2:45 of audio - this is approximately the minimal amount of audio data required
@@ -223,7 +233,7 @@ cut_start (const string& infile, const string& outfile, const string& start_str)
 
   size_t start = atoi_or_die (start_str.c_str());
 
-  const vector<float>& in_signal = wav_data.samples();
+  const auto& in_signal = wav_data.samples();
   vector<float> out_signal;
   for (size_t i = start * wav_data.n_channels(); i < in_signal.size(); i++)
     out_signal.push_back (in_signal[i]);
@@ -348,9 +358,7 @@ test_clip (const Key& key, const string& in_file, const string& out_file, int se
   while (!done);
   //printf ("%.3f %.3f\n", start_point / double (in_data.sample_rate()), end_point / double (in_data.sample_rate()));
 
-  vector<float> out_signal (in_data.samples().begin() + start_point * in_data.n_channels(),
-                            in_data.samples().begin() + end_point * in_data.n_channels());
-  WavData out_wav_data (out_signal, in_data.n_channels(), in_data.sample_rate(), in_data.bit_depth());
+  WavData out_wav_data = in_data.slice (start_point, end_point - start_point);
   err = out_wav_data.save (out_file);
   if (err)
     {
@@ -633,6 +641,10 @@ parse_shared_options (ArgParser& ap)
     {
       Params::mix = false;
     }
+  if (ap.parse_opt ("--silence-floor", f))
+    {
+      Params::silence_floor = f;
+    }
 }
 
 vector<Key>
@@ -685,6 +697,15 @@ parse_add_options (ArgParser& ap)
     {
       Params::snr = true;
     }
+  if (ap.parse_opt ("--jobs", i))
+    {
+      if (i < 1)
+        {
+          error ("audiowmark: bad --jobs setting %d (must be at least 1)\n", i);
+          exit (1);
+        }
+      Params::add_jobs = i;
+    }
   if (ap.parse_opt ("--input-format", s))
     {
       Params::input_format = parse_format (s);
@@ -768,6 +789,7 @@ parse_get_options (ArgParser& ap)
 {
   string s;
   float f;
+  int i;
 
   ap.parse_opt ("--test-cut", Params::test_cut);
   ap.parse_opt ("--test-truncate", Params::test_truncate);
@@ -809,6 +831,58 @@ parse_get_options (ArgParser& ap)
     {
       Params::json_output = s;
     }
+  if (ap.parse_opt ("--max-memory", i))
+    {
+      if (i <= 0)
+        {
+          error ("audiowmark: bad --max-memory setting %d (must be positive)\n", i);
+          exit (1);
+        }
+      Params::max_memory = size_t (i) * 1024 * 1024;
+    }
+  if (ap.parse_opt ("--compact-spectrogram"))
+    {
+      Params::compact_spectrogram = true;
+    }
+}
+
+bool
+parse_batch_file (const string& batch_file, vector<string>& outfiles, vector<string>& messages)
+{
+  FILE *f = fopen (batch_file.c_str(), "r");
+  if (!f)
+    {
+      error ("audiowmark: error opening batch file: '%s'\n", batch_file.c_str());
+      return false;
+    }
+
+  /* each line contains: <watermarked_wav> <message_hex> */
+  char buffer[1024];
+  int line = 1;
+  while (fgets (buffer, 1024, f))
+    {
+      vector<string> tokens;
+      if (!tokenize (buffer, tokens) || (tokens.size() != 0 && tokens.size() != 2))
+        {
+          error ("audiowmark: parse error in batch file '%s', line %d\n", batch_file.c_str(), line);
+          fclose (f);
+          return false;
+        }
+      if (tokens.size() == 2)
+        {
+          outfiles.push_back (tokens[0]);
+          messages.push_back (tokens[1]);
+        }
+      line++;
+    }
+  fclose (f);
+
+  if (outfiles.empty())
+    {
+      error ("audiowmark: batch file '%s' contains no entries\n", batch_file.c_str());
+      return false;
+    }
+  return true;
 }
 
 template <class ... Args>
@@ -868,6 +942,16 @@ main (int argc, char **argv)
     {
       Params::strict = true;
     }
+  int threads;
+  if (ap.parse_opt ("--threads", threads))
+    {
+      if (threads < 1)
+        {
+          error ("audiowmark: bad --threads setting %d (must be at least 1)\n", threads);
+          return 1;
+        }
+      Params::threads = threads;
+    }
   if (ap.parse_cmd ("hls-add"))
     {
       parse_shared_options (ap);
@@ -894,6 +978,19 @@ main (int argc, char **argv)
       args = parse_positional (ap, "input_wav", "watermarked_wav", "message_hex");
       return add_watermark (key, args[0], args[1], args[2]);
     }
+  else if (ap.parse_cmd ("add-batch"))
+    {
+      parse_shared_options (ap);
+      parse_add_options (ap);
+
+      Key key = parse_key (ap);
+      args = parse_positional (ap, "input_wav", "batch_file");
+
+      vector<string> outfiles, messages;
+      if (!parse_batch_file (args[1], outfiles, messages))
+        return 1;
+      return add_watermark_batch (key, args[0], outfiles, messages);
+    }
   else if (ap.parse_cmd ("get"))
     {
       parse_shared_options (ap);
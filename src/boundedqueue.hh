@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIOWMARK_BOUNDED_QUEUE_HH
+#define AUDIOWMARK_BOUNDED_QUEUE_HH
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+/*
+ * Single-producer/single-consumer bounded queue (spins, then blocks on a
+ * condition variable) which passes items from exactly one producer thread to
+ * exactly one consumer thread.
+ *
+ * A thread that can't push (queue full) or pop (queue empty) spins a little,
+ * and then sleeps on a condition variable until the other side changes the
+ * queue. The other side only locks the mutex if somebody is sleeping.
+ *
+ * Either side can close() the queue: the producer closes it after the last
+ * item was pushed, the consumer closes it if it doesn't want any more items.
+ */
+template<class T>
+class BoundedQueue
+{
+  std::vector<T>          m_items;
+  std::atomic<size_t>     m_read_pos { 0 };
+  std::atomic<size_t>     m_write_pos { 0 };
+  std::atomic<bool>       m_closed { false };
+  std::atomic<int>        m_sleepers { 0 };
+  std::mutex              m_mutex;
+  std::condition_variable m_cond;
+
+  static constexpr int max_spins = 64;
+
+  /* wait until ready() is true (or, while spinning, just retry) */
+  template<class F> void
+  wait (int& spins, const F& ready)
+  {
+    if (++spins < max_spins)
+      return;
+
+    std::unique_lock<std::mutex> lock (m_mutex);
+    m_sleepers.fetch_add (1);
+    /* pairs with the fence in wake(): either we see the change, or wake() sees the sleeper */
+    std::atomic_thread_fence (std::memory_order_seq_cst);
+    m_cond.wait (lock, ready);
+    m_sleepers.fetch_sub (1);
+  }
+  void
+  wake()
+  {
+    std::atomic_thread_fence (std::memory_order_seq_cst);
+    if (m_sleepers.load (std::memory_order_relaxed) > 0)
+      {
+        std::lock_guard<std::mutex> lg (m_mutex);
+        m_cond.notify_all();
+      }
+  }
+  bool
+  full() const
+  {
+    return m_write_pos.load (std::memory_order_acquire) - m_read_pos.load (std::memory_order_acquire) == m_items.size();
+  }
+  bool
+  empty() const
+  {
+    return m_write_pos.load (std::memory_order_acquire) == m_read_pos.load (std::memory_order_acquire);
+  }
+public:
+  BoundedQueue (size_t capacity) :
+    m_items (capacity)
+  {
+  }
+  bool
+  try_push (T& item)
+  {
+    const size_t write_pos = m_write_pos.load (std::memory_order_relaxed);
+    if (write_pos - m_read_pos.load (std::memory_order_acquire) == m_items.size())
+      return false; /* full */
+
+    m_items[write_pos % m_items.size()] = std::move (item);
+    m_write_pos.store (write_pos + 1, std::memory_order_release);
+    wake();
+    return true;
+  }
+  bool
+  try_pop (T& item)
+  {
+    const size_t read_pos = m_read_pos.load (std::memory_order_relaxed);
+    if (read_pos == m_write_pos.load (std::memory_order_acquire))
+      return false; /* empty */
+
+    item = std::move (m_items[read_pos % m_items.size()]);
+    m_read_pos.store (read_pos + 1, std::memory_order_release);
+    wake();
+    return true;
+  }
+  /* blocks until item was added; returns false if the queue was closed */
+  bool
+  push (T item)
+  {
+    int spins = 0;
+    while (!m_closed.load (std::memory_order_acquire))
+      {
+        if (try_push (item))
+          return true;
+        wait (spins, [this] { return m_closed.load (std::memory_order_acquire) || !full(); });
+      }
+    return false;
+  }
+  /* blocks until an item is available; returns false if the queue was closed and is empty */
+  bool
+  pop (T& item)
+  {
+    int spins = 0;
+    while (!try_pop (item))
+      {
+        if (m_closed.load (std::memory_order_acquire))
+          return try_pop (item); /* item could have been added before close() */
+        wait (spins, [this] { return m_closed.load (std::memory_order_acquire) || !empty(); });
+      }
+    return true;
+  }
+  void
+  close()
+  {
+    m_closed.store (true, std::memory_order_release);
+
+    std::lock_guard<std::mutex> lg (m_mutex);
+    m_cond.notify_all();
+  }
+};
+
+#endif /* AUDIOWMARK_BOUNDED_QUEUE_HH */
@@ -20,7 +20,14 @@
 
 #include <array>
 #include <algorithm>
+#include <limits>
 #include <assert.h>
+#include <stdint.h>
+
+#if defined (__GNUC__) && (defined (__x86_64__) || defined (__i386__))
+#include <immintrin.h>
+#define CONV_CODE_HAVE_AVX2 1
+#endif
 
 using std::vector;
 using std::string;
@@ -124,6 +131,137 @@ conv_encode (ConvBlockType block_type, const vector<int>& in_bits)
   return out_vec;
 }
 
+/* precompute branch metrics for one step: since the output bits only depend
+ * on the new state, there are only 2^rate distinct output words
+ *
+ * bit p of the output word is the output of generator p
+ */
+static void
+compute_branch_metrics (const float *cbits, unsigned int rate, vector<float>& branch_metrics)
+{
+  branch_metrics.resize (1 << rate);
+  branch_metrics[0] = 0;
+  for (unsigned int p = 0; p < rate; p++)
+    {
+      const float cbit = cbits[p];
+      const unsigned int words = 1 << p;
+
+      /* decoding error weight for this bit; if input is only 0.0 and 1.0, this is the hamming distance */
+      for (unsigned int w = 0; w < words; w++)
+        {
+          branch_metrics[w | words] = branch_metrics[w] + (cbit - 1) * (cbit - 1);
+          branch_metrics[w]         = branch_metrics[w] + cbit * cbit;
+        }
+    }
+}
+
+/* add-compare-select for one step of the viterbi algorithm
+ *
+ * the new states 2j and 2j+1 both have the predecessors j and j + half_state_count
+ * and since the branch metric only depends on the new state, both new states use
+ * the same decision: bit j of decision is set if the path from j + half_state_count is better
+ */
+constexpr unsigned int half_state_count = state_count / 2;
+constexpr unsigned int decision_words   = half_state_count / 32;
+
+static void
+viterbi_step_scalar (const float *old_delta, float *new_delta, const float *branch_metrics,
+                     const int *word_even, const int *word_odd, uint32_t *decision)
+{
+  for (unsigned int j0 = 0; j0 < half_state_count; j0 += 32)
+    {
+      uint32_t bits = 0;
+      for (unsigned int j = j0; j < j0 + 32; j++)
+        {
+          const float lo = old_delta[j];
+          const float hi = old_delta[j + half_state_count];
+          const bool  d  = hi < lo;
+          const float m  = d ? hi : lo;
+
+          new_delta[2 * j]     = m + branch_metrics[word_even[j]];
+          new_delta[2 * j + 1] = m + branch_metrics[word_odd[j]];
+          bits |= uint32_t (d) << (j - j0);
+        }
+      decision[j0 / 32] = bits;
+    }
+}
+
+#ifdef CONV_CODE_HAVE_AVX2
+__attribute__ ((target ("avx2"))) static void
+viterbi_step_avx2 (const float *old_delta, float *new_delta, const float *branch_metrics,
+                   const int *word_even, const int *word_odd, uint32_t *decision)
+{
+  for (unsigned int j0 = 0; j0 < half_state_count; j0 += 32)
+    {
+      uint32_t bits = 0;
+      for (unsigned int j = j0; j < j0 + 32; j += 8)
+        {
+          const __m256 lo = _mm256_loadu_ps (old_delta + j);
+          const __m256 hi = _mm256_loadu_ps (old_delta + j + half_state_count);
+
+          /* min_ps (hi, lo) returns lo if hi < lo is false, like the scalar code */
+          const __m256 m  = _mm256_min_ps (hi, lo);
+          const int    d  = _mm256_movemask_ps (_mm256_cmp_ps (hi, lo, _CMP_LT_OQ));
+
+          const __m256 bm_even = _mm256_i32gather_ps (branch_metrics, _mm256_loadu_si256 ((const __m256i *) (word_even + j)), 4);
+          const __m256 bm_odd  = _mm256_i32gather_ps (branch_metrics, _mm256_loadu_si256 ((const __m256i *) (word_odd + j)), 4);
+          const __m256 even = _mm256_add_ps (m, bm_even);
+          const __m256 odd  = _mm256_add_ps (m, bm_odd);
+
+          /* interleave even and odd states */
+          const __m256 i0 = _mm256_unpacklo_ps (even, odd);
+          const __m256 i1 = _mm256_unpackhi_ps (even, odd);
+          _mm256_storeu_ps (new_delta + 2 * j,     _mm256_permute2f128_ps (i0, i1, 0x20));
+          _mm256_storeu_ps (new_delta + 2 * j + 8, _mm256_permute2f128_ps (i0, i1, 0x31));
+
+          bits |= uint32_t (d) << (j - j0);
+        }
+      decision[j0 / 32] = bits;
+    }
+}
+#endif
+
+/* memory used by the viterbi decoder; we keep one workspace per thread to
+ * avoid allocating (and zeroing) the tables for each decoder call
+ */
+struct ViterbiWorkspace
+{
+  vector<float>    delta_old;
+  vector<float>    delta_new;
+  vector<uint32_t> decision;      /* survivor decisions: one bit per state pair per step */
+  vector<float>    branch_metrics;
+
+  /* new state -> output word table, separately for even and odd states (for each block type) */
+  struct WordTable
+  {
+    vector<int> word_even;
+    vector<int> word_odd;
+  } word_tables[3];
+
+  const WordTable&
+  word_table (ConvBlockType block_type, const vector<unsigned>& generators)
+  {
+    WordTable& table = word_tables[int (block_type)];
+    if (table.word_even.empty())
+      {
+        table.word_even.resize (half_state_count);
+        table.word_odd.resize (half_state_count);
+        for (unsigned int state = 0; state < state_count; state++)
+          {
+            int word = 0;
+            for (size_t p = 0; p < generators.size(); p++)
+              word |= parity (state & generators[p]) << p;
+
+            if (state & 1)
+              table.word_odd[state / 2] = word;
+            else
+              table.word_even[state / 2] = word;
+          }
+      }
+    return table;
+  }
+};
+
 /* decode using viterbi algorithm */
 vector<int>
 conv_decode_soft (ConvBlockType block_type, const vector<float>& coded_bits, float *error_out)
@@ -134,74 +272,43 @@ conv_decode_soft (ConvBlockType block_type, const vector<float>& coded_bits, flo
 
   assert (coded_bits.size() % rate == 0);
 
-  struct StateEntry
-  {
-    int   last_state;
-    float delta;
-    int   bit;
-  };
-  vector<vector<StateEntry>> error_count;
-  for (size_t i = 0; i < coded_bits.size() + rate; i += rate) /* 1 extra element */
-    error_count.emplace_back (state_count, StateEntry {0, -1, 0});
+  auto viterbi_step = viterbi_step_scalar;
+#ifdef CONV_CODE_HAVE_AVX2
+  static const bool have_avx2 = __builtin_cpu_supports ("avx2");
+  if (have_avx2)
+    viterbi_step = viterbi_step_avx2;
+#endif
 
-  error_count[0][0].delta = 0; /* start state */
+  static thread_local ViterbiWorkspace ws;
+  const auto& word_table = ws.word_table (block_type, generators);
 
-  /* precompute state -> output bits table */
-  vector<float> state2bits;
-  for (unsigned int state = 0; state < state_count; state++)
-    {
-      for (size_t p = 0; p < generators.size(); p++)
-        {
-          int out_bit = parity (state & generators[p]);
-          state2bits.push_back (out_bit);
-        }
-    }
+  /* unreachable states have infinite error: this ensures that we only consider states reachable from state=0 at time=0 */
+  const size_t steps = coded_bits.size() / rate;
+  ws.delta_old.assign (state_count, std::numeric_limits<float>::infinity());
+  ws.delta_new.resize (state_count);
+  ws.decision.resize (steps * decision_words);
 
-  for (size_t i = 0; i < coded_bits.size(); i += rate)
+  ws.delta_old[0] = 0; /* start state */
+
+  for (size_t i = 0; i < steps; i++)
     {
-      vector<StateEntry>& old_table = error_count[i / rate];
-      vector<StateEntry>& new_table = error_count[i / rate + 1];
+      compute_branch_metrics (&coded_bits[i * rate], rate, ws.branch_metrics);
 
-      for (unsigned int state = 0; state < state_count; state++)
-        {
-          /* this check enforces that we only consider states reachable from state=0 at time=0*/
-          if (old_table[state].delta >= 0)
-            {
-              for (int bit = 0; bit < 2; bit++)
-                {
-                  int   new_state = ((state << 1) | bit) & state_mask;
-
-                  float delta = old_table[state].delta;
-                  int   sbit_pos = new_state * rate;
-
-                  for (size_t p = 0; p < rate; p++)
-                    {
-                      const float cbit = coded_bits[i + p];
-                      const float sbit = state2bits[sbit_pos + p];
-
-                      /* decoding error weight for this bit; if input is only 0.0 and 1.0, this is the hamming distance */
-                      delta += (cbit - sbit) * (cbit - sbit);
-                    }
-
-                  if (delta < new_table[new_state].delta || new_table[new_state].delta < 0) /* better match with this link? replace entry */
-                    {
-                      new_table[new_state].delta      = delta;
-                      new_table[new_state].last_state = state;
-                      new_table[new_state].bit        = bit;
-                    }
-                }
-            }
-        }
+      viterbi_step (ws.delta_old.data(), ws.delta_new.data(), ws.branch_metrics.data(),
+                    word_table.word_even.data(), word_table.word_odd.data(), &ws.decision[i * decision_words]);
+      std::swap (ws.delta_old, ws.delta_new);
     }
 
   unsigned int state = 0;
   if (error_out)
-    *error_out = error_count.back()[state].delta / coded_bits.size();
-  for (size_t idx = error_count.size() - 1; idx > 0; idx--)
+    *error_out = ws.delta_old[state] / coded_bits.size();
+  for (size_t idx = steps; idx > 0; idx--)
     {
-      decoded_bits.push_back (error_count[idx][state].bit);
+      decoded_bits.push_back (state & 1);
 
-      state = error_count[idx][state].last_state;
+      const unsigned int j = state >> 1;
+      const uint32_t    *decision = &ws.decision[(idx - 1) * decision_words];
+      state = (decision[j / 32] >> (j % 32)) & 1 ? j + half_state_count : j;
     }
   std::reverse (decoded_bits.begin(), decoded_bits.end());
 
@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <map>
+#include <mutex>
+
+#include "keyschedule.hh"
+#include "shortcode.hh"
+
+using std::vector;
+
+KeySchedule::KeySchedule (const Key& key) :
+  m_payload_size (Params::payload_size)
+{
+  UpDownGen sync_up_down_gen (key, Random::Stream::sync_up_down);
+  for (size_t f = 0; f < mark_sync_frame_count(); f++)
+    {
+      UpDownArray up, down;
+      sync_up_down_gen.get (f, up, down);
+      m_sync_up.push_back (up);
+      m_sync_down.push_back (down);
+    }
+
+  UpDownGen data_up_down_gen (key, Random::Stream::data_up_down);
+  for (size_t f = 0; f < mark_data_frame_count(); f++)
+    {
+      UpDownArray up, down;
+      data_up_down_gen.get (f, up, down);
+      m_data_up.push_back (up);
+      m_data_down.push_back (down);
+    }
+
+  /* frame positions: sync frames and data frames are randomly distributed within the block */
+  for (size_t i = 0; i < mark_sync_frame_count() + mark_data_frame_count(); i++)
+    m_frame_pos.push_back (i);
+
+  Random pos_random (key, 0, Random::Stream::frame_position);
+  pos_random.shuffle (m_frame_pos);
+
+  /* data entries: up/down bands of all data frames, mix entries: the same entries in random order */
+  for (size_t f = 0; f < mark_data_frame_count(); f++)
+    {
+      for (size_t i = 0; i < Params::bands_per_frame; i++)
+        m_data_entries.push_back ({ data_frame (f), m_data_up[f][i], m_data_down[f][i] });
+    }
+  m_mix_entries = m_data_entries;
+
+  Random mix_random (key, /* seed */ 0, Random::Stream::mix);
+  mix_random.shuffle (m_mix_entries);
+
+  /* bit order for the error correction coded payload */
+  for (size_t i = 0; i < code_size (ConvBlockType::a, Params::payload_size); i++)
+    m_bit_order.push_back (i);
+
+  Random bit_order_random (key, /* seed */ 0, Random::Stream::bit_order);
+  bit_order_random.shuffle (m_bit_order);
+}
+
+/* cache key: (aes key, payload size) */
+using KeyScheduleCacheKey = std::pair<vector<unsigned char>, size_t>;
+
+static std::mutex                                                          key_schedule_cache_mutex;
+static std::map<KeyScheduleCacheKey, std::shared_ptr<const KeySchedule>>  key_schedule_cache;
+
+/* safe to call from any thread */
+std::shared_ptr<const KeySchedule>
+KeySchedule::get (const Key& key)
+{
+  /* the cache is unbounded: a process only uses the keys passed on the command line (--key, --test-key) */
+  const KeyScheduleCacheKey cache_key (vector<unsigned char> (key.aes_key(), key.aes_key() + Key::SIZE), Params::payload_size);
+  {
+    std::lock_guard<std::mutex> lg (key_schedule_cache_mutex);
+
+    auto it = key_schedule_cache.find (cache_key);
+    if (it != key_schedule_cache.end())
+      return it->second;
+  }
+  /* computing the schedule is expensive, so other threads can use the cache meanwhile */
+  auto key_schedule = std::make_shared<const KeySchedule> (key);
+
+  std::lock_guard<std::mutex> lg (key_schedule_cache_mutex);
+
+  /* if another thread computed the same schedule in the meantime, use the cached one */
+  auto result = key_schedule_cache.emplace (cache_key, key_schedule);
+  return result.first->second;
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIOWMARK_KEY_SCHEDULE_HH
+#define AUDIOWMARK_KEY_SCHEDULE_HH
+
+#include <memory>
+#include <vector>
+
+#include "wmcommon.hh"
+
+/*
+ * The KeySchedule contains all key dependent pseudo random tables that are
+ * needed to watermark or to decode a block:
+ *
+ *  - up/down bands for each sync frame and each data frame
+ *  - positions of sync frames and data frames within the block
+ *  - data entries: the up/down bands of all data frames (linear order), and
+ *    mix entries (the same entries in random order, used for Params::mix)
+ *  - bit order of the error correction coded payload
+ *
+ * Computing these tables requires many AES operations and shuffles, so
+ * KeySchedule::get() caches the schedules of all keys used by the process. A
+ * KeySchedule is immutable, so it can be used from any thread.
+ *
+ * The tables depend on Params::payload_size, so the cache is keyed by (key,
+ * payload size).
+ */
+class KeySchedule
+{
+  size_t                    m_payload_size = 0;
+  std::vector<UpDownArray>  m_sync_up;
+  std::vector<UpDownArray>  m_sync_down;
+  std::vector<UpDownArray>  m_data_up;
+  std::vector<UpDownArray>  m_data_down;
+  std::vector<int>          m_frame_pos;
+  std::vector<MixEntry>     m_data_entries;
+  std::vector<MixEntry>     m_mix_entries;
+  std::vector<unsigned int> m_bit_order;
+
+public:
+  explicit KeySchedule (const Key& key);
+
+  static std::shared_ptr<const KeySchedule> get (const Key& key);
+
+  const UpDownArray& sync_up (int f) const   { return m_sync_up[f]; }
+  const UpDownArray& sync_down (int f) const { return m_sync_down[f]; }
+  const UpDownArray& data_up (int f) const   { return m_data_up[f]; }
+  const UpDownArray& data_down (int f) const { return m_data_down[f]; }
+
+  int
+  sync_frame (int f) const
+  {
+    assert (f >= 0 && size_t (f) < mark_sync_frame_count());
+    return m_frame_pos[f];
+  }
+  int
+  data_frame (int f) const
+  {
+    assert (f >= 0 && size_t (f) < mark_data_frame_count());
+    return m_frame_pos[f + mark_sync_frame_count()];
+  }
+  /* up/down bands of all data frames in linear order (data frame 0 first) */
+  const std::vector<MixEntry>&
+  data_entries() const
+  {
+    return m_data_entries;
+  }
+  const std::vector<MixEntry>&
+  mix_entries() const
+  {
+    return m_mix_entries;
+  }
+  size_t
+  payload_size() const
+  {
+    return m_payload_size;
+  }
+
+  template<class T> std::vector<T>
+  randomize_bit_order (const std::vector<T>& bit_vec, bool encode) const
+  {
+    assert (bit_vec.size() == m_bit_order.size());
+
+    std::vector<T> out_bits (bit_vec.size());
+    for (size_t i = 0; i < bit_vec.size(); i++)
+      {
+        if (encode)
+          out_bits[i] = bit_vec[m_bit_order[i]];
+        else
+          out_bits[m_bit_order[i]] = bit_vec[i];
+      }
+    return out_bits;
+  }
+};
+
+#endif /* AUDIOWMARK_KEY_SCHEDULE_HH */
@@ -42,6 +42,12 @@ Limiter::set_ceiling (float new_ceiling)
   ceiling = new_ceiling;
 }
 
+uint
+Limiter::get_block_size() const
+{
+  return block_size;
+}
+
 vector<float>
 Limiter::process (const vector<float>& samples)
 {
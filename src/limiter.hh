@@ -40,6 +40,7 @@ public:
 
   void set_block_size_ms (int value_ms);
   void set_ceiling (float ceiling);
+  uint get_block_size() const;
 
   std::vector<float> process (const std::vector<float>& samples);
   size_t             skip (size_t zeros);
@@ -20,9 +20,17 @@
 
 #include <regex>
 
+#include <algorithm>
+
 #include <assert.h>
+#include <string.h>
 #include <cinttypes>
 
+#if defined (__GNUC__) && (defined (__x86_64__) || defined (__i386__))
+#include <immintrin.h>
+#define RANDOM_HAVE_AESNI 1
+#endif
+
 using std::string;
 using std::vector;
 using std::regex;
@@ -31,28 +39,26 @@ using std::regex_match;
 static void
 gcrypt_init()
 {
-  static bool init_ok = false;
-
-  if (!init_ok)
-    {
-      /* version check: start libgcrypt initialization */
-      if (!gcry_check_version (GCRYPT_VERSION))
-        {
-          error ("audiowmark: libgcrypt version mismatch\n");
-          exit (1);
-        }
+  /* Random objects are created by thread pool workers, so this must be thread safe */
+  static const bool init_ok = [] {
+    /* version check: start libgcrypt initialization */
+    if (!gcry_check_version (GCRYPT_VERSION))
+      {
+        error ("audiowmark: libgcrypt version mismatch\n");
+        exit (1);
+      }
 
-      /* disable secure memory (assume we run in a controlled environment) */
-      gcry_control (GCRYCTL_DISABLE_SECMEM, 0);
+    /* disable secure memory (assume we run in a controlled environment) */
+    gcry_control (GCRYCTL_DISABLE_SECMEM, 0);
 
-      /* tell libgcrypt that initialization has completed */
-      gcry_control (GCRYCTL_INITIALIZATION_FINISHED, 0);
+    /* tell libgcrypt that initialization has completed */
+    gcry_control (GCRYCTL_INITIALIZATION_FINISHED, 0);
 
-      init_ok = true;
-    }
+    return true;
+  }();
+  (void) init_ok;
 }
 
-
 static constexpr auto        GCRY_CIPHER = GCRY_CIPHER_AES128;
 
 static void
@@ -95,23 +101,148 @@ print (const string& label, const vector<unsigned char>& data)
 }
 #endif
 
+#ifdef RANDOM_HAVE_AESNI
+/* AES-128 key expansion (FIPS-197), one round key per step */
+#define AESNI_EXPAND_STEP(rk, i, rcon) \
+  do { \
+      __m128i k = rk[i - 1]; \
+      __m128i t = _mm_shuffle_epi32 (_mm_aeskeygenassist_si128 (k, rcon), _MM_SHUFFLE (3, 3, 3, 3)); \
+      k = _mm_xor_si128 (k, _mm_slli_si128 (k, 4)); \
+      k = _mm_xor_si128 (k, _mm_slli_si128 (k, 4)); \
+      k = _mm_xor_si128 (k, _mm_slli_si128 (k, 4)); \
+      rk[i] = _mm_xor_si128 (k, t); \
+  } while (0)
+
+__attribute__ ((target ("aes,sse2"))) static void
+aesni_expand_key (const unsigned char *key, unsigned char *round_keys)
+{
+  __m128i *rk = reinterpret_cast<__m128i *> (round_keys);
+
+  rk[0] = _mm_loadu_si128 (reinterpret_cast<const __m128i *> (key));
+  AESNI_EXPAND_STEP (rk, 1, 0x01);
+  AESNI_EXPAND_STEP (rk, 2, 0x02);
+  AESNI_EXPAND_STEP (rk, 3, 0x04);
+  AESNI_EXPAND_STEP (rk, 4, 0x08);
+  AESNI_EXPAND_STEP (rk, 5, 0x10);
+  AESNI_EXPAND_STEP (rk, 6, 0x20);
+  AESNI_EXPAND_STEP (rk, 7, 0x40);
+  AESNI_EXPAND_STEP (rk, 8, 0x80);
+  AESNI_EXPAND_STEP (rk, 9, 0x1b);
+  AESNI_EXPAND_STEP (rk, 10, 0x36);
+}
+
+#undef AESNI_EXPAND_STEP
+
+__attribute__ ((target ("aes,sse2"))) static void
+aesni_encrypt_block (const unsigned char *round_keys, const unsigned char *plain_text, unsigned char *cipher_text)
+{
+  const __m128i *rk = reinterpret_cast<const __m128i *> (round_keys);
+
+  __m128i b = _mm_xor_si128 (_mm_loadu_si128 (reinterpret_cast<const __m128i *> (plain_text)), rk[0]);
+  for (int r = 1; r < 10; r++)
+    b = _mm_aesenc_si128 (b, rk[r]);
+  b = _mm_aesenclast_si128 (b, rk[10]);
+  _mm_storeu_si128 (reinterpret_cast<__m128i *> (cipher_text), b);
+}
+
+/* CTR mode keystream with a 128 bit big endian counter (same as libgcrypt),
+ * output as big endian uint64_t values; 8 blocks are encrypted interleaved
+ */
+__attribute__ ((target ("aes,sse2"))) static void
+aesni_ctr_keystream (const unsigned char *round_keys, uint64_t& ctr_hi, uint64_t& ctr_lo, size_t n_blocks, uint64_t *out)
+{
+  const __m128i *rk = reinterpret_cast<const __m128i *> (round_keys);
+
+  assert (n_blocks % 8 == 0);
+  for (size_t i = 0; i < n_blocks; i += 8)
+    {
+      __m128i b[8];
+      for (int j = 0; j < 8; j++)
+        {
+          b[j] = _mm_xor_si128 (_mm_set_epi64x (__builtin_bswap64 (ctr_lo), __builtin_bswap64 (ctr_hi)), rk[0]);
+          if (++ctr_lo == 0)
+            ctr_hi++;
+        }
+      for (int r = 1; r < 10; r++)
+        {
+          const __m128i k = rk[r];
+#pragma GCC unroll 8
+          for (int j = 0; j < 8; j++)
+            b[j] = _mm_aesenc_si128 (b[j], k);
+        }
+      for (int j = 0; j < 8; j++)
+        b[j] = _mm_aesenclast_si128 (b[j], rk[10]);
+      for (int j = 0; j < 8; j++)
+        {
+          alignas (16) uint64_t block[2];
+          _mm_store_si128 (reinterpret_cast<__m128i *> (block), b[j]);
+          *out++ = __builtin_bswap64 (block[0]);
+          *out++ = __builtin_bswap64 (block[1]);
+        }
+    }
+}
+#endif
+
+static bool force_gcrypt = false;
+
+static bool
+have_aesni()
+{
+#ifdef RANDOM_HAVE_AESNI
+  static const bool aesni = __builtin_cpu_supports ("aes");
+  return aesni && !force_gcrypt;
+#else
+  return false;
+#endif
+}
+
+void
+Random::set_force_gcrypt (bool force)
+{
+  force_gcrypt = force;
+}
+
 Random::Random (const Key& key, uint64_t start_seed, Stream stream)
 {
+  buffer.reserve (max_batch_blocks * 2);
+
   gcrypt_init();
 
-  gcry_error_t gcry_ret = gcry_cipher_open (&aes_ctr_cipher, GCRY_CIPHER, GCRY_CIPHER_MODE_CTR, 0);
-  die_on_error ("gcry_cipher_open", gcry_ret);
+  if (have_aesni())
+    {
+#ifdef RANDOM_HAVE_AESNI
+      aesni_expand_key (key.aes_key(), aes_round_keys);
+#endif
+    }
+  else
+    {
+      gcry_error_t gcry_ret = gcry_cipher_open (&aes_ctr_cipher, GCRY_CIPHER, GCRY_CIPHER_MODE_CTR, 0);
+      die_on_error ("gcry_cipher_open", gcry_ret);
 
-  gcry_ret = gcry_cipher_setkey (aes_ctr_cipher, key.aes_key(), Key::SIZE);
-  die_on_error ("gcry_cipher_setkey", gcry_ret);
+      gcry_ret = gcry_cipher_setkey (aes_ctr_cipher, key.aes_key(), Key::SIZE);
+      die_on_error ("gcry_cipher_setkey", gcry_ret);
+    }
 
-  gcry_ret = gcry_cipher_open (&seed_cipher, GCRY_CIPHER, GCRY_CIPHER_MODE_ECB, 0);
-  die_on_error ("gcry_cipher_open", gcry_ret);
+  seed (start_seed, stream);
+}
 
-  gcry_ret = gcry_cipher_setkey (seed_cipher, key.aes_key(), Key::SIZE);
-  die_on_error ("gcry_cipher_setkey", gcry_ret);
+void
+Random::encrypt_block (const unsigned char *plain_text, unsigned char *cipher_text)
+{
+#ifdef RANDOM_HAVE_AESNI
+  if (!aes_ctr_cipher)
+    {
+      aesni_encrypt_block (aes_round_keys, plain_text, cipher_text);
+      return;
+    }
+#endif
+  /* CTR mode with counter = plain_text applied to zeros is ECB encryption of plain_text */
+  gcry_error_t gcry_ret = gcry_cipher_setctr (aes_ctr_cipher, plain_text, Key::SIZE);
+  die_on_error ("gcry_cipher_setctr", gcry_ret);
 
-  seed (start_seed, stream);
+  memset (cipher_text, 0, Key::SIZE);
+  gcry_ret = gcry_cipher_encrypt (aes_ctr_cipher, cipher_text, Key::SIZE, nullptr, 0);
+  die_on_error ("gcry_cipher_encrypt", gcry_ret);
 }
 
 void
@@ -119,6 +250,7 @@ Random::seed (uint64_t seed, Stream stream)
 {
   buffer_pos = 0;
   buffer.clear();
+  batch_blocks = min_batch_blocks;
 
   unsigned char plain_text[Key::SIZE];
   unsigned char cipher_text[Key::SIZE];
@@ -128,37 +260,49 @@ Random::seed (uint64_t seed, Stream stream)
 
   plain_text[8] = uint8_t (stream);
 
-  gcry_error_t gcry_ret = gcry_cipher_encrypt (seed_cipher, &cipher_text[0], Key::SIZE,
-                                                            &plain_text[0],  Key::SIZE);
-  die_on_error ("gcry_cipher_encrypt", gcry_ret);
+  encrypt_block (plain_text, cipher_text);
 
-  gcry_ret = gcry_cipher_setctr (aes_ctr_cipher, &cipher_text[0], Key::SIZE);
-  die_on_error ("gcry_cipher_setctr", gcry_ret);
+  ctr_hi = uint64_from_buffer (&cipher_text[0]);
+  ctr_lo = uint64_from_buffer (&cipher_text[8]);
+
+  if (aes_ctr_cipher)
+    {
+      gcry_error_t gcry_ret = gcry_cipher_setctr (aes_ctr_cipher, &cipher_text[0], Key::SIZE);
+      die_on_error ("gcry_cipher_setctr", gcry_ret);
+    }
 }
 
 Random::~Random()
 {
-  gcry_cipher_close (aes_ctr_cipher);
-  gcry_cipher_close (seed_cipher);
+  if (aes_ctr_cipher)
+    gcry_cipher_close (aes_ctr_cipher);
 }
 
 void
 Random::refill_buffer()
 {
-  const size_t block_size = 256;
-  static unsigned char zeros[block_size] = { 0, };
-  unsigned char cipher_text[block_size];
+  const size_t n_blocks = batch_blocks;
 
-  gcry_error_t gcry_ret = gcry_cipher_encrypt (aes_ctr_cipher, cipher_text, block_size, zeros, block_size);
-  die_on_error ("gcry_cipher_encrypt", gcry_ret);
+  buffer.resize (n_blocks * 2);
+#ifdef RANDOM_HAVE_AESNI
+  if (!aes_ctr_cipher)
+    aesni_ctr_keystream (aes_round_keys, ctr_hi, ctr_lo, n_blocks, &buffer[0]);
+#endif
+  if (aes_ctr_cipher)
+    {
+      unsigned char cipher_text[max_batch_blocks * 16];
 
-  // print ("AES OUT", {cipher_text, cipher_text + block_size});
+      memset (cipher_text, 0, n_blocks * 16);
+      gcry_error_t gcry_ret = gcry_cipher_encrypt (aes_ctr_cipher, cipher_text, n_blocks * 16, nullptr, 0);
+      die_on_error ("gcry_cipher_encrypt", gcry_ret);
 
-  buffer.clear();
-  for (size_t i = 0; i < block_size; i += 8)
-    buffer.push_back (uint64_from_buffer (cipher_text + i));
+      // print ("AES OUT", {cipher_text, cipher_text + n_blocks * 16});
 
+      for (size_t i = 0; i < n_blocks * 2; i++)
+        buffer[i] = uint64_from_buffer (cipher_text + i * 8);
+    }
   buffer_pos = 0;
+  batch_blocks = std::min (batch_blocks * 2, max_batch_blocks);
 }
 
 void
@@ -185,6 +329,8 @@ Random::gen_key()
 uint64_t
 Random::seed_from_hash (const vector<float>& floats)
 {
+  gcrypt_init();
+
   unsigned char hash[20];
   gcry_md_hash_buffer (GCRY_MD_SHA1, hash, &floats[0], floats.size() * sizeof (float));
   return uint64_from_buffer (hash);
@@ -207,92 +353,6 @@ Key::set_test_key (uint64_t key)
   m_name = string_printf ("test-key-%" PRId64, key);
 }
 
-static bool
-string_chars (char ch)
-{
-  if ((ch >= 'A' && ch <= 'Z')
-  ||  (ch >= '0' && ch <= '9')
-  ||  (ch >= 'a' && ch <= 'z')
-  ||  (ch == '.')
-  ||  (ch == ':')
-  ||  (ch == '=')
-  ||  (ch == '/')
-  ||  (ch == '-')
-  ||  (ch == '_'))
-    return true;
-
-  return false;
-}
-
-static bool
-white_space (char ch)
-{
-  return (ch == ' ' || ch == '\n' || ch == '\t' || ch == '\r');
-}
-
-static bool
-tokenize (const string& line, vector<string>& tokens)
-{
-  enum { BLANK, STRING, QUOTED_STRING, QUOTED_STRING_ESCAPED, COMMENT } state = BLANK;
-  string s;
-
-  string xline = line + '\n';
-  tokens.clear();
-  for (string::const_iterator i = xline.begin(); i != xline.end(); i++)
-    {
-      if (state == BLANK && string_chars (*i))
-        {
-          state = STRING;
-          s += *i;
-        }
-      else if (state == BLANK && *i == '"')
-        {
-          state = QUOTED_STRING;
-        }
-      else if (state == BLANK && white_space (*i))
-        {
-          // ignore more whitespaces if we've already seen one
-        }
-      else if (state == STRING && string_chars (*i))
-        {
-          s += *i;
-        }
-      else if ((state == STRING && white_space (*i))
-           ||  (state == QUOTED_STRING && *i == '"'))
-        {
-          tokens.push_back (s);
-          s = "";
-          state = BLANK;
-        }
-      else if (state == QUOTED_STRING && *i == '\\')
-        {
-          state = QUOTED_STRING_ESCAPED;
-        }
-      else if (state == QUOTED_STRING)
-        {
-          s += *i;
-        }
-      else if (state == QUOTED_STRING_ESCAPED)
-        {
-          s += *i;
-          state = QUOTED_STRING;
-        }
-      else if (*i == '#')
-        {
-          state = COMMENT;
-        }
-      else if (state == COMMENT)
-        {
-          // ignore comments
-        }
-      else
-        {
-          return false;
-        }
-    }
-  return state == BLANK || state == COMMENT;
-}
-
 void
 Key::load_key (const string& key_file)
 {
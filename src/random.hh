@@ -53,11 +53,27 @@ public:
     frame_position = 6
   };
 private:
-  gcry_cipher_hd_t           aes_ctr_cipher = nullptr;
-  gcry_cipher_hd_t           seed_cipher = nullptr;
+  /*
+   * The random numbers are an AES-128 CTR keystream; the start value of the
+   * counter is AES (seed | stream), so reseeding costs one block encryption.
+   *
+   * The keystream is generated in batches, starting with min_batch_blocks
+   * after each seed, doubling up to max_batch_blocks. If the cpu supports
+   * AES-NI, the keystream is computed directly, otherwise libgcrypt is used.
+   */
+  static constexpr size_t    min_batch_blocks = 16;
+  static constexpr size_t    max_batch_blocks = 256;
+
+  alignas (16) unsigned char aes_round_keys[11 * 16];  // AES-NI only
+  gcry_cipher_hd_t           aes_ctr_cipher = nullptr; // libgcrypt fallback only
+  uint64_t                   ctr_hi = 0;
+  uint64_t                   ctr_lo = 0;
+  size_t                     batch_blocks = 0;
   std::vector<uint64_t>      buffer;
   size_t                     buffer_pos = 0;
 
+  void encrypt_block (const unsigned char *plain_text, unsigned char *cipher_text);
+
   std::uniform_real_distribution<double> double_dist;
 
   void die_on_error (const char *func, gcry_error_t error);
@@ -108,6 +124,9 @@ public:
 
   static std::string gen_key();
   static uint64_t    seed_from_hash (const std::vector<float>& floats);
+
+  /* testing only: use libgcrypt even if the cpu supports AES-NI (affects Random objects created later) */
+  static void        set_force_gcrypt (bool force);
 };
 
 #endif /* AUDIOWMARK_RANDOM_HH */
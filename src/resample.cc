@@ -20,6 +20,8 @@
 #include <assert.h>
 #include <math.h>
 
+#include "wmcommon.hh"
+
 #include <zita-resampler/resampler.h>
 #include <zita-resampler/vresampler.h>
 
@@ -27,7 +29,7 @@ using std::vector;
 
 template<class R>
 static void
-process_resampler (R& resampler, const vector<float>& in, vector<float>& out)
+process_resampler (R& resampler, const WavData::Samples& in, vector<float>& out)
 {
   resampler.out_count = out.size() / resampler.nchan();
   resampler.out_data = &out[0];
@@ -58,7 +60,7 @@ resample (const WavData& wav_data, int rate)
   const int hlen = 16;
   const double ratio = double (rate) / wav_data.sample_rate();
 
-  const vector<float>& in = wav_data.samples();
+  const WavData::Samples in = wav_data.samples();
   vector<float> out (lrint (in.size() / wav_data.n_channels() * ratio) * wav_data.n_channels());
 
   /* zita-resampler provides two resampling algorithms
@@ -76,14 +78,14 @@ resample (const WavData& wav_data, int rate)
   if (resampler.setup (wav_data.sample_rate(), rate, wav_data.n_channels(), hlen) == 0)
     {
       process_resampler (resampler, in, out);
-      return WavData (out, wav_data.n_channels(), rate, wav_data.bit_depth());
+      return WavData (std::move (out), wav_data.n_channels(), rate, wav_data.bit_depth());
     }
 
   VResampler vresampler;
   if (vresampler.setup (ratio, wav_data.n_channels(), hlen) == 0)
     {
       process_resampler (vresampler, in, out);
-      return WavData (out, wav_data.n_channels(), rate, wav_data.bit_depth());
+      return WavData (std::move (out), wav_data.n_channels(), rate, wav_data.bit_depth());
     }
   error ("audiowmark: resampling from rate %d to rate %d not supported.\n", wav_data.sample_rate(), rate);
   exit (1);
@@ -93,7 +95,7 @@ WavData
 resample_ratio (const WavData& wav_data, double ratio, int new_rate)
 {
   const int hlen = 16;
-  const vector<float>& in = wav_data.samples();
+  const WavData::Samples in = wav_data.samples();
   vector<float> out (lrint (in.size() / wav_data.n_channels() * ratio) * wav_data.n_channels());
 
   VResampler vresampler;
@@ -104,7 +106,176 @@ resample_ratio (const WavData& wav_data, double ratio, int new_rate)
     }
 
   process_resampler (vresampler, in, out);
-  return WavData (out, wav_data.n_channels(), new_rate, wav_data.bit_depth());
+  return WavData (std::move (out), wav_data.n_channels(), new_rate, wav_data.bit_depth());
 }
 
+template<class Resampler>
+class BufferedResamplerImpl : public ResamplerImpl
+{
+  const int     n_channels = 0;
+  const int     old_rate = 0;
+  const int     new_rate = 0;
+  bool          first_write = true;
+  Resampler     m_resampler;
+
+  vector<float> buffer;
+public:
+  BufferedResamplerImpl (int n_channels, int old_rate, int new_rate) :
+    n_channels (n_channels),
+    old_rate (old_rate),
+    new_rate (new_rate)
+  {
+  }
+  Resampler&
+  resampler()
+  {
+    return m_resampler;
+  }
+  size_t
+  skip (size_t zeros)
+  {
+    /* skipping a whole 1 second block should end in the same resampler state we had at the beginning */
+    size_t seconds = 0;
+    if (zeros >= Params::frame_size)
+      seconds = (zeros - Params::frame_size) / old_rate;
+
+    const size_t extra = new_rate * seconds;
+    zeros -= old_rate * seconds;
+
+    write_frames (vector<float> (zeros * n_channels));
+
+    size_t out = can_read_frames() + extra;
+    out -= out % Params::frame_size; /* always skip whole frames */
+    read_frames (out - extra);
+    return out;
+  }
+  void
+  write_frames (const vector<float>& frames)
+  {
+    if (first_write)
+      {
+        /* avoid timeshift: zita needs k/2 - 1 samples before the actual input */
+        m_resampler.inp_count = m_resampler.inpsize () / 2 - 1;
+        m_resampler.inp_data  = nullptr;
+
+        m_resampler.out_count = 1000000; // <- just needs to be large enough that all input is consumed
+        m_resampler.out_data  = nullptr;
+        m_resampler.process();
+
+        first_write = false;
+      }
+
+    uint start = 0;
+    while (start != frames.size() / n_channels)
+      {
+        const int out_count = Params::frame_size;
+        float out[out_count * n_channels];
 
+        m_resampler.out_count = out_count;
+        m_resampler.out_data  = out;
+
+        m_resampler.inp_count = frames.size() / n_channels - start;
+        m_resampler.inp_data  = const_cast<float *> (&frames[start * n_channels]);
+        m_resampler.process();
+
+        size_t count = out_count - m_resampler.out_count;
+        buffer.insert (buffer.end(), out, out + count * n_channels);
+
+        start = frames.size() / n_channels - m_resampler.inp_count;
+      }
+  }
+  vector<float>
+  read_frames (size_t frames)
+  {
+    assert (frames * n_channels <= buffer.size());
+    const auto begin = buffer.begin();
+    const auto end   = begin + frames * n_channels;
+    vector<float> result (begin, end);
+    buffer.erase (begin, end);
+    return result;
+  }
+  size_t
+  can_read_frames() const
+  {
+    return buffer.size() / n_channels;
+  }
+  void
+  flush()
+  {
+    /* zita needs k/2 samples after the actual input */
+    write_frames (vector<float> (m_resampler.inpsize() / 2 * n_channels));
+  }
+};
+
+ResamplerImpl *
+create_resampler (int n_channels, int old_rate, int new_rate)
+{
+  if (old_rate == new_rate)
+    {
+      return nullptr; // should not be using create_resampler for that case
+    }
+  else
+    {
+      /* zita-resampler provides two resampling algorithms
+       *
+       * a fast optimized version: Resampler
+       *   this is an optimized version, which works for many common cases,
+       *   like resampling between 22050, 32000, 44100, 48000, 96000 Hz
+       *
+       * a slower version: VResampler
+       *   this works for arbitary rates (like 33333 -> 44100 resampling)
+       *
+       * so we try using Resampler, and if that fails fall back to VResampler
+       */
+      const int hlen = 16;
+
+      auto resampler = new BufferedResamplerImpl<Resampler> (n_channels, old_rate, new_rate);
+      if (resampler->resampler().setup (old_rate, new_rate, n_channels, hlen) == 0)
+        {
+          return resampler;
+        }
+      else
+        delete resampler;
+
+      auto vresampler = new BufferedResamplerImpl<VResampler> (n_channels, old_rate, new_rate);
+      const double ratio = double (new_rate) / old_rate;
+      if (vresampler->resampler().setup (ratio, n_channels, hlen) == 0)
+        {
+          return vresampler;
+        }
+      else
+        {
+          error ("audiowmark: resampling from old_rate=%d to new_rate=%d not implemented\n", old_rate, new_rate);
+          delete vresampler;
+          return nullptr;
+        }
+    }
+}
+
+/* if create_resampler uses the fixed ratio Resampler for old_rate -> new_rate,
+ * the resampler phase repeats every period input frames; so two resamplers
+ * that start at a multiple of the period produce identical output (once the
+ * filter is filled with the same input)
+ *
+ * returns the period in input frames, or 0 if there is no such period
+ */
+size_t
+resampler_period (int old_rate, int new_rate)
+{
+  assert (old_rate != new_rate);
+
+  const int hlen = 16;
+
+  Resampler resampler;
+  if (resampler.setup (old_rate, new_rate, 1, hlen) != 0)
+    return 0;
+
+  int a = old_rate, b = new_rate;
+  while (b)
+    {
+      int t = a % b;
+      a = b;
+      b = t;
+    }
+  return old_rate / a;
+}
@@ -19,7 +19,9 @@
 #include "shortcode.hh"
 #include "wmcommon.hh"
 
+#include <array>
 #include <assert.h>
+#include <stdint.h>
 
 using std::vector;
 
@@ -86,6 +88,87 @@ static vector<vector<int>> gen_matrix;
 static size_t              gen_in_count = 0;
 static size_t              gen_out_count = 0;
 
+/* packed bit representation of a codeword (all codes have at most 128 bits) */
+typedef std::array<uint64_t, 2> CodeWord;
+
+static vector<CodeWord>    gen_rows;      /* packed generator matrix rows */
+static vector<CodeWord>    decode_masks;  /* message bit b = parity (codeword & decode_masks[b]) */
+
+static CodeWord
+pack_code_word (const vector<int>& bits)
+{
+  CodeWord w {};
+  for (size_t j = 0; j < bits.size(); j++)
+    if (bits[j])
+      w[j / 64] |= uint64_t (1) << (j % 64);
+  return w;
+}
+
+static void
+xor_code_word (CodeWord& a, const CodeWord& b)
+{
+  a[0] ^= b[0];
+  a[1] ^= b[1];
+}
+
+static bool
+code_word_bit (const CodeWord& w, size_t j)
+{
+  return (w[j / 64] >> (j % 64)) & 1;
+}
+
+static int
+code_word_parity (const CodeWord& w)
+{
+  return __builtin_parityll (w[0]) ^ __builtin_parityll (w[1]);
+}
+
+/* find an information set (gen_in_count independent columns of the generator
+ * matrix) using gauss-jordan elimination; the inverse of the generator matrix
+ * restricted to these columns maps a codeword back to the message bits
+ */
+static void
+init_decode_masks()
+{
+  vector<CodeWord> rows = gen_rows;
+  vector<uint32_t> transform;           /* rows[i] = xor of gen_rows[b] for all bits b in transform[i] */
+  vector<size_t>   pivot_col;
+
+  for (size_t i = 0; i < gen_in_count; i++)
+    transform.push_back (1 << i);
+
+  for (size_t col = 0; col < gen_out_count && pivot_col.size() < gen_in_count; col++)
+    {
+      const size_t rank = pivot_col.size();
+
+      size_t r = rank;
+      while (r < gen_in_count && !code_word_bit (rows[r], col))
+        r++;
+      if (r == gen_in_count)
+        continue;
+
+      std::swap (rows[r], rows[rank]);
+      std::swap (transform[r], transform[rank]);
+      for (size_t i = 0; i < gen_in_count; i++)
+        {
+          if (i != rank && code_word_bit (rows[i], col))
+            {
+              xor_code_word (rows[i], rows[rank]);
+              transform[i] ^= transform[rank];
+            }
+        }
+      pivot_col.push_back (col);
+    }
+  /* generator matrix must have full rank, otherwise codewords would not be unique */
+  assert (pivot_col.size() == gen_in_count);
+
+  decode_masks.assign (gen_in_count, CodeWord {});
+  for (size_t i = 0; i < gen_in_count; i++)
+    for (size_t b = 0; b < gen_in_count; b++)
+      if (transform[i] & (1 << b))
+        decode_masks[b][pivot_col[i] / 64] |= uint64_t (1) << (pivot_col[i] % 64);
+}
+
 size_t
 short_code_init (size_t k)
 {
@@ -111,6 +194,11 @@ short_code_init (size_t k)
     {
       return 0;
     }
+  gen_rows.clear();
+  for (const auto& row : gen_matrix)
+    gen_rows.push_back (pack_code_word (row));
+
+  init_decode_masks();
   return gen_out_count;
 }
 
@@ -169,46 +257,101 @@ short_code_size (ConvBlockType block_type, size_t msg_size)
   return conv_code_size (block_type, gen_out_count);
 }
 
+/* returns the message for a valid codeword, or an empty vector if coded_bits is not a codeword */
 vector<int>
 short_decode_blk (const vector<int>& coded_bits)
 {
+  assert (coded_bits.size() == gen_out_count);
+
+  const CodeWord coded = pack_code_word (coded_bits);
+
+  /* compute message bits from information set, then check by encoding the message again */
   vector<int> out_bits;
-  for (size_t c = 0; c < size_t (1 << gen_in_count); c++)
+  CodeWord    encoded {};
+  for (size_t bit = 0; bit < gen_in_count; bit++)
+    {
+      CodeWord masked = coded;
+      masked[0] &= decode_masks[bit][0];
+      masked[1] &= decode_masks[bit][1];
+
+      const int b = code_word_parity (masked);
+      if (b)
+        xor_code_word (encoded, gen_rows[bit]);
+      out_bits.push_back (b);
+    }
+  if (encoded != coded)
+    return {};
+
+  return out_bits;
+}
+
+/* soft decision maximum likelihood decoder: returns the message for the
+ * codeword c with the smallest squared error sum ((soft_bits[j] - c[j])^2)
+ *
+ * all 2^k codewords are enumerated in gray code order, so each codeword is
+ * obtained from the previous one by xoring a single generator row
+ */
+vector<int>
+short_decode_blk_soft (const vector<float>& soft_bits, float *error_out)
+{
+  assert (soft_bits.size() == gen_out_count);
+
+  /* error = const + sum of (1 - 2 * soft_bits[j]) for all bits j set in the codeword
+   *
+   * we precompute the sum for each byte of the codeword, for all 256 possible byte values
+   */
+  const size_t n_bytes = (gen_out_count + 7) / 8;
+  vector<float> byte_error (n_bytes * 256);
+  for (size_t byte = 0; byte < n_bytes; byte++)
     {
-      bool match = true;
-      for (size_t j = 0; j < gen_out_count; j++)
+      for (size_t value = 0; value < 256; value++)
         {
-          int x = 0;
-          for (size_t bit = 0; bit < gen_in_count; bit++)
-            {
-              if (c & (1 << bit))
-                {
-                  x ^= gen_matrix[bit][j];
-                }
-            }
-          if (coded_bits[j] != x)
+          float e = 0;
+          for (size_t i = 0; i < 8; i++)
             {
-              match = false;
-              break;
+              const size_t j = byte * 8 + i;
+              if ((value & (1 << i)) && j < gen_out_count)
+                e += 1 - 2 * soft_bits[j];
             }
+          byte_error[byte * 256 + value] = e;
         }
-      if (match)
+    }
+  float base_error = 0;
+  for (auto s : soft_bits)
+    base_error += s * s;
+
+  auto code_word_error = [&] (const CodeWord& w)
+    {
+      float e = base_error;
+      for (size_t byte = 0; byte < n_bytes; byte++)
+        e += byte_error[byte * 256 + ((w[byte / 8] >> (byte % 8 * 8)) & 0xff)];
+      return e;
+    };
+
+  CodeWord code_word {};
+  uint32_t gray = 0;
+  uint32_t best_msg = 0;
+  float    best_error = code_word_error (code_word);
+  for (uint32_t i = 1; i < (uint32_t (1) << gen_in_count); i++)
+    {
+      const int bit = __builtin_ctz (i);
+
+      gray ^= 1 << bit;
+      xor_code_word (code_word, gen_rows[bit]);
+
+      const float e = code_word_error (code_word);
+      if (e < best_error)
         {
-          for (size_t bit = 0; bit < gen_in_count; bit++)
-            {
-              if (c & (1 << bit))
-                {
-                  out_bits.push_back (1);
-                }
-              else
-                {
-                  out_bits.push_back (0);
-                }
-            }
-          return out_bits;
+          best_error = e;
+          best_msg = gray;
         }
     }
+  if (error_out)
+    *error_out = best_error / gen_out_count;
 
+  vector<int> out_bits;
+  for (size_t bit = 0; bit < gen_in_count; bit++)
+    out_bits.push_back ((best_msg >> bit) & 1);
   return out_bits;
 }
 
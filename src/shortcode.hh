@@ -33,6 +33,7 @@ std::vector<int> short_decode_soft (ConvBlockType block_type, const std::vector<
 
 std::vector<int> short_encode_blk (const std::vector<int>& in_bits);
 std::vector<int> short_decode_blk (const std::vector<int>& coded_bits);
+std::vector<int> short_decode_blk_soft (const std::vector<float>& soft_bits, float *error_out = nullptr);
 size_t           short_code_init (size_t k);
 
 #endif /* AUDIOWMARK_SHORT_CODE_HH */
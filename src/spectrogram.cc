@@ -0,0 +1,292 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+
+#include <math.h>
+
+#include "spectrogram.hh"
+
+using std::vector;
+using std::complex;
+using std::min;
+
+static constexpr size_t frames_per_chunk = 256;
+
+constexpr double Spectrogram::min_db;
+constexpr float  Spectrogram::compact_scale;
+
+/* 8 values, unaligned loads are allowed */
+typedef int16_t CompactVec __attribute__ ((vector_size (16), aligned (2), may_alias));
+typedef int32_t IntVec     __attribute__ ((vector_size (32)));
+typedef float   FloatVec   __attribute__ ((vector_size (32), aligned (4), may_alias));
+
+/*
+ * get all dB values of one frame ([channel][band - Params::min_band]), either
+ * directly or unpacked into buffer (which must have space for n_channels * n_bands
+ * values)
+ */
+const float *
+Spectrogram::Frames::frame_db (size_t frame, float *buffer) const
+{
+  const size_t n = n_channels * n_bands();
+  if (!compact)
+    return &db[frame * n];
+
+  const int16_t *in = &db_compact[frame * n];
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8)
+    {
+      IntVec v = __builtin_convertvector (*reinterpret_cast<const CompactVec *> (in + i), IntVec);
+      *reinterpret_cast<FloatVec *> (buffer + i) = __builtin_convertvector (v, FloatVec) * (1 / compact_scale);
+    }
+  for (; i < n; i++)
+    buffer[i] = in[i] * (1 / compact_scale);
+  return buffer;
+}
+
+Spectrogram::Spectrogram (ThreadPool& thread_pool, const PaddedWavData& wav_data) :
+  m_thread_pool (thread_pool),
+  m_wav_data (wav_data),
+  m_compact (Params::compact_spectrogram)
+{
+  const int    n_channels = wav_data.n_channels();
+  const size_t n_blocks = wav_data.n_frames() / energy_block_size;
+
+  m_block_energy.resize (n_blocks);
+  thread_pool.parallel_for (0, n_blocks, 1024, [&] (size_t b)
+    {
+      const size_t first = b * energy_block_size;
+      if (wav_data.is_padding (first, energy_block_size))
+        {
+          m_block_energy[b] = 0;
+          return;
+        }
+      vector<float> buffer;
+      const float *block = wav_data.frames (first, energy_block_size, buffer);
+      double energy = 0;
+      for (size_t i = 0; i < energy_block_size * n_channels; i++)
+        energy += double (block[i]) * block[i];
+      m_block_energy[b] = energy;
+    });
+}
+
+/* is the frame starting at index (in sample frames) silent? (then it is not transformed) */
+bool
+Spectrogram::skip_frame (size_t index) const
+{
+  const int    n_channels = m_wav_data.n_channels();
+  const size_t end = min (index + Params::frame_size, m_wav_data.n_frames());
+
+  /* full energy blocks [first_block, last_block), the rest is computed from the samples */
+  const size_t first_block = min ((index + energy_block_size - 1) / energy_block_size, m_block_energy.size());
+  const size_t last_block  = std::max (min (end / energy_block_size, m_block_energy.size()), first_block);
+
+  double energy = 0;
+  for (size_t b = first_block; b < last_block; b++)
+    energy += m_block_energy[b];
+
+  vector<float> buffer;
+  auto add_samples = [&] (size_t first, size_t last)
+    {
+      if (first >= last || m_wav_data.is_padding (first, last - first))
+        return;
+
+      const float *samples = m_wav_data.frames (first, last - first, buffer);
+      for (size_t i = 0; i < (last - first) * n_channels; i++)
+        energy += double (samples[i]) * samples[i];
+    };
+  if (first_block < last_block)
+    {
+      add_samples (index, first_block * energy_block_size);
+      add_samples (last_block * energy_block_size, end);
+    }
+  else
+    {
+      add_samples (index, end);
+    }
+  return silent_frame (energy, Params::frame_size * n_channels);
+}
+
+/* count the frames starting at first_index + n * frame_size (before last_index), and how many of them are silent */
+void
+Spectrogram::count_silent_frames (size_t first_index, size_t last_index, size_t *n_frames, size_t *n_silent) const
+{
+  *n_frames = 0;
+  *n_silent = 0;
+  for (size_t index = first_index; index < last_index && index + Params::frame_size <= m_wav_data.n_frames(); index += Params::frame_size)
+    {
+      *n_frames += 1;
+      *n_silent += skip_frame (index);
+    }
+}
+
+/* compute one chunk of frames for several shifts (the shifts share most input samples) */
+void
+Spectrogram::compute_chunk (const vector<size_t>& shifts, const vector<Frames *>& shift_frames, size_t chunk)
+{
+  FFTAnalyzer fft_analyzer (m_wav_data.n_channels());
+
+  const int    n_channels = m_wav_data.n_channels();
+  const size_t first = chunk * frames_per_chunk;
+  const size_t last  = first + frames_per_chunk;
+
+  vector<float> db_buffer (n_channels * n_bands());
+  Spectrum      spectrum = Spectrum::bands (n_channels);
+  vector<float> sample_buffer;
+
+  for (size_t f = first; f < last; f++)
+    {
+      for (size_t s = 0; s < shifts.size(); s++)
+        {
+          Frames& frames = *shift_frames[s];
+          if (f >= frames.n_frames)
+            continue;
+
+          const size_t index = shifts[s] + f * Params::frame_size;
+
+          float *out = frames.compact ? &db_buffer[0] : &frames.db[f * n_channels * n_bands()];
+          if (skip_frame (index))
+            {
+              std::fill (out, out + n_channels * n_bands(), min_db);
+            }
+          else
+            {
+              fft_analyzer.run_fft (m_wav_data.frames (index, Params::frame_size, sample_buffer), spectrum);
+
+              /* computing db-magnitude is expensive, so we better do it here */
+              for (int ch = 0; ch < n_channels; ch++)
+                {
+                  const complex<float> *bins = spectrum.bins (0, ch);
+                  for (size_t i = 0; i < n_bands(); i++)
+                    out[ch * n_bands() + i] = db_from_complex (bins[i], min_db);
+                }
+
+              frames.have_frames[f] = 1;
+            }
+          if (frames.compact)
+            {
+              int16_t *compact_out = &frames.db_compact[f * n_channels * n_bands()];
+              for (size_t i = 0; i < n_channels * n_bands(); i++)
+                compact_out[i] = lrint (std::max (std::min (out[i] * compact_scale, 32767.f), -32768.f));
+            }
+        }
+    }
+}
+
+Spectrogram::Frames&
+Spectrogram::shift_frames (size_t shift)
+{
+  assert (shift < Params::frame_size);
+
+  std::unique_ptr<Frames>& frames_ptr = m_frames[shift];
+  if (!frames_ptr)
+    {
+      const size_t n_wav_frames = m_wav_data.n_frames();
+
+      frames_ptr = std::make_unique<Frames>();
+      frames_ptr->n_frames   = n_wav_frames >= shift ? (n_wav_frames - shift) / Params::frame_size : 0;
+      frames_ptr->n_channels = m_wav_data.n_channels();
+      frames_ptr->compact    = m_compact;
+      if (m_compact)
+        frames_ptr->db_compact.resize (frames_ptr->n_frames * frames_ptr->n_channels * n_bands());
+      else
+        frames_ptr->db.resize (frames_ptr->n_frames * frames_ptr->n_channels * n_bands());
+      frames_ptr->have_frames.resize (frames_ptr->n_frames);
+      frames_ptr->chunk_done.resize ((frames_ptr->n_frames + frames_per_chunk - 1) / frames_per_chunk);
+    }
+  return *frames_ptr;
+}
+
+/* get all frames for one shift */
+const Spectrogram::Frames&
+Spectrogram::frames (size_t shift)
+{
+  return frames (shift, 0, m_wav_data.n_frames());
+}
+
+/* get frames for one shift, ensuring that [first_frame, first_frame + frame_count) is computed */
+const Spectrogram::Frames&
+Spectrogram::frames (size_t shift, size_t first_frame, size_t frame_count)
+{
+  Frames& frames = shift_frames (shift);
+
+  const size_t last_frame = min (first_frame + frame_count, frames.n_frames);
+  if (first_frame < last_frame)
+    {
+      vector<size_t> chunks;
+      for (size_t chunk = first_frame / frames_per_chunk; chunk * frames_per_chunk < last_frame; chunk++)
+        if (!frames.chunk_done[chunk])
+          chunks.push_back (chunk);
+
+      m_thread_pool.parallel_for (0, chunks.size(), 1, [&] (size_t i)
+        {
+          compute_chunk ({ shift }, { &frames }, chunks[i]);
+        });
+      for (auto chunk : chunks)
+        frames.chunk_done[chunk] = 1;
+    }
+  return frames;
+}
+
+/*
+ * compute all frames for several shifts in one pass over the input, which is
+ * faster than calling frames() for each shift, since the frames for different
+ * shifts overlap, so the input samples are only read once
+ */
+void
+Spectrogram::compute_shifts (const vector<size_t>& shifts)
+{
+  vector<Frames *> all_frames;
+  size_t           n_chunks = 0;
+  for (auto shift : shifts)
+    {
+      Frames& frames = shift_frames (shift);
+
+      all_frames.push_back (&frames);
+      n_chunks = std::max (n_chunks, frames.chunk_done.size());
+    }
+  m_thread_pool.parallel_for (0, n_chunks, 1, [&] (size_t chunk)
+    {
+      vector<size_t>   chunk_shifts;
+      vector<Frames *> chunk_frames;
+      for (size_t s = 0; s < shifts.size(); s++)
+        {
+          if (chunk < all_frames[s]->chunk_done.size() && !all_frames[s]->chunk_done[chunk])
+            {
+              chunk_shifts.push_back (shifts[s]);
+              chunk_frames.push_back (all_frames[s]);
+            }
+        }
+      compute_chunk (chunk_shifts, chunk_frames, chunk);
+    });
+  for (auto frames : all_frames)
+    std::fill (frames->chunk_done.begin(), frames->chunk_done.end(), 1);
+}
+
+/* free memory for all shifts that are not needed anymore */
+void
+Spectrogram::retain (const vector<size_t>& shifts)
+{
+  for (auto it = m_frames.begin(); it != m_frames.end();)
+    {
+      if (std::find (shifts.begin(), shifts.end(), it->first) == shifts.end())
+        it = m_frames.erase (it);
+      else
+        it++;
+    }
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIOWMARK_SPECTROGRAM_HH
+#define AUDIOWMARK_SPECTROGRAM_HH
+
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "wmcommon.hh"
+#include "threadpool.hh"
+
+/*
+ * The Spectrogram class stores the dB magnitudes of the watermark bands
+ * (Params::min_band .. Params::max_band) for the frames of one WavData
+ * (optionally with virtual zero padding, see PaddedWavData).
+ *
+ * Frames are Params::frame_size samples long and don't overlap, so the frames
+ * for one shift (0 <= shift < frame_size) can be used for every position
+ * index with (index % frame_size) == shift. The SyncFinder searches at a few
+ * fixed shifts, while BlockDecoder and ClipDecoder decode the data at the
+ * refined sync positions. Since blocks are a multiple of frame_size apart,
+ * typically all blocks of one file share the same shift, so each frame only
+ * needs to be transformed once.
+ *
+ * The frames are computed lazily in chunks (using the thread pool), so
+ * decoding a single block at an otherwise unused shift only transforms the
+ * frames of this block. The SyncFinder uses compute_shifts() to compute all
+ * search shifts in a single pass over the input.
+ *
+ * Frames which are silent (see silent_frame(): only zero samples, or a level
+ * below Params::silence_floor) are not transformed: have_frames is 0 for these
+ * frames, and the dB values are min_db, which is exactly what the FFT of zero
+ * samples would give. To find silent frames cheaply for any position, the
+ * constructor computes the energy of the input in blocks of energy_block_size
+ * sample frames once (blocks in the padding are known to be zero without
+ * reading them). This skips the ClipDecoder zero padding as well as digital
+ * silence within the input.
+ *
+ * If Params::compact_spectrogram is set, the dB values are stored as 16 bit
+ * fixed point values (1/64 dB steps) to halve the memory usage for long
+ * inputs. Since the rounding error is at most 1/128 dB, this doesn't change
+ * detection results in practice. Use db_value() or frame_db() to read the
+ * values, which works for both representations.
+ *
+ * A Spectrogram is not thread safe, it should only be used by one thread.
+ */
+class Spectrogram
+{
+public:
+  static constexpr double min_db = -96;
+
+  /* compact storage: dB values as 16 bit fixed point numbers with 1/64 dB resolution */
+  static constexpr float compact_scale = 64;
+
+  struct Frames
+  {
+    size_t               n_frames = 0;
+    int                  n_channels = 0;
+    bool                 compact = false;
+    std::vector<float>   db;          // [frame][channel][band - Params::min_band]
+    std::vector<int16_t> db_compact;  // same as db, for compact storage
+    std::vector<char>    have_frames; // 0: frame skipped (silence)
+    std::vector<char>    chunk_done;
+
+    float
+    db_value (size_t frame, int ch, int band) const
+    {
+      const size_t i = (frame * n_channels + ch) * n_bands() + band - Params::min_band;
+      return compact ? db_compact[i] * (1 / compact_scale) : db[i];
+    }
+    const float *frame_db (size_t frame, float *buffer) const;
+  };
+private:
+  ThreadPool&     m_thread_pool;
+  PaddedWavData   m_wav_data;
+
+  static constexpr size_t energy_block_size = 64;
+
+  std::vector<double> m_block_energy; // sum of squares of all samples in each energy block
+  bool            m_compact = false;
+
+  std::map<size_t, std::unique_ptr<Frames>> m_frames; // shift -> frames
+
+  Frames& shift_frames (size_t shift);
+  void    compute_chunk (const std::vector<size_t>& shifts, const std::vector<Frames *>& shift_frames, size_t chunk);
+public:
+  Spectrogram (ThreadPool& thread_pool, const PaddedWavData& wav_data);
+
+  const Frames& frames (size_t shift);
+  const Frames& frames (size_t shift, size_t first_frame, size_t frame_count);
+  void          compute_shifts (const std::vector<size_t>& shifts);
+  void          retain (const std::vector<size_t>& shifts);
+  bool          skip_frame (size_t index) const;
+  void          count_silent_frames (size_t first_index, size_t last_index, size_t *n_frames, size_t *n_silent) const;
+
+  const PaddedWavData& wav_data() const { return m_wav_data; }
+
+  static size_t
+  n_bands()
+  {
+    return Params::max_band - Params::min_band + 1;
+  }
+};
+
+#endif /* AUDIOWMARK_SPECTROGRAM_HH */
@@ -18,19 +18,40 @@
 #include <vector>
 #include <algorithm>
 
+#include <assert.h>
+#include <math.h>
+
 #include "syncfinder.hh"
 #include "threadpool.hh"
 #include "wmcommon.hh"
+#include "keyschedule.hh"
+#include "fft.hh"
 
 using std::complex;
 using std::vector;
 using std::string;
 using std::min;
 
-vector<vector<SyncFinder::FrameBit>>
-SyncFinder::get_sync_bits (const Key& key, const WavData& wav_data, Mode mode)
+constexpr size_t SyncFinder::sync_tile_size;
+
+/* 4 floats, unaligned loads from float arrays are allowed */
+typedef float SyncVec __attribute__ ((vector_size (16), aligned (4), may_alias));
+
+SyncFinder::SyncFinder (ThreadPool& thread_pool) :
+  thread_pool (thread_pool)
 {
-  vector<vector<SyncFinder::FrameBit>> sync_bits;
+}
+
+SyncFinder::SyncPattern
+SyncFinder::get_sync_pattern (const Key& key, int n_channels, Mode mode)
+{
+  struct FrameBit
+  {
+    int frame;
+    vector<int> up;
+    vector<int> down;
+  };
+  SyncPattern sync_pattern;
 
   // "long" blocks consist of two "normal" blocks, which means
   //   the sync bits pattern is repeated after the end of the first block
@@ -38,21 +59,20 @@ SyncFinder::get_sync_bits (const Key& key, const WavData& wav_data, Mode mode)
   const int block_count = mode == Mode::CLIP ? 2 : 1;
   size_t n_bands = Params::max_band - Params::min_band + 1;
 
-  UpDownGen up_down_gen (key, Random::Stream::sync_up_down);
-  BitPosGen bit_pos_gen (key);
+  auto key_schedule = KeySchedule::get (key);
   for (int bit = 0; bit < Params::sync_bits; bit++)
     {
       vector<FrameBit> frame_bits;
       for (int f = 0; f < Params::sync_frames_per_bit; f++)
         {
-          UpDownArray frame_up, frame_down;
-          up_down_gen.get (f + bit * Params::sync_frames_per_bit, frame_up, frame_down);
+          const UpDownArray& frame_up   = key_schedule->sync_up (f + bit * Params::sync_frames_per_bit);
+          const UpDownArray& frame_down = key_schedule->sync_down (f + bit * Params::sync_frames_per_bit);
 
           for (int block = 0; block < block_count; block++)
             {
               FrameBit frame_bit;
-              frame_bit.frame = bit_pos_gen.sync_frame (f + bit * Params::sync_frames_per_bit) + block * first_block_end;
-              for (int ch = 0; ch < wav_data.n_channels(); ch++)
+              frame_bit.frame = key_schedule->sync_frame (f + bit * Params::sync_frames_per_bit) + block * first_block_end;
+              for (int ch = 0; ch < n_channels; ch++)
                 {
                   if (block == 0)
                     {
@@ -75,9 +95,22 @@ SyncFinder::get_sync_bits (const Key& key, const WavData& wav_data, Mode mode)
             }
         }
       std::sort (frame_bits.begin(), frame_bits.end(), [] (FrameBit& f1, FrameBit& f2) { return f1.frame < f2.frame; });
-      sync_bits.push_back (frame_bits);
+
+      /* flatten */
+      sync_pattern.bit_start.push_back (sync_pattern.size());
+      for (const auto& frame_bit : frame_bits)
+        {
+          assert (frame_bit.up.size() == frame_bit.down.size());
+          sync_pattern.n_up_down = frame_bit.up.size();
+
+          sync_pattern.bit.push_back (bit);
+          sync_pattern.frame.push_back (frame_bit.frame);
+          sync_pattern.up.insert (sync_pattern.up.end(), frame_bit.up.begin(), frame_bit.up.end());
+          sync_pattern.down.insert (sync_pattern.down.end(), frame_bit.down.begin(), frame_bit.down.end());
+        }
     }
-  return sync_bits;
+  sync_pattern.bit_start.push_back (sync_pattern.size());
+  return sync_pattern;
 }
 
 /* safe to call from any thread */
@@ -117,35 +150,46 @@ SyncFinder::bit_quality (float umag, float dmag, int bit)
   return expect_data_bit ? raw_bit : -raw_bit;
 }
 
+/*
+ * computes the sync quality for start_frame
+ *
+ * fft_out_db must be 0 for frames we don't have, so the sums for each sync
+ * bit can be computed without checking have_frames for every frame
+ *
+ * safe to call from any thread
+ */
 double
-SyncFinder::sync_decode (const vector<vector<FrameBit>>& sync_bits,
-                         const WavData& wav_data, const size_t start_frame,
-                         const vector<float>& fft_out_db,
-                         const vector<char>&  have_frames,
+SyncFinder::sync_decode (const SyncPattern& sync_pattern, int n_channels, size_t start_frame,
+                         const vector<float>& fft_out_db, const vector<char>& have_frames,
                          ConvBlockType *block_type)
 {
   double sync_quality = 0;
 
-  size_t n_bands = Params::max_band - Params::min_band + 1;
+  const size_t n_bands   = Params::max_band - Params::min_band + 1;
+  const size_t row_size  = n_channels * n_bands;
+  const size_t n_up_down = sync_pattern.n_up_down;
+  const int   *frames    = &sync_pattern.frame[0];
+  const float *db        = &fft_out_db[start_frame * row_size];
+  const char  *have      = &have_frames[start_frame];
+
   int bit_count = 0;
-  for (size_t bit = 0; bit < sync_bits.size(); bit++)
+  for (size_t bit = 0; bit + 1 < sync_pattern.bit_start.size(); bit++)
     {
-      const vector<FrameBit>& frame_bits = sync_bits[bit];
       float umag = 0, dmag = 0;
 
       int frame_bit_count = 0;
-      for (const auto& frame_bit : frame_bits)
+      for (int e = sync_pattern.bit_start[bit]; e < sync_pattern.bit_start[bit + 1]; e++)
         {
-          if (have_frames[start_frame + frame_bit.frame])
+          const float *row  = db + frames[e] * row_size;
+          const int   *up   = &sync_pattern.up[e * n_up_down];
+          const int   *down = &sync_pattern.down[e * n_up_down];
+
+          for (size_t i = 0; i < n_up_down; i++)
             {
-              const int index = ((start_frame + frame_bit.frame) * wav_data.n_channels()) * n_bands;
-              for (size_t i = 0; i < frame_bit.up.size(); i++)
-                {
-                  umag += fft_out_db[index + frame_bit.up[i]];
-                  dmag += fft_out_db[index + frame_bit.down[i]];
-                }
-              frame_bit_count++;
+              umag += row[up[i]];
+              dmag += row[down[i]];
             }
+          frame_bit_count += have[frames[e]];
         }
       sync_quality += bit_quality (umag, dmag, bit) * frame_bit_count;
       bit_count += frame_bit_count;
@@ -166,71 +210,619 @@ SyncFinder::sync_decode (const vector<vector<FrameBit>>& sync_bits,
     }
 }
 
+/*
+ * computes the sync quality of one key for the start frames
+ *
+ *   [first_start_frame, first_start_frame + n_start_frames)
+ *
+ * this gives the same results as calling sync_decode() for each start frame,
+ * but band_db is expected in band-major order ([channel * n_bands + band][frame],
+ * with 0 for frames we don't have), so for each entry of the sync pattern the
+ * values for all start frames of the tile can be added in one contiguous loop
+ *
+ * band_db and have_frames must contain at least sync_tile_size columns after
+ * the last frame used by the sync pattern, have_count[col] is the number of
+ * frames we have before col
+ *
+ * the score for start frame s is stored in scores[s * score_stride]
+ */
 void
-SyncFinder::scan_silence (const WavData& wav_data)
+SyncFinder::sync_decode_tile (const SyncPattern& sync_pattern,
+                              const vector<float>& band_db, size_t n_cols,
+                              const vector<char>& have_frames,
+                              const vector<int>& have_count,
+                              size_t first_start_frame, size_t n_start_frames,
+                              size_t sync_shift, Score *scores, size_t score_stride)
 {
-  const vector<float>& samples = wav_data.samples();
+  assert (n_start_frames <= sync_tile_size);
+
+  double sync_quality[sync_tile_size] = { 0, };
+  int    bit_count[sync_tile_size] = { 0, };
 
-  // find first non-zero sample
-  wav_data_first = 0;
-  while (wav_data_first < samples.size() && samples[wav_data_first] == 0)
-    wav_data_first++;
+  const size_t n_up_down = sync_pattern.n_up_down;
+
+  for (size_t bit = 0; bit + 1 < sync_pattern.bit_start.size(); bit++)
+    {
+      const int e_start = sync_pattern.bit_start[bit];
+      const int e_end   = sync_pattern.bit_start[bit + 1];
 
-  // search wav_data_last to get [wav_data_first, wav_data_last) range
-  wav_data_last = samples.size();
-  while (wav_data_last > wav_data_first && samples[wav_data_last - 1] == 0)
-    wav_data_last--;
+      float umag[sync_tile_size];
+      float dmag[sync_tile_size];
+      int   frame_bit_count[sync_tile_size] = { 0, };
+
+      for (int e = e_start; e < e_end; e++)
+        {
+          /* always process a full tile (band_db is padded), so the compiler can vectorize the loop */
+          const char *have = &have_frames[first_start_frame + sync_pattern.frame[e]];
+          for (size_t s = 0; s < sync_tile_size; s++)
+            frame_bit_count[s] += have[s];
+        }
+      /* keep the sums for 16 start frames in registers while adding up the sync pattern */
+      for (size_t s = 0; s < sync_tile_size; s += 16)
+        {
+          SyncVec u0 = {}, u1 = {}, u2 = {}, u3 = {};
+          SyncVec d0 = {}, d1 = {}, d2 = {}, d3 = {};
+
+          for (int e = e_start; e < e_end; e++)
+            {
+              const size_t col = first_start_frame + sync_pattern.frame[e] + s;
+
+              /* skip silence (frames we don't have), the values would be 0 anyway */
+              if (have_count[col + 16] == have_count[col])
+                continue;
+
+              const int *up_rows   = &sync_pattern.up[e * n_up_down];
+              const int *down_rows = &sync_pattern.down[e * n_up_down];
+              for (size_t i = 0; i < n_up_down; i++)
+                {
+                  const SyncVec *up   = reinterpret_cast<const SyncVec *> (&band_db[up_rows[i] * n_cols + col]);
+                  const SyncVec *down = reinterpret_cast<const SyncVec *> (&band_db[down_rows[i] * n_cols + col]);
+                  u0 += up[0];
+                  u1 += up[1];
+                  u2 += up[2];
+                  u3 += up[3];
+                  d0 += down[0];
+                  d1 += down[1];
+                  d2 += down[2];
+                  d3 += down[3];
+                }
+            }
+          for (int j = 0; j < 4; j++)
+            {
+              umag[s + j]      = u0[j];
+              umag[s + j + 4]  = u1[j];
+              umag[s + j + 8]  = u2[j];
+              umag[s + j + 12] = u3[j];
+              dmag[s + j]      = d0[j];
+              dmag[s + j + 4]  = d1[j];
+              dmag[s + j + 8]  = d2[j];
+              dmag[s + j + 12] = d3[j];
+            }
+        }
+      for (size_t s = 0; s < n_start_frames; s++)
+        {
+          sync_quality[s] += bit_quality (umag[s], dmag[s], bit) * frame_bit_count[s];
+          bit_count[s] += frame_bit_count[s];
+        }
+    }
+  for (size_t s = 0; s < n_start_frames; s++)
+    {
+      double q = sync_quality[s];
+      if (bit_count[s])
+        q /= bit_count[s];
+      q = normalize_sync_quality (q);
+
+      Score& score = scores[s * score_stride];
+      score.index = (first_start_frame + s) * Params::frame_size + sync_shift;
+      if (q < 0)
+        {
+          score.block_type = ConvBlockType::b;
+          score.quality = -q;
+        }
+      else
+        {
+          score.block_type = ConvBlockType::a;
+          score.quality = q;
+        }
+    }
 }
 
 void
-SyncFinder::search_approx (vector<KeyResult>& key_results, const vector<vector<vector<FrameBit>>>& sync_bits, const WavData& wav_data, Mode mode)
+SyncFinder::search_approx_tile (vector<KeyResult>& key_results, const vector<SyncPattern>& sync_patterns, Spectrogram& spectrogram, Mode mode)
 {
-  ThreadPool    thread_pool;
-  vector<float> fft_db;
-  vector<char>  have_frames;
+  const PaddedWavData& wav_data = spectrogram.wav_data();
 
-  std::mutex result_mutex;
-  // compute multiple time-shifted fft vectors
-  size_t n_bands = Params::max_band - Params::min_band + 1;
   int total_frame_count = mark_sync_frame_count() + mark_data_frame_count();
   if (mode == Mode::CLIP)
     total_frame_count *= 2;
-  for (size_t sync_shift = 0; sync_shift < Params::frame_size; sync_shift += Params::sync_search_step)
+
+  /* use the same number of frames for all shifts (the last frame is incomplete for some shifts) */
+  const int n_search_frames = frame_count (wav_data) - 1;
+  const size_t n_start_frames = std::max (n_search_frames - total_frame_count, 0);
+  const size_t n_shifts = Params::frame_size / Params::sync_search_step;
+  const size_t n_rows = wav_data.n_channels() * Spectrogram::n_bands();
+  const size_t n_cols = n_search_frames + sync_tile_size; /* padding for the last tile */
+
+  if (!n_start_frames)
+    return;
+
+  for (auto& key_result : key_results)
+    key_result.sync_scores.resize (n_shifts * n_start_frames);
+
+  vector<float> band_db (n_rows * n_cols);
+  vector<char>  have_frames (n_cols);
+  vector<int>   have_count (n_cols + 1);
+
+  // use multiple time-shifted fft vectors
+  for (size_t shift_index = 0; shift_index < n_shifts; shift_index++)
     {
-      sync_fft_parallel (thread_pool, wav_data, sync_shift, fft_db, have_frames);
+      const size_t sync_shift = shift_index * Params::sync_search_step;
+      const Spectrogram::Frames& frames = spectrogram.frames (sync_shift);
 
-      vector<int> start_frames;
-      for (int start_frame = 0; start_frame < frame_count (wav_data); start_frame++)
+      /* transpose spectrogram to band-major order */
+      vector<float> db_buffer (n_rows);
+      for (size_t col = 0; col < size_t (n_search_frames); col++)
         {
-          if ((start_frame + total_frame_count) * wav_data.n_channels() * n_bands < fft_db.size())
-            start_frames.push_back (start_frame);
+          const float *frame_db = frames.frame_db (col, &db_buffer[0]);
+
+          have_frames[col] = frames.have_frames[col];
+          for (size_t row = 0; row < n_rows; row++)
+            band_db[row * n_cols + col] = have_frames[col] ? frame_db[row] : 0;
         }
+      for (size_t col = 0; col < n_cols; col++)
+        have_count[col + 1] = have_count[col] + have_frames[col];
 
-      for (size_t k = 0; k < key_results.size(); k++)
+      /* evaluate all keys for one tile of start frames, so the spectrogram data
+       * for the tile is still in the cache when the next key needs it
+       */
+      const size_t n_tiles = (n_start_frames + sync_tile_size - 1) / sync_tile_size;
+      thread_pool.parallel_for (0, n_tiles, 1, [&] (size_t tile)
         {
-          for (auto split_start_frames : split_vector (start_frames, 256))
+          const size_t first_start_frame = tile * sync_tile_size;
+          const size_t n = std::min (sync_tile_size, n_start_frames - first_start_frame);
+
+          for (size_t k = 0; k < key_results.size(); k++)
             {
-              thread_pool.add_job ([this, k, sync_shift, split_start_frames,
-                                    &sync_bits, &wav_data, &fft_db, &have_frames, &key_results, &result_mutex]()
+              Score *scores = &key_results[k].sync_scores[first_start_frame * n_shifts + shift_index];
+              sync_decode_tile (sync_patterns[k], band_db, n_cols, have_frames, have_count, first_start_frame, n, sync_shift, scores, n_shifts);
+            }
+        });
+    }
+}
+
+/*
+ * The SyncCorrelator computes the sync quality of one key for many start
+ * frames at once, by correlating the spectrogram with the sync pattern of the
+ * key along the time axis.
+ *
+ * For each sync bit, the sum of the up bands for start frame s is
+ *
+ *   umag (s) = sum (f, band) up_pattern (f, band) * db (s + f, band)
+ *
+ * where up_pattern (f, band) is 1 if band is an up band of frame f of this
+ * sync bit (0 otherwise) and db (frame, band) is the sum of the dB values of
+ * all channels (0 for frames we don't have). The same is true for dmag and for
+ * the number of frames we have (using a pattern that is 1 for each frame of the
+ * sync bit and a "have" signal instead of db). Since bit_quality() is not linear,
+ * these sums are computed for each sync bit separately.
+ *
+ * The correlations are computed blockwise with FFTs (overlap-save): one block
+ * of fft_size frames gives the results for step = fft_size - span + 1 start
+ * frames. For each bit, the spectra of the band signals are multiplied with the
+ * (precomputed) pattern spectra and summed over all bands, so only one inverse
+ * FFT per bit and up/down is necessary.
+ *
+ * In clip mode the pattern consists of two blocks, where the second block uses
+ * the same frames with up and down bands swapped, so
+ *
+ *   umag_clip (s) = umag (s) + dmag (s + first_block_end)
+ *
+ * To improve the precision of the float FFTs, a constant offset (the mean dB
+ * value) is subtracted from the spectrogram before the FFT and added back to
+ * the results.
+ */
+class SyncCorrelator
+{
+  const size_t n_bands = Spectrogram::n_bands();
+  const int    n_channels;
+  const bool   clip;
+  const size_t first_block_end;
+  const size_t span;
+
+  static size_t
+  fft_size_for_span (size_t span)
+  {
+    size_t fft_size = 1;
+    while (fft_size < 2 * span)
+      fft_size *= 2;
+    return fft_size;
+  }
+  /* stores a spectrum with separate real and imaginary parts */
+  void
+  store_spectrum (const float *fft_out, float scale, bool conjugate, float *spectrum) const
+  {
+    float *re = spectrum;
+    float *im = spectrum + n_bins_pad;
+
+    for (size_t i = 0; i < n_bins_pad; i++)
+      {
+        if (i < n_bins)
+          {
+            re[i] = fft_out[2 * i] * scale;
+            im[i] = fft_out[2 * i + 1] * (conjugate ? -scale : scale);
+          }
+        else
+          {
+            re[i] = im[i] = 0;
+          }
+      }
+  }
+public:
+  const size_t fft_size;
+  const size_t n_bins;
+  const size_t n_bins_pad;
+  const size_t spectrum_size;
+  const size_t step;
+
+  /* per key: for each sync bit: n_bands up spectra, n_bands down spectra, frame spectrum */
+  const size_t n_pattern_spectra = Params::sync_bits * (2 * n_bands + 1);
+  /* per block: n_bands band spectra, have spectrum */
+  const size_t n_data_spectra = n_bands + 1;
+
+  SyncCorrelator (int n_channels, SyncFinder::Mode mode) :
+    n_channels (n_channels),
+    clip (mode == SyncFinder::Mode::CLIP),
+    first_block_end (mark_sync_frame_count() + mark_data_frame_count()),
+    span (clip ? 2 * first_block_end : first_block_end),
+    fft_size (fft_size_for_span (span)),
+    n_bins (fft_size / 2 + 1),
+    n_bins_pad ((n_bins + 3) / 4 * 4),
+    spectrum_size (2 * n_bins_pad),
+    step (fft_size - span + 1)
+  {
+  }
+  void
+  pattern_spectra (const KeySchedule& key_schedule, int bit, float *spectra) const
+  {
+    FFTProcessor fft (fft_size);
+
+    vector<vector<int>> up_frames (n_bands);
+    vector<vector<int>> down_frames (n_bands);
+    vector<int>         frames;
+    for (int f = 0; f < Params::sync_frames_per_bit; f++)
+      {
+        const int index = f + bit * Params::sync_frames_per_bit;
+        const int frame = key_schedule.sync_frame (index);
+
+        for (auto u : key_schedule.sync_up (index))
+          up_frames[u - Params::min_band].push_back (frame);
+        for (auto d : key_schedule.sync_down (index))
+          down_frames[d - Params::min_band].push_back (frame);
+        frames.push_back (frame);
+      }
+    auto transform = [&] (const vector<int>& pattern_frames, float *spectrum)
+      {
+        std::fill (fft.in(), fft.in() + fft_size, 0);
+        for (auto frame : pattern_frames)
+          fft.in()[frame] = 1;
+        fft.fft();
+
+        /* correlation: multiply with conjugated spectrum, FFTW doesn't normalize */
+        store_spectrum (fft.out(), 1.0 / fft_size, true, spectrum);
+      };
+    float *bit_spectra = spectra + bit * (2 * n_bands + 1) * spectrum_size;
+    for (size_t band = 0; band < n_bands; band++)
+      {
+        transform (up_frames[band], bit_spectra + band * spectrum_size);
+        transform (down_frames[band], bit_spectra + (n_bands + band) * spectrum_size);
+      }
+    transform (frames, bit_spectra + 2 * n_bands * spectrum_size);
+  }
+  void
+  data_spectra (const Spectrogram::Frames& frames, size_t n_frames, size_t first_frame, float db_offset, float *spectra) const
+  {
+    FFTProcessor fft (fft_size);
+
+    /* collect band signals (frame-major spectrogram -> band-major block) */
+    vector<float> block ((n_bands + 1) * fft_size);
+    vector<float> db_buffer (n_channels * n_bands);
+    for (size_t t = 0; t < fft_size; t++)
+      {
+        const size_t frame = first_frame + t;
+
+        if (frame < n_frames && frames.have_frames[frame])
+          {
+            const float *frame_db = frames.frame_db (frame, &db_buffer[0]);
+            for (int ch = 0; ch < n_channels; ch++)
+              {
+                const float *db = frame_db + ch * n_bands;
+                for (size_t band = 0; band < n_bands; band++)
+                  block[band * fft_size + t] += db[band] - db_offset;
+              }
+            block[n_bands * fft_size + t] = 1;
+          }
+      }
+    for (size_t i = 0; i < n_data_spectra; i++)
+      {
+        std::copy_n (&block[i * fft_size], fft_size, fft.in());
+        fft.fft();
+        store_spectrum (fft.out(), 1, false, spectra + i * spectrum_size);
+      }
+  }
+  /*
+   * computes the scores for the start frames [first_frame, first_frame + n_start_frames),
+   * n_start_frames <= step, have_count[frame] is the number of frames we have before frame
+   *
+   * the score for start frame s is stored in scores[s * score_stride]
+   */
+  void
+  scores (const float *pattern_spectra, const float *data_spectra, const vector<int>& have_count,
+          size_t first_frame, size_t n_start_frames, float db_offset, size_t sync_shift,
+          SyncFinder::Score *scores, size_t score_stride) const
+  {
+    assert (n_start_frames <= step);
+
+    const size_t n_frames_used = n_start_frames - 1 + span;
+    const int    have = have_count[first_frame + n_frames_used] - have_count[first_frame];
+    if (!have)
+      {
+        /* silence: no frames, so all scores are zero */
+        for (size_t s = 0; s < n_start_frames; s++)
+          scores[s * score_stride] = SyncFinder::Score { (first_frame + s) * Params::frame_size + sync_shift, 0, ConvBlockType::a };
+        return;
+      }
+
+    /* results for start frames [first_frame, first_frame + n_start_frames + (clip ? first_block_end : 0)) */
+    const size_t n_out = n_start_frames + span - first_block_end;
+
+    FFTProcessor  fft (fft_size);
+    vector<float> acc (spectrum_size);
+    vector<float> umag (Params::sync_bits * n_out);
+    vector<float> dmag (Params::sync_bits * n_out);
+    vector<int>   frame_count (Params::sync_bits * n_out, Params::sync_frames_per_bit);
+
+    /* correlate n data spectra with n pattern spectra, and sum up the results */
+    auto correlate = [&] (const float *data, const float *pattern, size_t n, float *out)
+      {
+        std::fill (acc.begin(), acc.end(), 0);
+
+        SyncVec *acc_re = reinterpret_cast<SyncVec *> (&acc[0]);
+        SyncVec *acc_im = reinterpret_cast<SyncVec *> (&acc[n_bins_pad]);
+        for (size_t i = 0; i < n; i++)
+          {
+            const SyncVec *x_re = reinterpret_cast<const SyncVec *> (data + i * spectrum_size);
+            const SyncVec *x_im = reinterpret_cast<const SyncVec *> (data + i * spectrum_size + n_bins_pad);
+            const SyncVec *p_re = reinterpret_cast<const SyncVec *> (pattern + i * spectrum_size);
+            const SyncVec *p_im = reinterpret_cast<const SyncVec *> (pattern + i * spectrum_size + n_bins_pad);
+
+            for (size_t j = 0; j < n_bins_pad / 4; j++)
+              {
+                acc_re[j] += x_re[j] * p_re[j] - x_im[j] * p_im[j];
+                acc_im[j] += x_re[j] * p_im[j] + x_im[j] * p_re[j];
+              }
+          }
+        float *in = fft.in();
+        for (size_t i = 0; i < n_bins; i++)
+          {
+            in[2 * i]     = acc[i];
+            in[2 * i + 1] = acc[n_bins_pad + i];
+          }
+        fft.ifft();
+        std::copy_n (fft.out(), n_out, out);
+      };
+    const size_t bit_stride = (2 * n_bands + 1) * spectrum_size;
+    for (int bit = 0; bit < Params::sync_bits; bit++)
+      {
+        const float *bit_pattern = pattern_spectra + bit * bit_stride;
+
+        correlate (data_spectra, bit_pattern, n_bands, &umag[bit * n_out]);
+        correlate (data_spectra, bit_pattern + n_bands * spectrum_size, n_bands, &dmag[bit * n_out]);
+
+        /* count frames we have, unless all frames are available */
+        if (size_t (have) != n_frames_used)
+          {
+            vector<float> count (n_out);
+
+            correlate (data_spectra + n_bands * spectrum_size, bit_pattern + 2 * n_bands * spectrum_size, 1, &count[0]);
+            for (size_t s = 0; s < n_out; s++)
+              frame_count[bit * n_out + s] = lrint (count[s]);
+          }
+      }
+    for (size_t s = 0; s < n_start_frames; s++)
+      {
+        double sync_quality = 0;
+        int    bit_count = 0;
+
+        for (int bit = 0; bit < Params::sync_bits; bit++)
+          {
+            const size_t i = bit * n_out + s;
+
+            double u = umag[i];
+            double d = dmag[i];
+            int    n = frame_count[i];
+            if (clip)
+              {
+                u += dmag[i + first_block_end];
+                d += umag[i + first_block_end];
+                n += frame_count[i + first_block_end];
+              }
+            /* undo db_offset */
+            u += double (db_offset) * n * n_channels * Params::bands_per_frame;
+            d += double (db_offset) * n * n_channels * Params::bands_per_frame;
+
+            sync_quality += SyncFinder::bit_quality (u, d, bit) * n;
+            bit_count += n;
+          }
+        if (bit_count)
+          sync_quality /= bit_count;
+        sync_quality = SyncFinder::normalize_sync_quality (sync_quality);
+
+        SyncFinder::Score& score = scores[s * score_stride];
+        score.index = (first_frame + s) * Params::frame_size + sync_shift;
+        if (sync_quality < 0)
+          {
+            score.block_type = ConvBlockType::b;
+            score.quality = -sync_quality;
+          }
+        else
+          {
+            score.block_type = ConvBlockType::a;
+            score.quality = sync_quality;
+          }
+      }
+  }
+};
+
+void
+SyncFinder::search_approx_fft (vector<KeyResult>& key_results, Spectrogram& spectrogram, Mode mode)
+{
+  const PaddedWavData& wav_data = spectrogram.wav_data();
+
+  int total_frame_count = mark_sync_frame_count() + mark_data_frame_count();
+  if (mode == Mode::CLIP)
+    total_frame_count *= 2;
+
+  /* use the same number of frames for all shifts (the last frame is incomplete for some shifts) */
+  const int n_search_frames = frame_count (wav_data) - 1;
+  const size_t n_start_frames = std::max (n_search_frames - total_frame_count, 0);
+  const size_t n_shifts = Params::frame_size / Params::sync_search_step;
+
+  if (!n_start_frames)
+    return;
+
+  for (auto& key_result : key_results)
+    key_result.sync_scores.resize (n_shifts * n_start_frames);
+
+  const SyncCorrelator correlator (wav_data.n_channels(), mode);
+  const size_t         n_blocks = (n_start_frames + correlator.step - 1) / correlator.step;
+
+  /* the pattern spectra are large, so we only keep them for a group of keys at a time */
+  const size_t pattern_bytes = correlator.n_pattern_spectra * correlator.spectrum_size * sizeof (float);
+  const size_t group_size = std::max<size_t> (max_pattern_bytes / pattern_bytes, 1);
+
+  for (size_t first_key = 0; first_key < key_results.size(); first_key += group_size)
+    {
+      const size_t n_keys = std::min (group_size, key_results.size() - first_key);
+
+      vector<vector<float>> pattern_spectra (n_keys);
+      for (auto& spectra : pattern_spectra)
+        spectra.resize (correlator.n_pattern_spectra * correlator.spectrum_size);
+
+      thread_pool.parallel_for (0, n_keys * Params::sync_bits, 1, [&] (size_t i)
+        {
+          const size_t k   = i / Params::sync_bits;
+          const int    bit = i % Params::sync_bits;
+
+          auto key_schedule = KeySchedule::get (key_results[first_key + k].key);
+          correlator.pattern_spectra (*key_schedule, bit, &pattern_spectra[k][0]);
+        });
+
+      // use multiple time-shifted fft vectors
+      for (size_t shift_index = 0; shift_index < n_shifts; shift_index++)
+        {
+          const size_t sync_shift = shift_index * Params::sync_search_step;
+          const Spectrogram::Frames& frames = spectrogram.frames (sync_shift);
+
+          vector<int>   have_count (n_search_frames + 1);
+          vector<float> db_buffer (wav_data.n_channels() * Spectrogram::n_bands());
+          double        db_sum = 0;
+          for (int f = 0; f < n_search_frames; f++)
+            {
+              if (frames.have_frames[f])
                 {
-                  for (auto start_frame : split_start_frames)
-                    {
-                      ConvBlockType block_type;
-                      double quality = sync_decode (sync_bits[k], wav_data, start_frame, fft_db, have_frames, &block_type);
-                      // printf ("%zd %f\n", sync_index, quality);
-                      const size_t sync_index = start_frame * Params::frame_size + sync_shift;
-                      {
-                        std::lock_guard<std::mutex> lg (result_mutex);
-                        key_results[k].sync_scores.emplace_back (Score { sync_index, quality, block_type });
-                      }
-                    }
-                });
+                  const float *frame_db = frames.frame_db (f, &db_buffer[0]);
+                  for (size_t i = 0; i < db_buffer.size(); i++)
+                    db_sum += frame_db[i];
+                }
+              have_count[f + 1] = have_count[f] + frames.have_frames[f];
             }
+          const float db_offset = have_count.back() ? db_sum / (have_count.back() * wav_data.n_channels() * Spectrogram::n_bands()) : 0;
+
+          vector<float> data_spectra (n_blocks * correlator.n_data_spectra * correlator.spectrum_size);
+          thread_pool.parallel_for (0, n_blocks, 1, [&] (size_t block)
+            {
+              correlator.data_spectra (frames, n_search_frames, block * correlator.step, db_offset,
+                                       &data_spectra[block * correlator.n_data_spectra * correlator.spectrum_size]);
+            });
+
+          /* one index for each (key, block) combination */
+          thread_pool.parallel_for (0, n_keys * n_blocks, 1, [&] (size_t i)
+            {
+              const size_t k = i / n_blocks;
+              const size_t block = i % n_blocks;
+              const size_t first_frame = block * correlator.step;
+              const size_t n = std::min (correlator.step, n_start_frames - first_frame);
+
+              Score *scores = &key_results[first_key + k].sync_scores[first_frame * n_shifts + shift_index];
+              correlator.scores (&pattern_spectra[k][0],
+                                 &data_spectra[block * correlator.n_data_spectra * correlator.spectrum_size],
+                                 have_count, first_frame, n, db_offset, sync_shift, scores, n_shifts);
+            });
         }
-      thread_pool.wait_all();
     }
-  for (auto& key_result : key_results)
-    sort (key_result.sync_scores.begin(), key_result.sync_scores.end(), [] (const Score& a, const Score &b) { return a.index < b.index; });
+}
+
+/*
+ * The SyncCorrelator computes the pattern spectra for each key, which only
+ * pays off if there are enough start frames to search. So we estimate the
+ * number of float operations per key for both ways to compute the sync scores.
+ *
+ * Since sync_decode_tile() skips frames we don't have, the estimate takes into
+ * account how much of the input is silence (the ClipDecoder zero padding).
+ */
+static bool
+use_sync_correlator (Spectrogram& spectrogram, SyncFinder::Mode mode)
+{
+  const PaddedWavData& wav_data = spectrogram.wav_data();
+  const int      block_count = mode == SyncFinder::Mode::CLIP ? 2 : 1;
+  const int      total_frame_count = (mark_sync_frame_count() + mark_data_frame_count()) * block_count;
+  const int      n_search_frames = frame_count (wav_data) - 1;
+  const size_t   n_start_frames = std::max (n_search_frames - total_frame_count, 0);
+  const size_t   n_shifts = Params::frame_size / Params::sync_search_step;
+
+  if (!n_start_frames)
+    return false;
+
+  const Spectrogram::Frames& frames = spectrogram.frames (0);
+  const int n_have = std::count (frames.have_frames.begin(), frames.have_frames.begin() + n_search_frames, 1);
+  const double have_fraction = std::min (double (n_have) / total_frame_count, 1.0);
+
+  const double tile_ops = double (n_shifts) * n_start_frames * have_fraction *
+                          Params::sync_bits * Params::sync_frames_per_bit * block_count *
+                          wav_data.n_channels() * 2 * Params::bands_per_frame;
+
+  const SyncCorrelator correlator (wav_data.n_channels(), mode);
+  const size_t n_blocks = (n_start_frames + correlator.step - 1) / correlator.step;
+  const double fft_ops = 2.5 * correlator.fft_size * log2 (correlator.fft_size);
+  const double block_ops = 2 * Params::sync_bits * (Spectrogram::n_bands() * correlator.n_bins * 8 + fft_ops);
+  const double correlator_ops = correlator.n_pattern_spectra * fft_ops + double (n_shifts) * n_blocks * block_ops;
+
+  return correlator_ops < tile_ops;
+}
+
+void
+SyncFinder::search_approx (vector<KeyResult>& key_results, const vector<SyncPattern>& sync_patterns, Spectrogram& spectrogram, Mode mode)
+{
+  int total_frame_count = mark_sync_frame_count() + mark_data_frame_count();
+  if (mode == Mode::CLIP)
+    total_frame_count *= 2;
+
+  /* input too short: no start frames to search */
+  if (frame_count (spectrogram.wav_data()) - 1 <= total_frame_count)
+    return;
+
+  /* compute the spectrogram for all shifts in one pass */
+  vector<size_t> sync_shifts;
+  for (size_t shift = 0; shift < Params::frame_size; shift += Params::sync_search_step)
+    sync_shifts.push_back (shift);
+  spectrogram.compute_shifts (sync_shifts);
+
+  /* scores are stored as [start_frame][shift], so they are already sorted by index */
+  const bool use_fft = engine == Engine::AUTO ? use_sync_correlator (spectrogram, mode) : engine == Engine::FFT;
+  if (use_fft)
+    search_approx_fft (key_results, spectrogram, mode);
+  else
+    search_approx_tile (key_results, sync_patterns, spectrogram, mode);
 }
 
 void
@@ -275,15 +867,243 @@ SyncFinder::sync_select_n_best (vector<Score>& sync_scores, size_t n)
   std::sort (sync_scores.begin(), sync_scores.end(), [](Score& s1, Score& s2) { return s1.quality > s2.quality; });
   if (sync_scores.size() > n)
     sync_scores.resize (n);
+
+  /* keep the selected scores ordered by index (like sync_select_by_threshold does) */
+  std::sort (sync_scores.begin(), sync_scores.end(), [](Score& s1, Score& s2) { return s1.index < s2.index; });
 }
 
+/*
+ * computes the spectra of the wanted frames for the fine positions of
+ * search_refine, which are Params::sync_search_fine samples apart
+ *
+ * Instead of running one FFT per frame for each position, the DFT bins
+ * [min_band - 1, max_band + 1] of the unwindowed frame are updated using a
+ * sliding DFT: moving a frame by n samples subtracts the n samples that leave
+ * the frame, adds the n samples that enter it and rotates the phase of each
+ * bin. The analysis window is a von Hann window
+ *
+ *   w[i] = c * (0.5 - 0.5 * cos (2 * pi * i / frame_size))
+ *
+ * so the windowed bins can be computed from three neighbouring bins
+ *
+ *   X[k] = c * (0.5 * R[k] - 0.25 * R[k - 1] - 0.25 * R[k + 1])
+ *
+ * The sliding state is kept in double precision, and it is initialized with
+ * one FFT whenever a frame has no state for the previous position. Silent
+ * frames (see Spectrogram::skip_frame()) are not computed at all.
+ */
+class SyncRefineSpectrum
+{
+  static constexpr size_t hop = Params::sync_search_fine;
+  static constexpr int    first_bin = Params::min_band - 1;
+  static constexpr size_t n_bins = Params::max_band - Params::min_band + 3;
+
+  const Spectrogram&   spectrogram;
+  const PaddedWavData& wav_data;
+  const int            n_channels;
+  const size_t         frame_count;
+  FFTProcessor         fft_processor;
+  double               window_scale = 0;
+
+  vector<int>         frame_slot;    // frame -> state slot, -1 for frames not wanted
+  vector<double>      bins_re;       // [slot][channel][bin]
+  vector<double>      bins_im;
+  vector<int>         non_zero;      // [slot][channel] non-zero samples with window weight > 0
+  vector<char>        valid;         // [slot] state matches m_index
+  vector<double>      hop_re;        // [j][bin] e^(-2 pi i * bin * j / frame_size)
+  vector<double>      hop_im;
+  vector<double>      rotate_re;     // [bin] e^(2 pi i * bin * hop / frame_size)
+  vector<double>      rotate_im;
+  vector<float>       sample_buffer; // samples which overlap the padding
+  size_t              m_index = 0;
+
+  void
+  init_state (size_t slot, size_t index)
+  {
+    const float *samples = wav_data.frames (index, Params::frame_size, sample_buffer);
+    float *in = fft_processor.in();
+    const float *out = fft_processor.out();
+
+    for (int ch = 0; ch < n_channels; ch++)
+      {
+        const size_t s = slot * n_channels + ch;
+        int nz = 0;
+        for (size_t x = 0; x < Params::frame_size; x++)
+          {
+            in[x] = samples[x * n_channels + ch];
+            if (x > 0 && in[x] != 0)
+              nz++;
+          }
+        fft_processor.fft();
+        for (size_t b = 0; b < n_bins; b++)
+          {
+            bins_re[s * n_bins + b] = out[2 * (first_bin + b)];
+            bins_im[s * n_bins + b] = out[2 * (first_bin + b) + 1];
+          }
+        non_zero[s] = nz;
+      }
+  }
+  void
+  advance_state (size_t slot, size_t index)
+  {
+    /* index is the old frame position, samples starts there */
+    const float *samples = wav_data.frames (index, Params::frame_size + hop, sample_buffer);
+
+    for (int ch = 0; ch < n_channels; ch++)
+      {
+        const size_t s = slot * n_channels + ch;
+        double *re = &bins_re[s * n_bins];
+        double *im = &bins_im[s * n_bins];
+        int nz = non_zero[s];
+
+        for (size_t j = 0; j < hop; j++)
+          {
+            const float old_value = samples[j * n_channels + ch];
+            const float new_value = samples[(Params::frame_size + j) * n_channels + ch];
+
+            /* the first sample of the window has weight 0, so it is not counted */
+            nz -= (samples[(1 + j) * n_channels + ch] != 0);
+            nz += (new_value != 0);
+
+            const double delta = double (new_value) - double (old_value);
+            if (delta != 0)
+              {
+                const double *tw_re = &hop_re[j * n_bins];
+                const double *tw_im = &hop_im[j * n_bins];
+                for (size_t b = 0; b < n_bins; b++)
+                  {
+                    re[b] += delta * tw_re[b];
+                    im[b] += delta * tw_im[b];
+                  }
+              }
+          }
+        non_zero[s] = nz;
+        if (nz == 0)
+          {
+            /* avoid accumulated rounding errors for silent frames */
+            std::fill (re, re + n_bins, 0);
+            std::fill (im, im + n_bins, 0);
+          }
+        else
+          {
+            for (size_t b = 0; b < n_bins; b++)
+              {
+                const double r = re[b] * rotate_re[b] - im[b] * rotate_im[b];
+                const double i = re[b] * rotate_im[b] + im[b] * rotate_re[b];
+                re[b] = r;
+                im[b] = i;
+              }
+          }
+      }
+  }
+public:
+  SyncRefineSpectrum (const Spectrogram& spectrogram, size_t frame_count, const vector<char>& want_frames) :
+    spectrogram (spectrogram),
+    wav_data (spectrogram.wav_data()),
+    n_channels (wav_data.n_channels()),
+    frame_count (frame_count),
+    fft_processor (Params::frame_size)
+  {
+    vector<float> window = FFTAnalyzer::gen_normalized_window (Params::frame_size);
+    window_scale = window[Params::frame_size / 2];
+
+    size_t n_slots = 0;
+    frame_slot.resize (frame_count, -1);
+    for (size_t f = 0; f < frame_count; f++)
+      if (want_frames[f])
+        frame_slot[f] = n_slots++;
+
+    bins_re.resize (n_slots * n_channels * n_bins);
+    bins_im.resize (n_slots * n_channels * n_bins);
+    non_zero.resize (n_slots * n_channels);
+    valid.resize (n_slots);
+
+    hop_re.resize (hop * n_bins);
+    hop_im.resize (hop * n_bins);
+    rotate_re.resize (n_bins);
+    rotate_im.resize (n_bins);
+    for (size_t b = 0; b < n_bins; b++)
+      {
+        const double w = 2 * M_PI * (first_bin + b) / Params::frame_size;
+        for (size_t j = 0; j < hop; j++)
+          {
+            hop_re[j * n_bins + b] = cos (w * j);
+            hop_im[j * n_bins + b] = -sin (w * j);
+          }
+        rotate_re[b] = cos (w * hop);
+        rotate_im[b] = sin (w * hop);
+      }
+  }
+  /* computes the dB spectrum of the wanted frames at index, fastest if index increases by hop between calls */
+  void
+  compute (size_t index, vector<float>& fft_out_db, vector<char>& have_frames)
+  {
+    fft_out_db.clear();
+    have_frames.clear();
+
+    /* read past end? -> fail */
+    if (wav_data.n_values() < (index + frame_count * Params::frame_size) * n_channels)
+      {
+        std::fill (valid.begin(), valid.end(), 0);
+        return;
+      }
+
+    const size_t n_bands = Params::max_band - Params::min_band + 1;
+    const bool   sliding = index == m_index + hop;
+
+    fft_out_db.resize (n_channels * n_bands * frame_count);
+    have_frames.resize (frame_count);
+
+    for (size_t f = 0; f < frame_count; f++)
+      {
+        const int slot = frame_slot[f];
+        if (slot < 0)
+          continue;
+
+        const size_t f_index = index + f * Params::frame_size;
+        if (spectrogram.skip_frame (f_index))
+          {
+            valid[slot] = 0;
+            continue;
+          }
+        if (sliding && valid[slot])
+          advance_state (slot, f_index - hop);
+        else
+          init_state (slot, f_index);
+        valid[slot] = 1;
+
+        constexpr double min_db = -96;
+
+        float *out = &fft_out_db[f * n_channels * n_bands];
+        for (int ch = 0; ch < n_channels; ch++)
+          {
+            const size_t s = slot * n_channels + ch;
+            if (non_zero[s] == 0)
+              {
+                std::fill (out, out + n_bands, min_db);
+                out += n_bands;
+                continue;
+              }
+            const double *re = &bins_re[s * n_bins];
+            const double *im = &bins_im[s * n_bins];
+            for (size_t b = 0; b < n_bands; b++)
+              {
+                const double wre = window_scale * (0.5 * re[b + 1] - 0.25 * (re[b] + re[b + 2]));
+                const double wim = window_scale * (0.5 * im[b + 1] - 0.25 * (im[b] + im[b + 2]));
+                *out++ = db_from_complex (wre, wim, min_db);
+              }
+          }
+        have_frames[f] = 1;
+      }
+    m_index = index;
+  }
+};
+
 void
-SyncFinder::search_refine (const WavData& wav_data, Mode mode, KeyResult& key_result, const vector<vector<FrameBit>>& sync_bits)
+SyncFinder::search_refine (const Spectrogram& spectrogram, Mode mode, KeyResult& key_result, const SyncPattern& sync_pattern)
 {
-  ThreadPool    thread_pool;
-  std::mutex    result_mutex;
-  vector<Score> result_scores;
-  BitPosGen     bit_pos_gen (key_result.key);
+  const PaddedWavData& wav_data = spectrogram.wav_data();
+  auto key_schedule = KeySchedule::get (key_result.key);
 
   int total_frame_count = mark_sync_frame_count() + mark_data_frame_count();
   const int first_block_end = total_frame_count;
@@ -293,57 +1113,73 @@ SyncFinder::search_refine (const WavData& wav_data, Mode mode, KeyResult& key_re
   vector<char> want_frames (total_frame_count);
   for (size_t f = 0; f < mark_sync_frame_count(); f++)
     {
-      want_frames[bit_pos_gen.sync_frame (f)] = 1;
+      want_frames[key_schedule->sync_frame (f)] = 1;
       if (mode == Mode::CLIP)
-        want_frames[first_block_end + bit_pos_gen.sync_frame (f)] = 1;
+        want_frames[first_block_end + key_schedule->sync_frame (f)] = 1;
     }
 
-  for (const auto& score : key_result.sync_scores)
+  /*
+   * each job stores its result in refined_scores[i], so no locking is needed
+   *
+   * sync_select_by_threshold returns the candidates ordered by index and at
+   * least 2 * sync_search_step apart; in clip mode, sync_select_n_best selects
+   * the best candidates by quality, but sorts the selection by index again
+   *
+   * so refining each candidate by at most sync_search_step keeps the
+   * candidates ordered, and the result needs no sorting
+   */
+  vector<Score> refined_scores (key_result.sync_scores.size());
+  vector<char>  refined_ok (key_result.sync_scores.size());
+
+  thread_pool.parallel_for (0, key_result.sync_scores.size(), 1, [&] (size_t i)
     {
-      thread_pool.add_job ([this, score, total_frame_count,
-                            &wav_data, &want_frames, &sync_bits, &result_scores, &result_mutex] ()
+      const Score& score = key_result.sync_scores[i];
+
+      SyncRefineSpectrum refine_spectrum (spectrogram, total_frame_count, want_frames);
+      vector<float> fft_db;
+      vector<char>  have_frames;
+      //printf ("%zd %s %f", score.index, find_closest_sync (score.index).c_str(), score.quality);
+
+      // refine match
+      double best_quality       = score.quality;
+      size_t best_index         = score.index;
+      ConvBlockType best_block_type = score.block_type; /* doesn't really change during refinement */
+
+      int start = std::max (int (score.index) - Params::sync_search_step, 0);
+      int end   = score.index + Params::sync_search_step;
+      for (int fine_index = start; fine_index <= end; fine_index += Params::sync_search_fine)
         {
-          vector<float> fft_db;
-          vector<char>  have_frames;
-          //printf ("%zd %s %f", score.index, find_closest_sync (score.index).c_str(), score.quality);
-
-          // refine match
-          double best_quality       = score.quality;
-          size_t best_index         = score.index;
-          ConvBlockType best_block_type = score.block_type; /* doesn't really change during refinement */
-
-          int start = std::max (int (score.index) - Params::sync_search_step, 0);
-          int end   = score.index + Params::sync_search_step;
-          for (int fine_index = start; fine_index <= end; fine_index += Params::sync_search_fine)
+          refine_spectrum.compute (fine_index, fft_db, have_frames);
+          if (fft_db.size())
             {
-              sync_fft (wav_data, fine_index, total_frame_count, fft_db, have_frames, want_frames);
-              if (fft_db.size())
-                {
-                  ConvBlockType block_type;
-                  double        q = sync_decode (sync_bits, wav_data, 0, fft_db, have_frames, &block_type);
+              ConvBlockType block_type;
+              double        q = sync_decode (sync_pattern, wav_data.n_channels(), 0, fft_db, have_frames, &block_type);
 
-                  if (q > best_quality)
-                    {
-                      best_quality = q;
-                      best_index   = fine_index;
-                    }
+              if (q > best_quality)
+                {
+                  best_quality = q;
+                  best_index   = fine_index;
                 }
             }
-          //printf (" => refined: %zd %s %f\n", best_index, find_closest_sync (best_index).c_str(), best_quality);
-          if (best_quality > Params::sync_threshold2)
-            {
-              std::lock_guard<std::mutex> lg (result_mutex);
-              result_scores.push_back (Score { best_index, best_quality, best_block_type });
-            }
-        });
-    }
-  thread_pool.wait_all();
-  sort (result_scores.begin(), result_scores.end(), [] (const Score& a, const Score &b) { return a.index < b.index; });
-  key_result.sync_scores = result_scores;
+        }
+      //printf (" => refined: %zd %s %f\n", best_index, find_closest_sync (best_index).c_str(), best_quality);
+      if (best_quality > Params::sync_threshold2)
+        {
+          refined_scores[i] = Score { best_index, best_quality, best_block_type };
+          refined_ok[i]     = 1;
+        }
+    });
+  key_result.sync_scores.clear();
+  for (size_t i = 0; i < refined_scores.size(); i++)
+    if (refined_ok[i])
+      key_result.sync_scores.push_back (refined_scores[i]);
+
+  assert (std::is_sorted (key_result.sync_scores.begin(), key_result.sync_scores.end(),
+                          [] (const Score& s1, const Score& s2) { return s1.index < s2.index; }));
 }
 
 vector<SyncFinder::KeyResult>
-SyncFinder::fake_sync (const vector<Key>& key_list, const WavData& wav_data, Mode mode)
+SyncFinder::fake_sync (const vector<Key>& key_list, const PaddedWavData& wav_data, Mode mode)
 {
   vector<Score> result_scores;
 
@@ -370,35 +1206,25 @@ SyncFinder::fake_sync (const vector<Key>& key_list, const WavData& wav_data, Mod
 }
 
 vector<SyncFinder::KeyResult>
-SyncFinder::search (const vector<Key>& key_list, const WavData& wav_data, Mode mode)
+SyncFinder::search (const vector<Key>& key_list, Spectrogram& spectrogram, Mode mode)
 {
+  const PaddedWavData& wav_data = spectrogram.wav_data();
+
   if (Params::test_no_sync)
     return fake_sync (key_list, wav_data, mode);
 
-  if (mode == Mode::CLIP)
-    {
-      /* in clip mode we optimize handling large areas of padding which is silent */
-      scan_silence (wav_data);
-    }
-  else
-    {
-      /* in block mode we don't do anything special for silence at beginning/end */
-      wav_data_first = 0;
-      wav_data_last  = wav_data.samples().size();
-    }
-
   vector<KeyResult>                 key_results;
-  vector<vector<vector<FrameBit>>>  sync_bits;
+  vector<SyncPattern>               sync_patterns;
 
   for (const auto& key : key_list)
     {
       KeyResult key_result;
       key_result.key = key;
       key_results.push_back (key_result);
-      sync_bits.push_back (get_sync_bits (key, wav_data, mode));
+      sync_patterns.push_back (get_sync_pattern (key, wav_data.n_channels(), mode));
     }
 
-  search_approx (key_results, sync_bits, wav_data, mode);
+  search_approx (key_results, sync_patterns, spectrogram, mode);
   for (size_t k = 0; k < key_results.size(); k++)
     {
       /* find local maxima, select by threshold */
@@ -406,107 +1232,41 @@ SyncFinder::search (const vector<Key>& key_list, const WavData& wav_data, Mode m
       if (mode == Mode::CLIP)
         sync_select_n_best (key_results[k].sync_scores, 5);
 
-      search_refine (wav_data, mode, key_results[k], sync_bits[k]);
+      search_refine (spectrogram, mode, key_results[k], sync_patterns[k]);
     }
 
+  /* only keep spectrogram data which the decoders need */
+  vector<size_t> decode_shifts;
+  for (const auto& key_result : key_results)
+    for (const auto& score : key_result.sync_scores)
+      decode_shifts.push_back (score.index % Params::frame_size);
+  spectrogram.retain (decode_shifts);
+
   return key_results;
 }
 
-void
-SyncFinder::sync_fft (const WavData& wav_data, size_t index, size_t frame_count, vector<float>& fft_out_db, vector<char>& have_frames, const vector<char>& want_frames)
+/* sync scores for all start frames (before selecting and refining the candidates), for testing */
+vector<SyncFinder::KeyResult>
+SyncFinder::search_approx_scores (const vector<Key>& key_list, Spectrogram& spectrogram, Mode mode)
 {
-  fft_out_db.clear();
-  have_frames.clear();
-
-  /* read past end? -> fail */
-  if (wav_data.n_values() < (index + frame_count * Params::frame_size) * wav_data.n_channels())
-    return;
+  vector<KeyResult>   key_results;
+  vector<SyncPattern> sync_patterns;
 
-  FFTAnalyzer fft_analyzer (wav_data.n_channels());
-  const vector<float>& samples = wav_data.samples();
-  const size_t n_bands = Params::max_band - Params::min_band + 1;
-  int out_pos = 0;
-
-  fft_out_db.resize (wav_data.n_channels() * n_bands * frame_count);
-  have_frames.resize (frame_count);
-
-  for (size_t f = 0; f < frame_count; f++)
+  for (const auto& key : key_list)
     {
-      const size_t f_first = (index + f * Params::frame_size) * wav_data.n_channels();
-      const size_t f_last  = (index + (f + 1) * Params::frame_size) * wav_data.n_channels();
-
-      if ((want_frames.size() && !want_frames[f])   // frame not wanted?
-      ||  (f_last < wav_data_first)                 // frame in silence before input?
-      ||  (f_first > wav_data_last))                // frame in silence after input?
-        {
-          out_pos += n_bands * wav_data.n_channels();
-        }
-      else
-        {
-          constexpr double min_db = -96;
-
-          vector<vector<complex<float>>> frame_result = fft_analyzer.run_fft (samples, index + f * Params::frame_size);
-
-          /* computing db-magnitude is expensive, so we better do it here */
-          for (int ch = 0; ch < wav_data.n_channels(); ch++)
-            for (int i = Params::min_band; i <= Params::max_band; i++)
-              fft_out_db[out_pos++] = db_from_complex (frame_result[ch][i], min_db);
-
-          have_frames[f] = 1;
-        }
+      KeyResult key_result;
+      key_result.key = key;
+      key_results.push_back (key_result);
+      sync_patterns.push_back (get_sync_pattern (key, spectrogram.wav_data().n_channels(), mode));
     }
+  search_approx (key_results, sync_patterns, spectrogram, mode);
+  return key_results;
 }
 
 void
-SyncFinder::sync_fft_parallel (ThreadPool& thread_pool,
-                               const WavData& wav_data,
-                               size_t index,
-                               std::vector<float>& fft_out_db,
-                               std::vector<char>& have_frames)
+SyncFinder::set_engine (Engine new_engine)
 {
-  std::mutex result_mutex;
-
-  fft_out_db.clear();
-  have_frames.clear();
-
-  struct PartialFFTResult
-  {
-    int           start_frame = 0;
-    vector<char>  have_frames;
-    vector<float> fft_db;
-  };
-  vector<PartialFFTResult> partial_fft_results;
-  const int frames_per_job = 256;
-  for (int start_frame = 0; start_frame < frame_count (wav_data); start_frame += frames_per_job)
-    {
-      thread_pool.add_job ([this, start_frame, index, frames_per_job,
-                            &wav_data, &partial_fft_results, &result_mutex]
-        {
-          const int remaining_frames = frame_count (wav_data) - 1 - start_frame;
-          const int frames = std::min (remaining_frames, frames_per_job);
-          if (frames > 0)
-            {
-              PartialFFTResult result;
-              result.start_frame = start_frame;
-              sync_fft (wav_data, index + start_frame * Params::frame_size, frames, result.fft_db, result.have_frames, /* want all frames */ {});
-              if (!result.fft_db.size())
-                warning ("SyncFinder: sync_fft_parallel expected %d fft frames, but result was empty\n", frames);
-              {
-                std::lock_guard<std::mutex> lg (result_mutex);
-                partial_fft_results.push_back (result);
-              }
-            }
-        });
-    }
-  thread_pool.wait_all();
-  std::sort (partial_fft_results.begin(), partial_fft_results.end(),
-             [] (const auto& r1, const auto& r2) { return r1.start_frame < r2.start_frame; });
-
-  for (const auto& partial_fft_result : partial_fft_results)
-    {
-      fft_out_db.insert (fft_out_db.end(), partial_fft_result.fft_db.begin(), partial_fft_result.fft_db.end());
-      have_frames.insert (have_frames.end(), partial_fft_result.have_frames.begin(), partial_fft_result.have_frames.end());
-    }
+  engine = new_engine;
 }
 
 string
@@ -528,15 +1288,3 @@ SyncFinder::find_closest_sync (size_t index)
     }
   return string_printf ("n:%d offset:%d", best, int (index) - (wm_offset + best * wm_length));
 }
-
-vector<vector<int>>
-SyncFinder::split_vector (vector<int>& in_vector, size_t max_size)
-{
-  /* split input vector into smaller vectors of at most max_size elements */
-  vector<vector<int>> result;
-  size_t size = in_vector.size();
-
-  for (size_t i = 0; i < size; i += max_size)
-    result.emplace_back (in_vector.begin() + i, in_vector.begin() + i + min (size - i, max_size));
-  return result;
-}
@@ -22,6 +22,7 @@
 #include "wavdata.hh"
 #include "random.hh"
 #include "threadpool.hh"
+#include "spectrogram.hh"
 
 /*
  * The SyncFinder class searches for sync bits in an input WavData. It is used
@@ -34,19 +35,30 @@
  * locations are later refined with search_refine using sync_search_fine=8 as
  * stepping.
  *
+ * The spectrogram for search_approx is provided by the caller (see Spectrogram),
+ * so that BlockDecoder and ClipDecoder can reuse it for decoding the data bits.
+ *
+ * For long inputs, search_approx doesn't decode each start frame separately,
+ * but computes the sync quality for all start frames at once using FFT based
+ * correlation of the spectrogram with the sync pattern (see SyncCorrelator).
+ * If more than one key is used, the spectra of the spectrogram are shared
+ * between all keys. For short inputs (like the zero padded input of the
+ * ClipDecoder) computing the pattern spectra is too expensive, so the sync
+ * quality is computed by sync_decode_tile for a few start frames at a time.
+ *
  * BlockDecoder and ClipDecoder have similar but not identical needs, so
  * both use this class, using either Mode::BLOCK or Mode::CLIP.
  *
  * BlockDecoder (Mode::BLOCK)
  *  - search for full A or full B blocks
  *  - select candidates by threshold(s) only
- *  - zero samples are not treated any special
  *
  * ClipDecoder (Mode::CLIP)
  *  - search for AB block (one A block followed by one B block) or BA block
  *  - select candidates by threshold, but only keep at most the 5 best matches
- *  - zero samples at beginning/end don't affect the score returned by sync_decode
- *  - zero samples at beginning/end don't cost much cpu time (no fft performed)
+ *
+ * In both modes, silent frames (see Spectrogram) don't affect the score returned
+ * by sync_decode, and they don't cost much cpu time (no fft performed).
  *
  * The ClipDecoder will always use a big amount of zero padding at the beginning
  * and end to be able to find "partial" AB blocks, where most of the data is
@@ -68,16 +80,39 @@ class SyncFinder
 public:
   enum class Mode { BLOCK, CLIP };
 
+  /* how search_approx computes the sync scores (AUTO: estimate which one is faster) */
+  enum class Engine { AUTO, TILE, FFT };
+
   struct Score {
     size_t        index;
     double        quality;
     ConvBlockType block_type;
   };
-  struct FrameBit
+  /*
+   * sync pattern of one key, stored as structure of arrays
+   *
+   * the entries for sync bit b are [bit_start[b], bit_start[b + 1]), sorted by
+   * frame; entry e belongs to sync bit bit[e] and frame frame[e], and sums up
+   * the bands
+   *
+   *   up[e * n_up_down + i], down[e * n_up_down + i]    (0 <= i < n_up_down)
+   *
+   * which are offsets into the spectrogram row of the frame (channel * n_bands + band)
+   */
+  struct SyncPattern
   {
-    int frame;
+    size_t           n_up_down = 0;
+    std::vector<int> bit_start;
+    std::vector<int> bit;
+    std::vector<int> frame;
     std::vector<int> up;
     std::vector<int> down;
+
+    size_t
+    size() const
+    {
+      return frame.size();
+    }
   };
   struct KeyResult
   {
@@ -85,41 +120,42 @@ public:
     std::vector<Score> sync_scores;
   };
 private:
-  double  sync_decode (const std::vector<std::vector<FrameBit>>& sync_bits,
-                       const WavData& wav_data, const size_t start_frame,
-                       const std::vector<float>& fft_out_db,
-                       const std::vector<char>&  have_frames,
-                       ConvBlockType *block_type);
-  void scan_silence (const WavData& wav_data);
-  void search_approx (std::vector<KeyResult>& key_results, const std::vector<std::vector<std::vector<FrameBit>>>& sync_bits, const WavData& wav_data, Mode mode);
+  ThreadPool& thread_pool;
+  Engine      engine = Engine::AUTO;
+
+  static constexpr size_t sync_tile_size = 64;
+
+  void sync_decode_tile (const SyncPattern& sync_pattern,
+                         const std::vector<float>& band_db, size_t n_cols,
+                         const std::vector<char>& have_frames,
+                         const std::vector<int>& have_count,
+                         size_t first_start_frame, size_t n_start_frames,
+                         size_t sync_shift, Score *scores, size_t score_stride);
+  /* memory used for the sync pattern spectra of a group of keys in search_approx_fft */
+  static constexpr size_t max_pattern_bytes = 256 * 1024 * 1024;
+
+  void search_approx (std::vector<KeyResult>& key_results, const std::vector<SyncPattern>& sync_patterns, Spectrogram& spectrogram, Mode mode);
+  void search_approx_tile (std::vector<KeyResult>& key_results, const std::vector<SyncPattern>& sync_patterns, Spectrogram& spectrogram, Mode mode);
+  void search_approx_fft (std::vector<KeyResult>& key_results, Spectrogram& spectrogram, Mode mode);
   void sync_select_by_threshold (std::vector<Score>& sync_scores);
   void sync_select_n_best (std::vector<Score>& sync_scores, size_t n);
-  void search_refine (const WavData& wav_data, Mode mode, KeyResult& key_result, const std::vector<std::vector<FrameBit>>& sync_bits);
-  std::vector<KeyResult> fake_sync (const std::vector<Key>& key_list, const WavData& wav_data, Mode mode);
-
-  // non-zero sample range: [wav_data_first, wav_data_last)
-  size_t wav_data_first = 0;
-  size_t wav_data_last = 0;
+  void search_refine (const Spectrogram& spectrogram, Mode mode, KeyResult& key_result, const SyncPattern& sync_pattern);
+  std::vector<KeyResult> fake_sync (const std::vector<Key>& key_list, const PaddedWavData& wav_data, Mode mode);
 public:
-  std::vector<KeyResult> search (const std::vector<Key>& key_list, const WavData& wav_data, Mode mode);
-  static std::vector<std::vector<FrameBit>> get_sync_bits (const Key& key, const WavData& wav_data, Mode mode);
+  SyncFinder (ThreadPool& thread_pool);
+
+  std::vector<KeyResult> search (const std::vector<Key>& key_list, Spectrogram& spectrogram, Mode mode);
+  std::vector<KeyResult> search_approx_scores (const std::vector<Key>& key_list, Spectrogram& spectrogram, Mode mode);
+  void                   set_engine (Engine engine);
+  static SyncPattern get_sync_pattern (const Key& key, int n_channels, Mode mode);
+  static double sync_decode (const SyncPattern& sync_pattern, int n_channels, size_t start_frame,
+                             const std::vector<float>& fft_out_db, const std::vector<char>& have_frames,
+                             ConvBlockType *block_type);
 
   static double bit_quality (float umag, float dmag, int bit);
   static double normalize_sync_quality (double raw_quality);
 private:
-  void sync_fft_parallel (ThreadPool& thread_pool,
-                          const WavData& wav_data,
-                          size_t index,
-                          std::vector<float>& fft_out_db,
-                          std::vector<char>& have_frames);
-  void sync_fft (const WavData& wav_data,
-                 size_t index,
-                 size_t frame_count,
-                 std::vector<float>& fft_out_db,
-                 std::vector<char>& have_frames,
-                 const std::vector<char>& want_frames);
   std::string find_closest_sync (size_t index);
-  std::vector<std::vector<int>> split_vector (std::vector<int>& in_vector, size_t max_size);
 };
 
 #endif
@@ -209,6 +209,29 @@ main (int argc, char **argv)
         }
       printf ("%.1f ms/block\n", (get_time() - start_t) / runs * 1000.0);
     }
+  if (argc == 3 && string (argv[2]) == "perf-soft")
+    {
+      vector<int> in_bits;
+      while (in_bits.size() != 128)
+        in_bits.push_back (rand() & 1);
+
+      std::default_random_engine generator;
+      std::normal_distribution<double> dist (0, 0.5);
+
+      vector<float> recv_bits;
+      for (auto b : conv_encode (block_type, in_bits))
+        recv_bits.push_back (b + dist (generator));
+
+      const double start_t = get_time();
+      const size_t runs = 20;
+      float error = 0;
+      for (size_t i = 0; i < runs; i++)
+        {
+          vector<int> out_bits = conv_decode_soft (block_type, recv_bits, &error);
+          assert (out_bits.size() == in_bits.size());
+        }
+      printf ("%.1f ms/block (error %f)\n", (get_time() - start_t) / runs * 1000.0, error);
+    }
   if (argc == 3 && string (argv[2]) == "table")
     conv_print_table (block_type);
 }
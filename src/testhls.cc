@@ -127,7 +127,7 @@ mark_zexpand (const Key& key, WavData& wav_data, size_t zero_frames, const strin
   if (rc != 0)
     return rc;
 
-  wav_data.set_samples (wav_data_out.samples());
+  wav_data = wav_data_out;
 
   return 0;
 }
@@ -144,7 +144,7 @@ test_seek (const Key& key, const string& in, const string& out, int pos, const s
       return 1;
     }
 
-  samples = wav_data.samples();
+  samples.assign (wav_data.samples().begin(), wav_data.samples().end());
   samples.erase (samples.begin(), samples.begin() + pos * wav_data.n_channels());
   wav_data.set_samples (samples);
 
@@ -154,7 +154,7 @@ test_seek (const Key& key, const string& in, const string& out, int pos, const s
       return rc;
     }
 
-  samples = wav_data.samples();
+  samples.assign (wav_data.samples().begin(), wav_data.samples().end());
   samples.insert (samples.begin(), pos * wav_data.n_channels(), 0);
   wav_data.set_samples (samples);
 
@@ -23,6 +23,67 @@
 using std::vector;
 using std::string;
 
+/* reference implementation: AES-128 CTR keystream computed by libgcrypt */
+static vector<uint64_t>
+gcrypt_stream (const Key& key, uint64_t seed, Random::Stream stream, size_t n_values)
+{
+  gcry_cipher_hd_t ecb, ctr;
+  gcry_cipher_open (&ecb, GCRY_CIPHER_AES128, GCRY_CIPHER_MODE_ECB, 0);
+  gcry_cipher_open (&ctr, GCRY_CIPHER_AES128, GCRY_CIPHER_MODE_CTR, 0);
+  gcry_cipher_setkey (ecb, key.aes_key(), Key::SIZE);
+  gcry_cipher_setkey (ctr, key.aes_key(), Key::SIZE);
+
+  unsigned char block[Key::SIZE] = { 0, };
+  for (int i = 0; i < 8; i++)
+    block[i] = seed >> (56 - 8 * i);
+  block[8] = uint8_t (stream);
+  gcry_cipher_encrypt (ecb, block, Key::SIZE, nullptr, 0);
+  gcry_cipher_setctr (ctr, block, Key::SIZE);
+
+  vector<unsigned char> bytes (n_values * 8);
+  gcry_cipher_encrypt (ctr, bytes.data(), bytes.size(), nullptr, 0);
+  gcry_cipher_close (ecb);
+  gcry_cipher_close (ctr);
+
+  vector<uint64_t> result;
+  for (size_t i = 0; i < bytes.size(); i += 8)
+    {
+      uint64_t u = 0;
+      for (int b = 0; b < 8; b++)
+        u = (u << 8) + bytes[i + b];
+      result.push_back (u);
+    }
+  return result;
+}
+
+static bool
+check_reference (const char *path)
+{
+  Key key;
+  key.set_test_key (42);
+
+  for (uint64_t seed : { uint64_t (0), uint64_t (1), uint64_t (0xf00f1234b00b5678U), UINT64_MAX })
+    {
+      for (size_t n_values : { 1, 31, 32, 33, 100, 5000 })
+        {
+          Random rng (key, 0, Random::Stream::mix);
+          rng();
+          rng.seed (seed, Random::Stream::speed_clip); /* reseeding must restart the stream */
+
+          vector<uint64_t> ref = gcrypt_stream (key, seed, Random::Stream::speed_clip, n_values);
+          for (size_t i = 0; i < n_values; i++)
+            {
+              if (rng() != ref[i])
+                {
+                  printf ("reference check failed (%s): seed=%016" PRIx64 " n_values=%zd i=%zd\n", path, seed, n_values, i);
+                  return false;
+                }
+            }
+        }
+    }
+  return true;
+}
+
 int
 main (int argc, char **argv)
 {
@@ -36,6 +97,14 @@ main (int argc, char **argv)
   for (size_t i = 0; i < 20; i++)
     printf ("%f\n", rng.random_double());
 
+  /* both implementations must produce the same keystream */
+  if (!check_reference ("default"))
+    return 1;
+  Random::set_force_gcrypt (true);
+  if (!check_reference ("libgcrypt"))
+    return 1;
+  Random::set_force_gcrypt (false);
+
   uint64_t s = 0;
   double t_start = get_time();
   size_t runs = 25000000;
@@ -47,4 +116,38 @@ main (int argc, char **argv)
   printf ("s=%016" PRIx64 "\n\n", s);
 
   printf ("%f Mvalues/sec\n", runs / (t_end - t_start) / 1000000);
+  printf ("%f MB/sec\n", runs * sizeof (uint64_t) / (t_end - t_start) / (1024 * 1024));
+
+  /* typical reseed pattern (UpDownGen): one reseed followed by a few values */
+  t_start = get_time();
+  size_t reseeds = 1000000;
+  for (size_t i = 0; i < reseeds; i++)
+    {
+      rng.seed (i, Random::Stream::data_up_down);
+      for (size_t j = 0; j < 30; j++)
+        s += rng();
+    }
+  t_end = get_time();
+  printf ("s=%016" PRIx64 "\n\n", s);
+
+  printf ("%f Mreseeds/sec (30 values per seed)\n", reseeds / (t_end - t_start) / 1000000);
+
+  t_start = get_time();
+  for (size_t i = 0; i < reseeds; i++)
+    rng.seed (i, Random::Stream::data_up_down);
+  t_end = get_time();
+
+  printf ("%f Mreseeds/sec (no values)\n", reseeds / (t_end - t_start) / 1000000);
+
+  t_start = get_time();
+  size_t constructs = 100000;
+  for (size_t i = 0; i < constructs; i++)
+    {
+      Random crng (key, i, Random::Stream::data_up_down);
+      s += crng();
+    }
+  t_end = get_time();
+  printf ("s=%016" PRIx64 "\n\n", s);
+
+  printf ("%f Mconstructs/sec (1 value per object)\n", constructs / (t_end - t_start) / 1000000);
 }
@@ -138,6 +138,50 @@ main (int argc, char **argv)
           assert (out_bits == in_bits);
         }
       printf ("%.1f ms/block\n", (gettime() - start_t) / runs * 1000.0);
+
+      /* throughput for corrupted blocks (which are not codewords) */
+      const size_t bad_runs = 100000;
+      vector<vector<int>> bad_blocks;
+      for (size_t i = 0; i < 100; i++)
+        {
+          vector<int> in_bits;
+          while (in_bits.size() != K)
+            in_bits.push_back (rand() & 1);
+
+          vector<int> coded_bits = short_encode_blk (in_bits);
+          coded_bits[rand() % N] ^= 1;
+          bad_blocks.push_back (coded_bits);
+        }
+      const double bad_start_t = gettime();
+      for (size_t i = 0; i < bad_runs; i++)
+        {
+          vector<int> out_bits = short_decode_blk (bad_blocks[i % bad_blocks.size()]);
+          assert (out_bits.empty());
+        }
+      printf ("%.0f blocks/s (non-codewords)\n", bad_runs / (gettime() - bad_start_t));
+    }
+  if (argc == 3 && string (argv[2]) == "perf-soft")
+    {
+      const double start_t = gettime();
+      const size_t runs = 20;
+      for (size_t i = 0; i < runs; i++)
+        {
+          vector<int> in_bits;
+          while (in_bits.size() != K)
+            in_bits.push_back (rand() & 1);
+
+          vector<int>   error_bits = generate_error_vector (N, 5);
+          vector<float> soft_bits;
+          for (auto b : short_encode_blk (in_bits))
+            soft_bits.push_back (b ? 0.75 : 0.25);
+          for (size_t j = 0; j < N; j++)
+            if (error_bits[j])
+              soft_bits[j] = 1 - soft_bits[j];
+
+          vector<int> out_bits = short_decode_blk_soft (soft_bits);
+          assert (out_bits == in_bits);
+        }
+      printf ("%.1f ms/block\n", (gettime() - start_t) / runs * 1000.0);
     }
   if (argc == 3 && string (argv[2]) == "table")
     {
@@ -0,0 +1,288 @@
+/*
+ * Copyright (C) 2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <math.h>
+
+#include <random>
+
+#include "syncfinder.hh"
+#include "wmcommon.hh"
+#include "utils.hh"
+#include "audiostream.hh"
+
+using std::vector;
+using std::min;
+
+/* reference implementation: check have_frames for each frame of the sync pattern */
+static double
+reference_sync_decode (const SyncFinder::SyncPattern& sync_pattern, int n_channels,
+                       const vector<float>& fft_out_db, const vector<char>& have_frames)
+{
+  const size_t n_bands = Params::max_band - Params::min_band + 1;
+  double sync_quality = 0;
+  int bit_count = 0;
+
+  for (size_t bit = 0; bit + 1 < sync_pattern.bit_start.size(); bit++)
+    {
+      float umag = 0, dmag = 0;
+      int frame_bit_count = 0;
+      for (int e = sync_pattern.bit_start[bit]; e < sync_pattern.bit_start[bit + 1]; e++)
+        {
+          const int frame = sync_pattern.frame[e];
+          if (have_frames[frame])
+            {
+              const size_t index = frame * n_channels * n_bands;
+              for (size_t i = 0; i < sync_pattern.n_up_down; i++)
+                {
+                  umag += fft_out_db[index + sync_pattern.up[e * sync_pattern.n_up_down + i]];
+                  dmag += fft_out_db[index + sync_pattern.down[e * sync_pattern.n_up_down + i]];
+                }
+              frame_bit_count++;
+            }
+        }
+      sync_quality += SyncFinder::bit_quality (umag, dmag, bit) * frame_bit_count;
+      bit_count += frame_bit_count;
+    }
+  if (bit_count)
+    sync_quality /= bit_count;
+  return fabs (SyncFinder::normalize_sync_quality (sync_quality));
+}
+
+class WDInputStream : public AudioInputStream
+{
+  const WavData *wav_data;
+  size_t         read_pos = 0;
+public:
+  WDInputStream (const WavData *wav_data) :
+    wav_data (wav_data)
+  {
+  }
+  int
+  bit_depth() const override
+  {
+    return wav_data->bit_depth();
+  }
+  int
+  sample_rate() const override
+  {
+    return wav_data->sample_rate();
+  }
+  int
+  n_channels() const override
+  {
+    return wav_data->n_channels();
+  }
+  size_t
+  n_frames() const override
+  {
+    return wav_data->n_values() / wav_data->n_channels();
+  }
+  Error
+  read_frames (vector<float>& samples, size_t count) override
+  {
+    size_t read_count = min (n_frames() - read_pos, count);
+
+    const auto& wsamples = wav_data->samples();
+    samples.assign (wsamples.begin() + read_pos * n_channels(), wsamples.begin() + (read_pos + read_count) * n_channels());
+
+    read_pos += read_count;
+
+    return Error::Code::NONE;
+  }
+};
+
+class WDOutputStream : public AudioOutputStream
+{
+  WavData      *wav_data;
+  vector<float> samples;
+public:
+  WDOutputStream (WavData *wav_data) :
+    wav_data (wav_data)
+  {
+  }
+  int
+  bit_depth() const override
+  {
+    return wav_data->bit_depth();
+  }
+  int
+  sample_rate() const override
+  {
+    return wav_data->sample_rate();
+  }
+  int
+  n_channels() const override
+  {
+    return wav_data->n_channels();
+  }
+  Error
+  write_frames (const vector<float>& frames) override
+  {
+    samples.insert (samples.end(), frames.begin(), frames.end());
+    return Error::Code::NONE;
+  }
+  Error
+  close() override
+  {
+    wav_data->set_samples (samples);
+    return Error::Code::NONE;
+  }
+};
+
+static bool
+same_scores (const vector<SyncFinder::Score>& tile_scores, const vector<SyncFinder::Score>& fft_scores, const char *label)
+{
+  if (tile_scores.size() != fft_scores.size())
+    {
+      printf ("engine check failed: %s: tile scores: %zd, fft scores: %zd\n", label, tile_scores.size(), fft_scores.size());
+      return false;
+    }
+  for (size_t i = 0; i < tile_scores.size(); i++)
+    {
+      const auto& t = tile_scores[i];
+      const auto& f = fft_scores[i];
+
+      /* the block type is only well defined if the sync quality is not close to zero */
+      const bool type_ok = t.block_type == f.block_type || t.quality < 0.01;
+      if (t.index != f.index || fabs (t.quality - f.quality) > 1e-4 || !type_ok)
+        {
+          printf ("engine check failed: %s: score %zd: tile index=%zd q=%.6f %s, fft index=%zd q=%.6f %s\n", label, i,
+                  t.index, t.quality, t.block_type == ConvBlockType::a ? "A" : "B",
+                  f.index, f.quality, f.block_type == ConvBlockType::a ? "A" : "B");
+          return false;
+        }
+    }
+  return true;
+}
+
+/* search_approx with FFT correlation must give the same scores and sync positions as sync_decode_tile */
+static bool
+check_engines (const PaddedWavData& wav_data, SyncFinder::Mode mode)
+{
+  ThreadPool thread_pool;
+  const vector<Key> key_list { Key() };
+  const char *label = mode == SyncFinder::Mode::BLOCK ? "block" : "clip";
+
+  SyncFinder tile_finder (thread_pool);
+  SyncFinder fft_finder (thread_pool);
+  tile_finder.set_engine (SyncFinder::Engine::TILE);
+  fft_finder.set_engine (SyncFinder::Engine::FFT);
+
+  Spectrogram spectrogram (thread_pool, wav_data);
+
+  auto tile_approx = tile_finder.search_approx_scores (key_list, spectrogram, mode);
+  auto fft_approx = fft_finder.search_approx_scores (key_list, spectrogram, mode);
+  if (!same_scores (tile_approx[0].sync_scores, fft_approx[0].sync_scores, label))
+    return false;
+
+  auto tile_results = tile_finder.search (key_list, spectrogram, mode);
+  auto fft_results = fft_finder.search (key_list, spectrogram, mode);
+  if (!same_scores (tile_results[0].sync_scores, fft_results[0].sync_scores, label))
+    return false;
+
+  if (tile_results[0].sync_scores.empty())
+    {
+      printf ("engine check failed: %s: no sync positions found\n", label);
+      return false;
+    }
+  printf ("# engine check (%s, %d channels): %zd approx scores, %zd sync positions\n", label, wav_data.n_channels(),
+          tile_approx[0].sync_scores.size(), tile_results[0].sync_scores.size());
+  return true;
+}
+
+int
+main (int argc, char **argv)
+{
+  const size_t n_bands = Params::max_band - Params::min_band + 1;
+  const size_t runs = argc > 1 ? atoi (argv[1]) : 20000;
+
+  std::mt19937 rng (42);
+  std::uniform_real_distribution<float> db_dist (-96, 0);
+
+  /* compare both search_approx engines on watermarked noise */
+  set_log_level (Log::WARNING);
+  for (int n_channels : { 1, 2 })
+    {
+      std::uniform_real_distribution<float> noise_dist (-0.5, 0.5);
+
+      vector<float> noise (120 * Params::mark_sample_rate * n_channels);
+      for (auto& sample : noise)
+        sample = noise_dist (rng);
+
+      WavData in_data (noise, n_channels, Params::mark_sample_rate, 16);
+      WavData wm_data ({ /* no samples */ }, n_channels, Params::mark_sample_rate, 16);
+
+      WDInputStream  in_stream (&in_data);
+      WDOutputStream out_stream (&wm_data);
+      if (add_stream_watermark (Key(), &in_stream, &out_stream, "0123456789abcdef0011223344556677", 0) != 0)
+        return 1;
+
+      if (!check_engines (PaddedWavData (wm_data), SyncFinder::Mode::BLOCK))
+        return 1;
+
+      /* clip: 40 seconds from the middle, zero padded like in the ClipDecoder */
+      const size_t block_frames = (mark_sync_frame_count() + mark_data_frame_count()) * Params::frame_size;
+      const WavData clip_data = wm_data.slice (40 * Params::mark_sample_rate, 40 * Params::mark_sample_rate);
+      if (!check_engines (PaddedWavData (clip_data, block_frames, block_frames), SyncFinder::Mode::CLIP))
+        return 1;
+    }
+
+  printf ("# channels | mode | sync_decode [calls/s]\n");
+  for (int n_channels : { 1, 2, 6 })
+    {
+      for (auto mode : { SyncFinder::Mode::BLOCK, SyncFinder::Mode::CLIP })
+        {
+          const SyncFinder::SyncPattern sync_pattern = SyncFinder::get_sync_pattern (Key(), n_channels, mode);
+
+          size_t frame_count = mark_sync_frame_count() + mark_data_frame_count();
+          if (mode == SyncFinder::Mode::CLIP)
+            frame_count *= 2;
+
+          /* every 8th frame is missing, its values are 0 (as sync_decode expects) */
+          vector<float> fft_out_db (frame_count * n_channels * n_bands);
+          vector<char>  have_frames (frame_count);
+          for (size_t f = 0; f < frame_count; f++)
+            {
+              have_frames[f] = (f % 8) != 0;
+              if (have_frames[f])
+                for (size_t i = 0; i < n_channels * n_bands; i++)
+                  fft_out_db[f * n_channels * n_bands + i] = db_dist (rng);
+            }
+
+          ConvBlockType block_type;
+          const double q = SyncFinder::sync_decode (sync_pattern, n_channels, 0, fft_out_db, have_frames, &block_type);
+          const double q_ref = reference_sync_decode (sync_pattern, n_channels, fft_out_db, have_frames);
+          if (q != q_ref)
+            {
+              printf ("reference check failed: n_channels=%d q=%.9f q_ref=%.9f\n", n_channels, q, q_ref);
+              return 1;
+            }
+
+          double q_sum = 0;
+          const double start_t = get_time();
+          for (size_t r = 0; r < runs; r++)
+            q_sum += SyncFinder::sync_decode (sync_pattern, n_channels, 0, fft_out_db, have_frames, &block_type);
+          const double t = get_time() - start_t;
+
+          assert (q_sum > 0);
+          printf ("%10d | %4s | %21.0f\n", n_channels, mode == SyncFinder::Mode::BLOCK ? "A" : "AB", runs / t);
+        }
+    }
+}
@@ -16,21 +16,110 @@
  */
 
 #include <stdio.h>
-#include <unistd.h>
+#include <stdlib.h>
+#include <math.h>
+#include <assert.h>
+
+#include <atomic>
 
 #include "threadpool.hh"
+#include "utils.hh"
+
+using std::vector;
+using std::max;
+
+/* many tiny jobs: measures scheduling overhead */
+static double
+bench_tiny_jobs (ThreadPool& tp, size_t n_jobs)
+{
+  std::atomic<size_t> count { 0 };
+
+  const double start_t = get_time();
+  ThreadPool::TaskGroup group (tp);
+  for (size_t i = 0; i < n_jobs; i++)
+    group.add ([&count]() { count++; });
+  group.wait();
+  const double t = get_time() - start_t;
+
+  assert (count == n_jobs);
+  return t;
+}
+
+/* compute bound parallel_for: measures scalability */
+static double
+bench_parallel_for (ThreadPool& tp, size_t n, size_t grain)
+{
+  vector<double> out (n);
+
+  const double start_t = get_time();
+  tp.parallel_for (0, n, grain, [&out] (size_t i)
+    {
+      double x = 0;
+      for (int k = 1; k < 200; k++)
+        x += sin (i * 0.001 * k) / k;
+      out[i] = x;
+    });
+  const double t = get_time() - start_t;
+
+  for (size_t i = 0; i < n; i += n / 16)
+    {
+      double x = 0;
+      for (int k = 1; k < 200; k++)
+        x += sin (i * 0.001 * k) / k;
+      assert (out[i] == x);
+    }
+  return t;
+}
+
+/* jobs which spawn and wait for their own sub groups: must not deadlock */
+static double
+bench_nested (ThreadPool& tp, size_t n_outer, size_t n_inner)
+{
+  std::atomic<size_t> count { 0 };
+
+  const double start_t = get_time();
+  tp.parallel_for (0, n_outer, 1, [&] (size_t)
+    {
+      ThreadPool::TaskGroup inner (tp);
+      for (size_t i = 0; i < n_inner; i++)
+        inner.add ([&count]() { count++; });
+      inner.wait();
+    });
+  const double t = get_time() - start_t;
+
+  assert (count == n_outer * n_inner);
+  return t;
+}
 
 int
-main()
+main (int argc, char **argv)
 {
-  ThreadPool tp;
+  const size_t max_threads = argc > 1 ? atoi (argv[1]) : ThreadPool::default_thread_count();
+
+  const size_t n_tiny   = 200000;
+  const size_t n_for    = 200000;
+  const size_t n_outer  = 1000;
+  const size_t n_inner  = 100;
+
+  printf ("# threads | tiny jobs [Mjobs/s] | parallel_for [ms] (speedup) | nested [ms]\n");
+  /* 1, 2, 4, ... threads, always including max_threads */
+  vector<size_t> thread_counts;
+  for (size_t n_threads = 1; n_threads < max_threads; n_threads *= 2)
+    thread_counts.push_back (n_threads);
+  thread_counts.push_back (max (max_threads, size_t (1)));
+
+  double t_for_1 = 0;
+  for (auto n_threads : thread_counts)
+    {
+      ThreadPool tp (n_threads);
 
-  int result1 = 0;
-  int result2 = 0;
-  tp.add_job ([&result1](){printf ("A\n"); sleep (2); printf ("A done\n"); result1 = 123;});
-  tp.add_job ([&result2](){printf ("B\n"); sleep (3); printf ("B done\n"); result2 = 456;});
+      const double t_tiny   = bench_tiny_jobs (tp, n_tiny);
+      const double t_for    = bench_parallel_for (tp, n_for, 256);
+      const double t_nested = bench_nested (tp, n_outer, n_inner);
+      if (n_threads == 1)
+        t_for_1 = t_for;
 
-  tp.wait_all();
-  printf ("===\n");
-  printf ("results: %d, %d\n", result1, result2);
+      printf ("%9zd | %19.2f | %17.1f (%5.2f) | %11.1f\n",
+              n_threads, n_tiny / t_tiny / 1e6, t_for * 1000, t_for_1 / t_for, t_nested * 1000);
+    }
 }
@@ -18,91 +18,249 @@
 #include "threadpool.hh"
 #include "utils.hh"
 
-bool
-ThreadPool::worker_next_job (Job& job)
-{
-  std::unique_lock<std::mutex> lck (mutex);
+#include <algorithm>
+#include <cmath>
 
-  if (stop_workers)
-    return false;
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
 
-  if (jobs.empty())
-    cond.wait (lck);
+/* worker thread identity, used to push jobs added by a job to the worker's own deque */
+static thread_local ThreadPool *current_pool = nullptr;
+static thread_local size_t      current_worker = 0;
 
-  if (jobs.empty())
-    return false;
+static constexpr size_t NO_WORKER = ~size_t (0);
+
+ThreadPool::TaskGroup::TaskGroup (ThreadPool& pool) :
+  pool (pool)
+{
+}
 
-  job = jobs.front();
-  jobs.erase (jobs.begin());
-  return true;
+ThreadPool::TaskGroup::~TaskGroup()
+{
+  /* jobs reference the group, so it must not go away before they are done */
+  wait();
 }
 
 void
-ThreadPool::worker_run()
+ThreadPool::TaskGroup::wait()
 {
-  while (!stop_workers)
+  pool.wait_group (*this);
+}
+
+void
+ThreadPool::push_job (TaskGroup& group, Task&& task)
+{
+  group.n_pending++;
+
+  const size_t q = (current_pool == this) ? current_worker : next_queue++ % queues.size();
+
+  n_queued++;
+  {
+    std::lock_guard<std::mutex> lg (queues[q]->mutex);
+    queues[q]->jobs.push_back (Job { std::move (task), &group });
+  }
+  if (n_sleeping > 0)
     {
-      Job job;
-      if (worker_next_job (job))
-        {
-          job.fun();
+      std::lock_guard<std::mutex> lg (sleep_mutex);
+      sleep_cond.notify_one();
+    }
+}
 
-          std::lock_guard<std::mutex> lg (mutex);
-          jobs_done++;
+bool
+ThreadPool::pop_job (size_t worker_index, Job& job)
+{
+  if (n_queued == 0)
+    return false;
 
-          main_cond.notify_one();
+  /* own deque: newest job first */
+  if (worker_index != NO_WORKER)
+    {
+      WorkerQueue& queue = *queues[worker_index];
+      std::lock_guard<std::mutex> lg (queue.mutex);
+      if (!queue.jobs.empty())
+        {
+          job = std::move (queue.jobs.back());
+          queue.jobs.pop_back();
+          n_queued--;
+          return true;
+        }
+    }
+  /* steal oldest job from other deques */
+  const size_t start = (worker_index != NO_WORKER) ? worker_index + 1 : 0;
+  for (size_t i = 0; i < queues.size(); i++)
+    {
+      WorkerQueue& queue = *queues[(start + i) % queues.size()];
+      std::lock_guard<std::mutex> lg (queue.mutex);
+      if (!queue.jobs.empty())
+        {
+          job = std::move (queue.jobs.front());
+          queue.jobs.pop_front();
+          n_queued--;
+          return true;
         }
     }
+  return false;
 }
 
-ThreadPool::ThreadPool()
+void
+ThreadPool::run_job (Job& job)
 {
-  for (unsigned int i = 0; i < std::thread::hardware_concurrency(); i++)
+  TaskGroup *group = job.group;
+
+  job.task();
+  job.task = Task(); /* free captured data before signalling completion */
+
+  /* the group may be destroyed as soon as n_pending is zero, so don't touch it afterwards */
+  if (--group->n_pending == 0 && n_sleeping > 0)
     {
-      threads.push_back (std::thread (&ThreadPool::worker_run, this));
+      std::lock_guard<std::mutex> lg (sleep_mutex);
+      sleep_cond.notify_all();
     }
 }
 
 void
-ThreadPool::add_job (std::function<void()> fun)
+ThreadPool::wait_group (TaskGroup& group)
 {
-  std::lock_guard<std::mutex> lg (mutex);
-  Job job;
-  job.fun = fun;
-  jobs.push_back (job);
-  jobs_added++;
+  const size_t worker_index = (current_pool == this) ? current_worker : NO_WORKER;
+
+  while (group.n_pending > 0)
+    {
+      /* help executing jobs (from any group) while waiting */
+      Job job;
+      if (pop_job (worker_index, job))
+        {
+          run_job (job);
+          continue;
+        }
 
-  cond.notify_one();
+      std::unique_lock<std::mutex> lck (sleep_mutex);
+      n_sleeping++;
+      sleep_cond.wait (lck, [&]() { return group.n_pending == 0 || n_queued > 0; });
+      n_sleeping--;
+    }
 }
 
 void
-ThreadPool::wait_all()
+ThreadPool::worker_run (size_t worker_index)
 {
+  current_pool   = this;
+  current_worker = worker_index;
+
   for (;;)
     {
-      std::unique_lock<std::mutex> lck (mutex);
+      Job job;
+      if (pop_job (worker_index, job))
+        {
+          run_job (job);
+          continue;
+        }
 
-      if (jobs_added == jobs_done)
+      std::unique_lock<std::mutex> lck (sleep_mutex);
+      n_sleeping++;
+      sleep_cond.wait (lck, [&]() { return stop_workers || n_queued > 0; });
+      n_sleeping--;
+
+      if (stop_workers && n_queued == 0)
         return;
+    }
+}
+
+ThreadPool::ThreadPool (size_t n_threads)
+{
+  n_threads = std::max<size_t> (n_threads, 1);
+
+  for (size_t i = 0; i < n_threads; i++)
+    queues.push_back (std::make_unique<WorkerQueue>());
+
+  for (size_t i = 0; i < n_threads; i++)
+    {
+      threads.push_back (std::thread (&ThreadPool::worker_run, this, i));
+    }
+}
+
+size_t
+ThreadPool::n_threads() const
+{
+  return threads.size();
+}
 
-      main_cond.wait (lck);
+size_t
+ThreadPool::thread_index() const
+{
+  return (current_pool == this) ? current_worker + 1 : 0;
+}
+
+/* cpu quota from cgroup v2 (cpu.max) or cgroup v1 (cpu.cfs_quota_us), returns 0 if unlimited */
+static double
+cgroup_cpu_quota()
+{
+  long long quota = -1, period = 0;
+
+  FILE *file = fopen ("/sys/fs/cgroup/cpu.max", "r");
+  if (file)
+    {
+      char quota_str[64];
+      if (fscanf (file, "%63s %lld", quota_str, &period) == 2 && strcmp (quota_str, "max") != 0)
+        quota = atoll (quota_str);
+      fclose (file);
+    }
+  else
+    {
+      file = fopen ("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r");
+      if (file)
+        {
+          if (fscanf (file, "%lld", &quota) != 1)
+            quota = -1;
+          fclose (file);
+        }
+      file = fopen ("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r");
+      if (file)
+        {
+          if (fscanf (file, "%lld", &period) != 1)
+            period = 0;
+          fclose (file);
+        }
     }
+  if (quota > 0 && period > 0)
+    return double (quota) / period;
+  return 0;
+}
+
+/* number of threads to use by default: respects cpu affinity (taskset) and cgroup cpu quota (containers) */
+size_t
+ThreadPool::default_thread_count()
+{
+  size_t n_cpus = std::thread::hardware_concurrency();
+
+#ifdef CPU_COUNT
+  cpu_set_t cpu_set;
+  if (sched_getaffinity (0, sizeof (cpu_set), &cpu_set) == 0)
+    n_cpus = CPU_COUNT (&cpu_set);
+#endif
+
+  const double quota = cgroup_cpu_quota();
+  if (quota > 0)
+    n_cpus = std::min<size_t> (n_cpus, std::ceil (quota));
+
+  return std::max<size_t> (n_cpus, 1);
 }
 
 ThreadPool::~ThreadPool()
 {
   {
-    std::lock_guard<std::mutex> lg (mutex);
+    std::lock_guard<std::mutex> lg (sleep_mutex);
     stop_workers = true;
-    cond.notify_all();
+    sleep_cond.notify_all();
   }
 
   for (auto& t : threads)
     t.join();
 
-  if (jobs_added != jobs_done)
+  if (n_queued != 0)
     {
-      // user must wait before deleting the ThreadPool
-      error ("audiowmark: open jobs in ThreadPool::~ThreadPool() [added=%zd, done=%zd] - this should not happen\n", jobs_added, jobs_done);
+      // user must wait for all TaskGroups before deleting the ThreadPool
+      error ("audiowmark: open jobs in ThreadPool::~ThreadPool() [queued=%zd] - this should not happen\n", size_t (n_queued));
     }
 }
@@ -19,38 +19,151 @@
 #define AUDIOWMARK_THREAD_POOL_HH
 
 #include <vector>
+#include <deque>
 #include <thread>
-#include <functional>
-#include <set>
+#include <memory>
+#include <atomic>
 #include <mutex>
 #include <condition_variable>
+#include <type_traits>
+#include <algorithm>
 
+/*
+ * Work stealing thread pool
+ *
+ * Every worker owns a job deque: jobs added from a worker thread are pushed to
+ * its own deque and executed in LIFO order (cache friendly), idle workers steal
+ * the oldest jobs from the other deques. Jobs added from outside the pool are
+ * distributed round robin over the deques.
+ *
+ * Jobs always belong to a TaskGroup. TaskGroup::wait() only waits for the jobs
+ * of this group, and executes pending jobs while waiting, so groups can be used
+ * from different threads (and nested within jobs) without blocking each other.
+ */
 class ThreadPool
 {
-  std::vector<std::thread> threads;
+public:
+  /* move-only callable: unlike std::function, data captured by the job is never copied */
+  class Task
+  {
+    struct Base
+    {
+      virtual ~Base() {}
+      virtual void run() = 0;
+    };
+    template<class F>
+    struct Impl : public Base
+    {
+      F fun;
+
+      template<class G>
+      Impl (G&& g) :
+        fun (std::forward<G> (g))
+      {
+      }
+      void
+      run() override
+      {
+        fun();
+      }
+    };
+    std::unique_ptr<Base> impl;
+  public:
+    Task() = default;
+    Task (Task&&) = default;
+    Task& operator= (Task&&) = default;
+
+    template<class F, class = typename std::enable_if<!std::is_same<typename std::decay<F>::type, Task>::value>::type>
+    Task (F&& fun) :
+      impl (new Impl<typename std::decay<F>::type> (std::forward<F> (fun)))
+    {
+    }
+    void
+    operator()()
+    {
+      impl->run();
+    }
+  };
+
+  class TaskGroup
+  {
+    ThreadPool&         pool;
+    std::atomic<size_t> n_pending { 0 };
 
+    friend class ThreadPool;
+  public:
+    explicit TaskGroup (ThreadPool& pool);
+    ~TaskGroup();
+
+    TaskGroup (const TaskGroup&) = delete;
+    TaskGroup& operator= (const TaskGroup&) = delete;
+
+    template<class F> void
+    add (F&& fun)
+    {
+      pool.push_job (*this, Task (std::forward<F> (fun)));
+    }
+    void wait();
+  };
+
+private:
   struct Job
   {
-    std::function<void()> fun;
+    Task       task;
+    TaskGroup *group = nullptr;
+  };
+  struct WorkerQueue
+  {
+    std::mutex      mutex;
+    std::deque<Job> jobs;
   };
+  std::vector<std::unique_ptr<WorkerQueue>> queues;
+  std::vector<std::thread>                  threads;
 
-  std::mutex                mutex;
-  std::condition_variable   cond;
-  std::condition_variable   main_cond;
-  std::vector<Job>          jobs;
-  size_t                    jobs_added = 0;
-  size_t                    jobs_done = 0;
+  std::atomic<size_t>       n_queued { 0 };
+  std::atomic<size_t>       n_sleeping { 0 };
+  std::atomic<size_t>       next_queue { 0 };
   bool                      stop_workers = false;
+  std::mutex                sleep_mutex;
+  std::condition_variable   sleep_cond;
 
-  bool worker_next_job (Job& job);
-  void worker_run();
+  void push_job (TaskGroup& group, Task&& task);
+  bool pop_job (size_t worker_index, Job& job);
+  void run_job (Job& job);
+  void wait_group (TaskGroup& group);
+  void worker_run (size_t worker_index);
 
 public:
-  ThreadPool();
+  ThreadPool (size_t n_threads = default_thread_count());
   ~ThreadPool();
 
-  void add_job (std::function<void()> fun);
-  void wait_all();
+  ThreadPool (const ThreadPool&) = delete;
+  ThreadPool& operator= (const ThreadPool&) = delete;
+
+  /* call fun (i) for i in [begin, end), split into jobs of (at most) grain indices */
+  template<class F> void
+  parallel_for (size_t begin, size_t end, size_t grain, const F& fun)
+  {
+    TaskGroup group (*this);
+
+    grain = std::max<size_t> (grain, 1);
+    for (size_t start = begin; start < end; start += grain)
+      {
+        const size_t stop = std::min (start + grain, end);
+        group.add ([&fun, start, stop]()
+          {
+            for (size_t i = start; i < stop; i++)
+              fun (i);
+          });
+      }
+    group.wait();
+  }
+  size_t n_threads() const;
+
+  /* 0 for threads outside the pool, 1 + worker index for the workers (< n_threads() + 1) */
+  size_t thread_index() const;
+
+  static size_t default_thread_count();
 };
 
 #endif /* AUDIOWMARK_THREAD_POOL_HH */
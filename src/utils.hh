@@ -27,6 +27,8 @@ std::string      bit_vec_to_str (const std::vector<int>& bit_vec);
 std::vector<unsigned char> hex_str_to_vec (const std::string& str);
 std::string                vec_to_hex_str (const std::vector<unsigned char>& vec);
 
+bool tokenize (const std::string& line, std::vector<std::string>& tokens);
+
 double get_time();
 
 template<typename T>
@@ -22,8 +22,10 @@
 #include "sfoutputstream.hh"
 #include "mp3inputstream.hh"
 
+#include <algorithm>
 #include <memory>
 #include <math.h>
+#include <assert.h>
 
 using std::string;
 using std::vector;
@@ -32,9 +34,14 @@ WavData::WavData()
 {
 }
 
-WavData::WavData (const vector<float>& samples, int n_channels, int sample_rate, int bit_depth)
+WavData::WavData (const vector<float>& samples, int n_channels, int sample_rate, int bit_depth) :
+  WavData (vector<float> (samples), n_channels, sample_rate, bit_depth)
 {
-  m_samples     = samples;
+}
+
+WavData::WavData (vector<float>&& samples, int n_channels, int sample_rate, int bit_depth)
+{
+  set_samples (std::move (samples));
   m_n_channels  = n_channels;
   m_sample_rate = sample_rate;
   m_bit_depth   = bit_depth;
@@ -55,10 +62,9 @@ WavData::load (const string& filename)
 Error
 WavData::load (AudioInputStream *in_stream)
 {
-  m_samples.clear(); // get rid of old contents
-
+  vector<float> samples;
   if (in_stream->n_frames() != AudioInputStream::N_FRAMES_UNKNOWN)
-    m_samples.reserve (in_stream->n_frames() * in_stream->n_channels());
+    samples.reserve (in_stream->n_frames() * in_stream->n_channels());
 
   vector<float> m_buffer;
   while (true)
@@ -72,8 +78,9 @@ WavData::load (AudioInputStream *in_stream)
           /* reached eof */
           break;
         }
-      m_samples.insert (m_samples.end(), m_buffer.begin(), m_buffer.end());
+      samples.insert (samples.end(), m_buffer.begin(), m_buffer.end());
     }
+  set_samples (std::move (samples));
   m_sample_rate = in_stream->sample_rate();
   m_n_channels  = in_stream->n_channels();
   m_bit_depth   = in_stream->bit_depth();
@@ -87,13 +94,21 @@ WavData::save (const string& filename) const
   std::unique_ptr<AudioOutputStream> out_stream;
   Error err;
 
-  out_stream = AudioOutputStream::create (filename, m_n_channels, m_sample_rate, m_bit_depth, m_samples.size() / m_n_channels, err);
+  out_stream = AudioOutputStream::create (filename, m_n_channels, m_sample_rate, m_bit_depth, n_frames(), err);
   if (err)
     return err;
 
-  err = out_stream->write_frames (m_samples);
-  if (err)
-    return err;
+  /* write in blocks, so we don't need a copy of all samples */
+  const Samples samples = this->samples();
+  const size_t  block_size = 1024 * m_n_channels;
+  vector<float> block;
+  for (size_t pos = 0; pos < samples.size(); pos += block_size)
+    {
+      block.assign (samples.begin() + pos, samples.begin() + std::min (pos + block_size, samples.size()));
+      err = out_stream->write_frames (block);
+      if (err)
+        return err;
+    }
 
   err = out_stream->close();
   return err;
@@ -111,8 +126,71 @@ WavData::bit_depth() const
   return m_bit_depth;
 }
 
+/* get a WavData for the sample frames [first_frame, first_frame + n_frames) which shares the samples with this one */
+WavData
+WavData::slice (size_t first_frame, size_t n_frames) const
+{
+  assert (first_frame + n_frames <= this->n_frames());
+
+  WavData result = *this;
+  result.m_first    = m_first + first_frame * m_n_channels;
+  result.m_n_values = n_frames * m_n_channels;
+  return result;
+}
+
 void
 WavData::set_samples (const vector<float>& samples)
 {
-  m_samples = samples;
+  set_samples (vector<float> (samples));
+}
+
+void
+WavData::set_samples (vector<float>&& samples)
+{
+  m_n_values = samples.size();
+  m_first    = 0;
+  m_storage  = std::make_shared<const vector<float>> (std::move (samples));
+}
+
+PaddedWavData::PaddedWavData (const WavData& wav_data, size_t pad_start, size_t pad_end) :
+  m_wav_data (wav_data),
+  m_pad_start (pad_start),
+  m_n_frames (pad_start + wav_data.n_frames() + pad_end)
+{
+}
+
+/*
+ * get the interleaved samples of the sample frames [first, first + count):
+ * returns a pointer to the samples of the WavData if possible, otherwise the
+ * samples (and zeros for the padding) are copied to buffer
+ */
+const float *
+PaddedWavData::frames (size_t first, size_t count, vector<float>& buffer) const
+{
+  assert (first + count <= m_n_frames);
+
+  const size_t n_channels = m_wav_data.n_channels();
+  const size_t data_start = m_pad_start;
+  const size_t data_end   = m_pad_start + m_wav_data.n_frames();
+  const float *samples    = m_wav_data.samples().data();
+
+  if (first >= data_start && first + count <= data_end)
+    return samples + (first - data_start) * n_channels;
+
+  buffer.assign (count * n_channels, 0);
+
+  const size_t copy_start = std::max (first, data_start);
+  const size_t copy_end   = std::min (first + count, data_end);
+  if (copy_start < copy_end)
+    std::copy (samples + (copy_start - data_start) * n_channels,
+               samples + (copy_end - data_start) * n_channels,
+               buffer.begin() + (copy_start - first) * n_channels);
+  return buffer.data();
+}
+
+/* true if the sample frames [first, first + count) are all in the padding (zero) */
+bool
+PaddedWavData::is_padding (size_t first, size_t count) const
+{
+  return first + count <= m_pad_start || first >= m_pad_start + m_wav_data.n_frames();
 }
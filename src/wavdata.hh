@@ -18,15 +18,49 @@
 #ifndef AUDIOWMARK_WAV_DATA_HH
 #define AUDIOWMARK_WAV_DATA_HH
 
+#include <memory>
 #include <string>
 #include <vector>
 
 #include "utils.hh"
 #include "audiostream.hh"
 
+/*
+ * The samples of a WavData are stored in reference counted immutable storage,
+ * so copies of a WavData and slices of it (see slice()) share the samples
+ * instead of copying them. Since the storage is never modified, WavData
+ * objects which share storage can be used by different threads.
+ */
 class WavData
 {
-  std::vector<float> m_samples;
+public:
+  /* read-only range of interleaved samples, valid as long as the WavData storage */
+  class Samples
+  {
+    const float *m_data = nullptr;
+    size_t       m_size = 0;
+  public:
+    Samples (const float *data, size_t size) :
+      m_data (data),
+      m_size (size)
+    {
+    }
+    const float *begin() const  { return m_data; }
+    const float *end() const    { return m_data + m_size; }
+    const float *data() const   { return m_data; }
+    size_t       size() const   { return m_size; }
+    bool         empty() const  { return m_size == 0; }
+
+    const float&
+    operator[] (size_t i) const
+    {
+      return m_data[i];
+    }
+  };
+private:
+  std::shared_ptr<const std::vector<float>> m_storage;
+  size_t             m_first       = 0; // first value of this WavData in m_storage
+  size_t             m_n_values    = 0;
   int                m_sample_rate = 0;
   int                m_n_channels  = 0;
   int                m_bit_depth   = 0;
@@ -34,6 +68,7 @@ class WavData
 public:
   WavData();
   WavData (const std::vector<float>& samples, int n_channels, int sample_rate, int bit_depth);
+  WavData (std::vector<float>&& samples, int n_channels, int sample_rate, int bit_depth);
 
   Error load (AudioInputStream *in_stream);
   Error load (const std::string& filename);
@@ -50,20 +85,64 @@ public:
   size_t
   n_values() const
   {
-    return m_samples.size();
+    return m_n_values;
   }
   size_t
   n_frames() const
   {
-    return m_samples.size() / m_n_channels;
+    return m_n_values / m_n_channels;
   }
-  const std::vector<float>&
+  Samples
   samples() const
   {
-    return m_samples;
+    return Samples (m_storage ? m_storage->data() + m_first : nullptr, m_n_values);
   }
 
+  WavData slice (size_t first_frame, size_t n_frames) const;
+
   void set_samples (const std::vector<float>& samples);
+  void set_samples (std::vector<float>&& samples);
+};
+
+/*
+ * read-only view of a WavData with zero padding before and after the samples
+ *
+ * The padding is virtual: it is not stored, so padding a short clip to a
+ * full block costs neither memory nor time. Use frames() to read the
+ * samples of a range of sample frames; only ranges which overlap the
+ * padding and the samples are copied.
+ */
+class PaddedWavData
+{
+  WavData        m_wav_data;      // shares the samples with the original WavData
+  size_t         m_pad_start = 0; // in sample frames
+  size_t         m_n_frames  = 0; // including padding
+public:
+  explicit PaddedWavData (const WavData& wav_data, size_t pad_start = 0, size_t pad_end = 0);
+
+  const float *frames (size_t first, size_t count, std::vector<float>& buffer) const;
+  bool         is_padding (size_t first, size_t count) const;
+
+  int
+  n_channels() const
+  {
+    return m_wav_data.n_channels();
+  }
+  int
+  sample_rate() const
+  {
+    return m_wav_data.sample_rate();
+  }
+  size_t
+  n_frames() const
+  {
+    return m_n_frames;
+  }
+  size_t
+  n_values() const
+  {
+    return m_n_frames * m_wav_data.n_channels();
+  }
 };
 
 #endif /* AUDIOWMARK_WAV_DATA_HH */
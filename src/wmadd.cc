@@ -16,9 +16,8 @@
  */
 
 #include <stdint.h>
-
-#include <zita-resampler/resampler.h>
-#include <zita-resampler/vresampler.h>
+#include <thread>
+#include <set>
 
 #include "wmcommon.hh"
 #include "fft.hh"
@@ -32,6 +31,10 @@
 #include "stdoutwavoutputstream.hh"
 #include "shortcode.hh"
 #include "audiobuffer.hh"
+#include "resample.hh"
+#include "threadpool.hh"
+#include "boundedqueue.hh"
+#include "keyschedule.hh"
 
 using std::string;
 using std::vector;
@@ -46,10 +49,8 @@ enum class FrameMod : uint8_t {
 };
 
 static void
-prepare_frame_mod (UpDownGen& up_down_gen, int f, vector<FrameMod>& frame_mod, int data_bit)
+prepare_frame_mod (const UpDownArray& up, const UpDownArray& down, vector<FrameMod>& frame_mod, int data_bit)
 {
-  UpDownArray up, down;
-  up_down_gen.get (f, up, down);
   for (auto u : up)
     frame_mod[u] = data_bit ? FrameMod::UP : FrameMod::DOWN;
 
@@ -57,13 +58,15 @@ prepare_frame_mod (UpDownGen& up_down_gen, int f, vector<FrameMod>& frame_mod, i
     frame_mod[d] = data_bit ? FrameMod::DOWN : FrameMod::UP;
 }
 
+/* fft_out and fft_delta_spect contain the bins [first_bin, first_bin + n_bins) */
 static void
-apply_frame_mod (const vector<FrameMod>& frame_mod, const vector<complex<float>>& fft_out, vector<complex<float>>& fft_delta_spect)
+apply_frame_mod (const vector<FrameMod>& frame_mod, int first_bin, int n_bins, const complex<float> *fft_out, complex<float> *fft_delta_spect)
 {
   const float   min_mag = 1e-7;   // avoid computing pow (0.0, -water_delta) which would be inf
-  for (size_t i = 0; i < frame_mod.size(); i++)
+  for (int b = 0; b < n_bins; b++)
     {
-      if (frame_mod[i] == FrameMod::KEEP)
+      const size_t i = first_bin + b;
+      if (i >= frame_mod.size() || frame_mod[i] == FrameMod::KEEP)
         continue;
 
       int data_bit_sign = (frame_mod[i] == FrameMod::UP) ? 1 : -1;
@@ -72,18 +75,36 @@ apply_frame_mod (const vector<FrameMod>& frame_mod, const vector<complex<float>>
        *
        * this actually increases the amount of energy because mag is less than 1.0
        */
-      const float mag = abs (fft_out[i]);
+      const float mag = abs (fft_out[b]);
       if (mag > min_mag)
         {
           const float mag_factor = powf (mag, -Params::water_delta * data_bit_sign);
 
-          fft_delta_spect[i] = fft_out[i] * (mag_factor - 1);
+          fft_delta_spect[b] = fft_out[b] * (mag_factor - 1);
         }
     }
 }
 
+/* analyze one frame (only the watermark bands), silent frames (see silent_frame()) get no watermark,
+ * so they are not transformed (empty spectrum)
+ */
+static Spectrum
+analyze_frame (FFTAnalyzer& fft_analyzer, const vector<float>& samples, int n_channels)
+{
+  double energy = 0;
+  for (auto value : samples)
+    energy += double (value) * value;
+
+  if (silent_frame (energy, samples.size()))
+    return {};
+
+  Spectrum spectrum = Spectrum::bands (n_channels);
+  fft_analyzer.run_fft (samples, 0, spectrum);
+  return spectrum;
+}
+
 static void
-mark_data (const Key& key, vector<vector<FrameMod>>& frame_mod, const vector<int>& bitvec)
+mark_data (const KeySchedule& key_schedule, vector<vector<FrameMod>>& frame_mod, const vector<int>& bitvec)
 {
   assert (bitvec.size() == mark_data_frame_count() / Params::frames_per_bit);
   assert (frame_mod.size() >= mark_data_frame_count());
@@ -92,7 +113,7 @@ mark_data (const Key& key, vector<vector<FrameMod>>& frame_mod, const vector<int
 
   if (Params::mix)
     {
-      vector<MixEntry> mix_entries = gen_mix_entries (key);
+      const vector<MixEntry>& mix_entries = key_schedule.mix_entries();
 
       for (int f = 0; f < frame_count; f++)
         {
@@ -113,34 +134,28 @@ mark_data (const Key& key, vector<vector<FrameMod>>& frame_mod, const vector<int
     }
   else
     {
-      UpDownGen up_down_gen (key, Random::Stream::data_up_down);
-      BitPosGen bit_pos_gen (key);
-
       for (int f = 0; f < frame_count; f++)
         {
-          size_t index = bit_pos_gen.data_frame (f);
+          size_t index = key_schedule.data_frame (f);
 
-          prepare_frame_mod (up_down_gen, f, frame_mod[index], bitvec[f / Params::frames_per_bit]);
+          prepare_frame_mod (key_schedule.data_up (f), key_schedule.data_down (f), frame_mod[index], bitvec[f / Params::frames_per_bit]);
         }
     }
 }
 
 static void
-mark_sync (const Key& key, vector<vector<FrameMod>>& frame_mod, int ab)
+mark_sync (const KeySchedule& key_schedule, vector<vector<FrameMod>>& frame_mod, int ab)
 {
   const int frame_count = mark_sync_frame_count();
   assert (frame_mod.size() >= mark_sync_frame_count());
 
-  UpDownGen up_down_gen (key, Random::Stream::sync_up_down);
-  BitPosGen bit_pos_gen (key);
-
   // sync block always written in linear order (no mix)
   for (int f = 0; f < frame_count; f++)
     {
-      size_t index = bit_pos_gen.sync_frame (f);
+      size_t index = key_schedule.sync_frame (f);
       int    data_bit = (f / Params::sync_frames_per_bit + ab) & 1; /* write 010101 for a block, 101010 for b block */
 
-      prepare_frame_mod (up_down_gen, f, frame_mod[index], data_bit);
+      prepare_frame_mod (key_schedule.sync_up (f), key_schedule.sync_down (f), frame_mod[index], data_bit);
     }
 }
 
@@ -152,17 +167,19 @@ init_frame_mod_vec (const Key& key, vector<vector<FrameMod>>& frame_mod_vec, int
   for (auto& frame_mod : frame_mod_vec)
     frame_mod.resize (Params::max_band + 1);
 
+  auto key_schedule = KeySchedule::get (key);
+
   /* forward error correction */
   ConvBlockType block_type  = ab ? ConvBlockType::b : ConvBlockType::a;
-  vector<int>   bitvec_fec  = randomize_bit_order (key, code_encode (block_type, bitvec), /* encode */ true);
+  vector<int>   bitvec_fec  = key_schedule->randomize_bit_order (code_encode (block_type, bitvec), /* encode */ true);
 
-  mark_sync (key, frame_mod_vec, ab);
-  mark_data (key, frame_mod_vec, bitvec_fec);
+  mark_sync (*key_schedule, frame_mod_vec, ab);
+  mark_data (*key_schedule, frame_mod_vec, bitvec_fec);
 }
 
 /* synthesizes a watermark stream (overlap add with synthesis window)
  *
- * input:  per-channel fft delta values (always one frame)
+ * input:  per-channel fft delta values (always one frame, bins outside the band window are zero)
  * output: samples
  */
 class WatermarkSynth
@@ -212,17 +229,26 @@ public:
     synth_samples.resize (window.size() * n_channels);
   }
   vector<float>
-  run (const vector<vector<complex<float>>>& fft_delta_spect)
+  run (const Spectrum& fft_delta_spect)
   {
     const size_t synth_frame_sz = Params::frame_size * n_channels;
     /* move frame 1 and frame 2 to frame 0 and frame 1 */
     std::copy (synth_samples.begin() + synth_frame_sz, synth_samples.end(), synth_samples.begin());
     /* zero out frame 2 */
     std::fill (synth_samples.begin() + synth_frame_sz * 2, synth_samples.end(), 0);
-    for (int ch = 0; ch < n_channels; ch++)
+    /* fft_delta_spect is empty for silent frames (no watermark signal) */
+    for (int ch = 0; ch < (fft_delta_spect.empty() ? 0 : n_channels); ch++)
       {
+        /* complex<float> and the fft input have the same layout in memory */
+        complex<float> *ifft_in = reinterpret_cast<complex<float> *> (fft_processor.in());
+        std::fill (ifft_in, ifft_in + Params::frame_size / 2 + 1, 0);
+
+        const complex<float> *bins = fft_delta_spect.bins (0, ch);
+        std::copy (bins, bins + fft_delta_spect.n_bins(), ifft_in + fft_delta_spect.first_bin());
+
         /* mix watermark signal to output frame */
-        vector<float> fft_delta_out = fft_processor.ifft (fft_delta_spect[ch]);
+        fft_processor.ifft();
+        const float *fft_delta_out = fft_processor.out();
 
         for (int dframe = 0; dframe <= 2; dframe++)
           {
@@ -264,7 +290,7 @@ public:
 
 /* generates a watermark signal
  *
- * input:  original signal samples (always for one complete frame)
+ * input:  spectrum of the original signal (always for one complete frame)
  * output: watermark signal (to be mixed to the original sample)
  */
 class WatermarkGen
@@ -274,45 +300,48 @@ class WatermarkGen
   size_t                    frame_number = 0;
   int                       m_data_blocks = 0;
 
-  FFTAnalyzer               fft_analyzer;
   WatermarkSynth            wm_synth;
 
   vector<int>               bitvec;
   vector<vector<FrameMod>>  frame_mod_vec_a;
   vector<vector<FrameMod>>  frame_mod_vec_b;
+  Spectrum                  fft_delta_spect;
 public:
   WatermarkGen (int n_channels, const vector<int>& bitvec) :
     n_channels (n_channels),
     frames_per_block (mark_sync_frame_count() + mark_data_frame_count()),
-    fft_analyzer (n_channels),
     wm_synth (n_channels),
-    bitvec (bitvec)
+    bitvec (bitvec),
+    fft_delta_spect (Spectrum::bands (n_channels))
   {
-
-    /* start writing a partial B-block as padding */
-    assert (frames_per_block > Params::frames_pad_start);
-    frame_number = 2 * frames_per_block - Params::frames_pad_start;
+    frame_number = first_frame_number();
   }
+  /* fft_out is empty for silent frames (see analyze_frame) */
   vector<float>
-  run (const Key& key, const vector<float>& samples)
+  run (const Key& key, const Spectrum& fft_out)
   {
-    assert (samples.size() == Params::frame_size * n_channels);
-
-    vector<vector<complex<float>>> fft_out = fft_analyzer.run_fft (samples, 0);
+    assert (fft_out.empty() || fft_out.n_channels() == n_channels);
+    assert (fft_out.empty() || fft_out.first_bin() == fft_delta_spect.first_bin());
+    assert (fft_out.empty() || fft_out.n_bins() == fft_delta_spect.n_bins());
 
-    vector<vector<complex<float>>> fft_delta_spect;
-    for (int ch = 0; ch < n_channels; ch++)
-      fft_delta_spect.push_back (vector<complex<float>> (fft_out.back().size()));
+    const bool silent = fft_out.empty();
+    if (!silent)
+      {
+        fft_delta_spect.clear_bins();
 
-    const vector<FrameMod>& frame_mod = get_frame_mod (key);
-    for (int ch = 0; ch < n_channels; ch++)
-      apply_frame_mod (frame_mod, fft_out[ch], fft_delta_spect[ch]);
+        const vector<FrameMod>& frame_mod = get_frame_mod (key);
+        for (int ch = 0; ch < n_channels; ch++)
+          apply_frame_mod (frame_mod, fft_delta_spect.first_bin(), fft_delta_spect.n_bins(), fft_out.bins (0, ch), fft_delta_spect.bins (0, ch));
+      }
 
     frame_number++;
     if (frame_number % frames_per_block == 0)
       m_data_blocks++;
 
-    return wm_synth.run (fft_delta_spect);
+    if (silent)
+      return wm_synth.run (Spectrum());
+    else
+      return wm_synth.run (fft_delta_spect);
   }
   size_t
   skip (size_t zeros)
@@ -322,6 +351,31 @@ public:
     frame_number += zeros / Params::frame_size;
     return wm_synth.skip (zeros);
   }
+  /* start generating the watermark for frame f of the input (synthesis needs to warm up for one frame) */
+  void
+  seek (size_t f)
+  {
+    frame_number = first_frame_number() + f;
+  }
+  static size_t
+  first_frame_number()
+  {
+    /* start writing a partial B-block as padding */
+    const size_t frames_per_block = mark_sync_frame_count() + mark_data_frame_count();
+    assert (frames_per_block > Params::frames_pad_start);
+    return 2 * frames_per_block - Params::frames_pad_start;
+  }
+  /* number of data blocks after watermarking input frames [0, frames) */
+  static int
+  count_data_blocks (size_t frames)
+  {
+    const size_t frames_per_block = mark_sync_frame_count() + mark_data_frame_count();
+    const size_t start = first_frame_number();
+    const int blocks = (start + frames) / frames_per_block - start / frames_per_block;
+
+    // first block is padding - a partial B block
+    return max (blocks - 1, 0);
+  }
   const vector<FrameMod>&
   get_frame_mod (const Key& key)
   {
@@ -349,165 +403,102 @@ public:
   }
 };
 
-class ResamplerImpl
+/* payload independent part of the watermark generation: resample to Params::mark_sample_rate and analyze
+ *
+ * input:  samples from original signal (always one frame)
+ * output: spectrum of the frames at Params::mark_sample_rate (can be zero, one or more frames)
+ */
+class WatermarkAnalyzer
 {
-public:
-  virtual
-  ~ResamplerImpl()
-  {
-  }
+  std::unique_ptr<ResamplerImpl> in_resampler;
+  const int                      n_channels = 0;
+  const int                      input_rate = 0;
+  FFTAnalyzer                    fft_analyzer;
+  const bool                     need_resampler = false;
 
-  virtual size_t        skip (size_t zeros) = 0;
-  virtual void          write_frames (const vector<float>& frames) = 0;
-  virtual vector<float> read_frames (size_t frames) = 0;
-  virtual size_t        can_read_frames() const = 0;
-};
+  /* silence statistics, only for frames that start within the actual input (not the zero padding after it) */
+  size_t                         m_input_frames = 0;    // actual input sample frames (at input_rate)
+  size_t                         m_analyzed_frames = 0; // frames at Params::mark_sample_rate (including skipped frames)
+  size_t                         m_frames = 0;
+  size_t                         m_silent_frames = 0;
 
-template<class Resampler>
-class BufferedResamplerImpl : public ResamplerImpl
-{
-  const int     n_channels = 0;
-  const int     old_rate = 0;
-  const int     new_rate = 0;
-  bool          first_write = true;
-  Resampler     m_resampler;
+  Spectrum
+  analyze (const vector<float>& samples)
+  {
+    Spectrum spectrum = analyze_frame (fft_analyzer, samples, n_channels);
 
-  vector<float> buffer;
+    const uint64_t frame_start = m_analyzed_frames++ * Params::frame_size;
+    if (frame_start * input_rate < uint64_t (m_input_frames) * Params::mark_sample_rate)
+      {
+        m_frames++;
+        m_silent_frames += spectrum.empty();
+      }
+    return spectrum;
+  }
 public:
-  BufferedResamplerImpl (int n_channels, int old_rate, int new_rate) :
+  WatermarkAnalyzer (int n_channels, int input_rate) :
     n_channels (n_channels),
-    old_rate (old_rate),
-    new_rate (new_rate)
+    input_rate (input_rate),
+    fft_analyzer (n_channels),
+    need_resampler (input_rate != Params::mark_sample_rate)
   {
+    if (need_resampler)
+      in_resampler.reset (create_resampler (n_channels, input_rate, Params::mark_sample_rate));
   }
-  Resampler&
-  resampler()
+  bool
+  init_ok()
   {
-    return m_resampler;
+    if (need_resampler)
+      return bool (in_resampler);
+    else
+      return true;
   }
-  size_t
-  skip (size_t zeros)
+  /* n_input_frames: number of sample frames in samples which are actual input (the rest is zero padding) */
+  vector<Spectrum>
+  run (const vector<float>& samples, size_t n_input_frames)
   {
-    /* skipping a whole 1 second block should end in the same resampler state we had at the beginning */
-    size_t seconds = 0;
-    if (zeros >= Params::frame_size)
-      seconds = (zeros - Params::frame_size) / old_rate;
-
-    const size_t extra = new_rate * seconds;
-    zeros -= old_rate * seconds;
-
-    write_frames (vector<float> (zeros * n_channels));
+    m_input_frames += n_input_frames;
 
-    size_t out = can_read_frames() + extra;
-    out -= out % Params::frame_size; /* always skip whole frames */
-    read_frames (out - extra);
-    return out;
-  }
-  void
-  write_frames (const vector<float>& frames)
-  {
-    if (first_write)
+    vector<Spectrum> spectra;
+    if (!need_resampler)
       {
-        /* avoid timeshift: zita needs k/2 - 1 samples before the actual input */
-        m_resampler.inp_count = m_resampler.inpsize () / 2 - 1;
-        m_resampler.inp_data  = nullptr;
-
-        m_resampler.out_count = 1000000; // <- just needs to be large enough that all input is consumed
-        m_resampler.out_data  = nullptr;
-        m_resampler.process();
-
-        first_write = false;
+        /* cheap case: if no resampling is necessary, just analyze the frame */
+        spectra.push_back (analyze (samples));
+        return spectra;
       }
 
-    uint start = 0;
-    while (start != frames.size() / n_channels)
-      {
-        const int out_count = Params::frame_size;
-        float out[out_count * n_channels];
-
-        m_resampler.out_count = out_count;
-        m_resampler.out_data  = out;
-
-        m_resampler.inp_count = frames.size() / n_channels - start;
-        m_resampler.inp_data  = const_cast<float *> (&frames[start * n_channels]);
-        m_resampler.process();
-
-        size_t count = out_count - m_resampler.out_count;
-        buffer.insert (buffer.end(), out, out + count * n_channels);
+    /* resample to the watermark sample rate */
+    in_resampler->write_frames (samples);
+    while (in_resampler->can_read_frames() >= Params::frame_size)
+      spectra.push_back (analyze (in_resampler->read_frames (Params::frame_size)));
 
-        start = frames.size() / n_channels - m_resampler.inp_count;
-      }
+    return spectra;
   }
-  vector<float>
-  read_frames (size_t frames)
+  size_t
+  skip (size_t zeros)
   {
-    assert (frames * n_channels <= buffer.size());
-    const auto begin = buffer.begin();
-    const auto end   = begin + frames * n_channels;
-    vector<float> result (begin, end);
-    buffer.erase (begin, end);
-    return result;
+    assert (zeros % Params::frame_size == 0);
+
+    const size_t out = need_resampler ? in_resampler->skip (zeros) : zeros;
+    m_input_frames += zeros;
+    m_analyzed_frames += out / Params::frame_size;
+    return out;
   }
-  size_t
-  can_read_frames() const
+  /* fraction of the input frames which were silent (and got no watermark) */
+  double
+  silent_fraction() const
   {
-    return buffer.size() / n_channels;
+    return m_frames ? double (m_silent_frames) / m_frames : 0;
   }
 };
 
-static ResamplerImpl *
-create_resampler (int n_channels, int old_rate, int new_rate)
-{
-  if (old_rate == new_rate)
-    {
-      return nullptr; // should not be using create_resampler for that case
-    }
-  else
-    {
-      /* zita-resampler provides two resampling algorithms
-       *
-       * a fast optimized version: Resampler
-       *   this is an optimized version, which works for many common cases,
-       *   like resampling between 22050, 32000, 44100, 48000, 96000 Hz
-       *
-       * a slower version: VResampler
-       *   this works for arbitary rates (like 33333 -> 44100 resampling)
-       *
-       * so we try using Resampler, and if that fails fall back to VResampler
-       */
-      const int hlen = 16;
-
-      auto resampler = new BufferedResamplerImpl<Resampler> (n_channels, old_rate, new_rate);
-      if (resampler->resampler().setup (old_rate, new_rate, n_channels, hlen) == 0)
-        {
-          return resampler;
-        }
-      else
-        delete resampler;
-
-      auto vresampler = new BufferedResamplerImpl<VResampler> (n_channels, old_rate, new_rate);
-      const double ratio = double (new_rate) / old_rate;
-      if (vresampler->resampler().setup (ratio, n_channels, hlen) == 0)
-        {
-          return vresampler;
-        }
-      else
-        {
-          error ("audiowmark: resampling from old_rate=%d to new_rate=%d not implemented\n", old_rate, new_rate);
-          delete vresampler;
-          return nullptr;
-        }
-    }
-}
-
 /* generate a watermark at Params::mark_sample_rate and resample to whatever the original signal has
  *
- * input:  samples from original signal (always one frame)
+ * input:  spectrum of the original signal frames (from WatermarkAnalyzer)
  * output: watermark signal resampled to original signal sample rate
  */
 class WatermarkResampler
 {
-  std::unique_ptr<ResamplerImpl> in_resampler;
   std::unique_ptr<ResamplerImpl> out_resampler;
   WatermarkGen                   wm_gen;
   const bool                     need_resampler = false;
@@ -517,36 +508,35 @@ public:
     need_resampler (input_rate != Params::mark_sample_rate)
   {
     if (need_resampler)
-      {
-        in_resampler.reset (create_resampler (n_channels, input_rate, Params::mark_sample_rate));
-        out_resampler.reset (create_resampler (n_channels, Params::mark_sample_rate, input_rate));
-      }
+      out_resampler.reset (create_resampler (n_channels, Params::mark_sample_rate, input_rate));
   }
   bool
   init_ok()
   {
     if (need_resampler)
-      return (in_resampler && out_resampler);
+      return bool (out_resampler);
     else
       return true;
   }
   vector<float>
-  run (const Key& key, const vector<float>& samples)
+  run (const Key& key, const vector<Spectrum>& spectra)
   {
     if (!need_resampler)
       {
         /* cheap case: if no resampling is necessary, just generate the watermark signal */
-        return wm_gen.run (key, samples);
+        vector<float> wm_samples;
+        for (const auto& spectrum : spectra)
+          {
+            vector<float> frame_samples = wm_gen.run (key, spectrum);
+            wm_samples.insert (wm_samples.end(), frame_samples.begin(), frame_samples.end());
+          }
+        return wm_samples;
       }
 
-    /* resample to the watermark sample rate */
-    in_resampler->write_frames (samples);
-    while (in_resampler->can_read_frames() >= Params::frame_size)
+    for (const auto& spectrum : spectra)
       {
-        vector<float> r_samples = in_resampler->read_frames (Params::frame_size);
-
         /* generate watermark at normalized sample rate */
-        vector<float> wm_samples = wm_gen.run (key, r_samples);
+        vector<float> wm_samples = wm_gen.run (key, spectrum);
 
         /* resample back to the original sample rate of the audio file */
         out_resampler->write_frames (wm_samples);
@@ -555,28 +545,142 @@ public:
     size_t to_read = out_resampler->can_read_frames();
     return out_resampler->read_frames (to_read);
   }
+  /* zeros: number of (zero) frames skipped by WatermarkAnalyzer::skip */
   size_t
   skip (size_t zeros)
   {
     assert (zeros % Params::frame_size == 0);
+
+    size_t out = wm_gen.skip (zeros);
     if (!need_resampler)
-      {
-        return wm_gen.skip (zeros); /* cheap case */
-      }
+      return out; /* cheap case */
     else
+      return out_resampler->skip (out);
+  }
+  int
+  data_blocks() const
+  {
+    return wm_gen.data_blocks();
+  }
+};
+
+/* mixes the watermark signal for one payload to the original signal, applies
+ * the limiter and writes the result to the output stream
+ *
+ * for add-batch, WatermarkAnalyzer output is shared between all outputs
+ */
+class WatermarkOutput
+{
+  const Key&         key;
+  AudioOutputStream *out_stream = nullptr;
+  const int          n_channels = 0;
+  AudioBuffer        audio_buffer;
+  WatermarkResampler wm_resampler;
+  Limiter            limiter;
+
+  /* for signal to noise ratio */
+  double             snr_delta_power = 0;
+  double             snr_signal_power = 0;
+
+  size_t             total_output_frames = 0;
+  size_t             zero_frames_out = 0;
+public:
+  WatermarkOutput (const Key& key, const vector<int>& bitvec, AudioOutputStream *out_stream, int n_channels, int sample_rate, size_t zero_frames) :
+    key (key),
+    out_stream (out_stream),
+    n_channels (n_channels),
+    audio_buffer (n_channels),
+    wm_resampler (n_channels, sample_rate, bitvec),
+    limiter (n_channels, sample_rate),
+    zero_frames_out (zero_frames)
+  {
+    limiter.set_block_size_ms (Params::limiter_block_size_ms);
+    limiter.set_ceiling (Params::limiter_ceiling);
+  }
+  bool
+  init_ok()
+  {
+    return wm_resampler.init_ok();
+  }
+  /* skip_frames: zero frames at the start of the input, analyzer_out: result of WatermarkAnalyzer::skip */
+  void
+  skip (size_t skip_frames, size_t analyzer_out)
+  {
+    size_t out = wm_resampler.skip (analyzer_out);
+
+    audio_buffer.write_frames (std::vector<float> ((skip_frames - out) * n_channels));
+
+    out = limiter.skip (out);
+    assert (out < zero_frames_out);
+
+    zero_frames_out -= out;
+    total_output_frames += out;
+  }
+  /* generate watermark signal for the input spectra (from WatermarkAnalyzer) */
+  vector<float>
+  generate (const vector<Spectrum>& spectra)
+  {
+    return wm_resampler.run (key, spectra);
+  }
+  /* mix watermark signal to input samples and apply limiter, returns the samples to write */
+  vector<float>
+  mix (const vector<float>& in_samples, vector<float> samples, size_t total_input_frames)
+  {
+    audio_buffer.write_frames (in_samples);
+    size_t to_read = samples.size() / n_channels;
+    vector<float> orig_samples  = audio_buffer.read_frames (to_read);
+    assert (samples.size() == orig_samples.size());
+
+    if (Params::snr)
       {
-        /* resample to the watermark sample rate */
-        size_t out = in_resampler->skip (zeros);
+        for (size_t i = 0; i < samples.size(); i++)
+          {
+            const double orig  = orig_samples[i]; // original sample
+            const double delta = samples[i];      // watermark
 
-        out = wm_gen.skip (out);
+            snr_delta_power += delta * delta;
+            snr_signal_power += orig * orig;
+          }
+      }
+    for (size_t i = 0; i < samples.size(); i++)
+      samples[i] += orig_samples[i];
 
-        return out_resampler->skip (out);
+    if (!Params::test_no_limiter)
+      samples = limiter.process (samples);
+
+    size_t max_write_frames = total_input_frames - total_output_frames;
+    if (samples.size() > max_write_frames * n_channels)
+      samples.resize (max_write_frames * n_channels);
+
+    const size_t cut_frames = min (samples.size() / n_channels, zero_frames_out);
+    if (cut_frames > 0)
+      {
+        samples.erase (samples.begin(), samples.begin() + cut_frames * n_channels);
+        total_output_frames += cut_frames;
+        zero_frames_out -= cut_frames;
       }
+    total_output_frames += samples.size() / n_channels;
+    return samples;
+  }
+  Error
+  process (const vector<float>& in_samples, const vector<Spectrum>& spectra, size_t total_input_frames)
+  {
+    return out_stream->write_frames (mix (in_samples, generate (spectra), total_input_frames));
+  }
+  size_t
+  output_frames() const
+  {
+    return total_output_frames;
+  }
+  double
+  snr() const
+  {
+    return 10 * log10 (snr_signal_power / snr_delta_power);
   }
   int
   data_blocks() const
   {
-    return wm_gen.data_blocks();
+    return wm_resampler.data_blocks();
   }
 };
 
@@ -589,6 +693,354 @@ info_format (const string& label, const RawFormat& format)
       format.endian() == RawFormat::Endian::LITTLE ? "little" : "big");
 }
 
+/* one frame of input data, passed through the add_stream_watermark pipeline */
+struct PipelineFrame
+{
+  vector<float>         samples;
+  vector<Spectrum>      spectra;
+  vector<float>         wm_samples;
+  size_t                input_frames = 0;       /* actual input sample frames in samples (without padding) */
+  size_t                total_input_frames = 0;
+  bool                  short_read = false;
+};
+
+static void
+info_input_stream (AudioInputStream *in_stream)
+{
+  if (in_stream->n_frames() == AudioInputStream::N_FRAMES_UNKNOWN)
+    {
+      info ("Time:         unknown\n");
+    }
+  else
+    {
+      size_t orig_seconds = in_stream->n_frames() / in_stream->sample_rate();
+      info ("Time:         %zd:%02zd\n", orig_seconds / 60, orig_seconds % 60);
+    }
+  info ("Sample Rate:  %d\n", in_stream->sample_rate());
+  info ("Channels:     %d\n", in_stream->n_channels());
+}
+
+static int
+close_output (AudioInputStream *in_stream, AudioOutputStream *out_stream, size_t zero_frames, size_t output_frames)
+{
+  if (in_stream->n_frames() != AudioInputStream::N_FRAMES_UNKNOWN)
+    {
+      const size_t expect_frames = in_stream->n_frames() + zero_frames;
+      if (output_frames != expect_frames)
+        {
+          auto msg = string_printf ("unexpected EOF; input frames (%zd) != output frames (%zd)", expect_frames, output_frames);
+          if (Params::strict)
+            {
+              error ("audiowmark: error: %s\n", msg.c_str());
+              return 1;
+            }
+          warning ("audiowmark: warning: %s\n", msg.c_str());
+        }
+    }
+
+  Error err = out_stream->close();
+  if (err)
+    {
+      error ("audiowmark: closing output stream failed: %s\n", err.message());
+      return 1;
+    }
+  return 0;
+}
+
+/* one chunk of the input for add --jobs */
+struct AddChunk
+{
+  size_t        in_start = 0;     /* position of in_samples (input frames) */
+  size_t        first_frame = 0;  /* first analyzed frame (in units of Params::frame_size at Params::mark_sample_rate) */
+  size_t        end_frame = 0;    /* analyzed frames are [first_frame, end_frame) */
+  size_t        wm_start = 0;     /* first watermark sample at Params::mark_sample_rate used for the output */
+  size_t        limiter_start = 0;
+  size_t        mix_end = 0;
+  size_t        out_start = 0;
+  size_t        out_end = 0;
+  bool          last = false;
+  vector<float> in_samples;
+  vector<float> out_samples;
+  double        snr_delta_power = 0;
+  double        snr_signal_power = 0;
+  size_t        frames = 0;
+  size_t        silent_frames = 0;
+};
+
+/* input frames <-> frames at Params::mark_sample_rate (both positions need to be exact multiples of the resampler period) */
+static size_t
+in_to_mark (size_t pos, int sample_rate)
+{
+  return uint64_t (pos) * Params::mark_sample_rate / sample_rate;
+}
+
+static size_t
+mark_to_in (size_t pos, int sample_rate)
+{
+  return uint64_t (pos) * sample_rate / Params::mark_sample_rate;
+}
+
+/* watermark one chunk: the output for [out_start, out_end) is identical to the output of a serial run
+ *
+ * the chunk starts one frame early to warm up the synthesis overlap-add, and
+ * the limiter starts one limiter block before out_start to get the same state;
+ * if resampling is necessary, both resamplers start at a multiple of the
+ * resampler period and the warm-up output is discarded
+ */
+static void
+add_chunk_watermark (const Key& key, const vector<int>& bitvec, int n_channels, int sample_rate, AddChunk& chunk)
+{
+  WatermarkGen wm_gen (n_channels, bitvec);
+  FFTAnalyzer  fft_analyzer (n_channels);
+  Limiter      limiter (n_channels, sample_rate);
+  limiter.set_block_size_ms (Params::limiter_block_size_ms);
+  limiter.set_ceiling (Params::limiter_ceiling);
+
+  const bool   need_resampler = sample_rate != Params::mark_sample_rate;
+  const size_t frame_values   = Params::frame_size * n_channels;
+
+  /* input at Params::mark_sample_rate, starting at chunk.first_frame */
+  vector<float> resampled;
+  if (need_resampler)
+    {
+      std::unique_ptr<ResamplerImpl> in_resampler (create_resampler (n_channels, sample_rate, Params::mark_sample_rate));
+
+      in_resampler->write_frames (chunk.in_samples);
+      in_resampler->read_frames (chunk.first_frame * Params::frame_size - in_to_mark (chunk.in_start, sample_rate));
+      resampled = in_resampler->read_frames (in_resampler->can_read_frames());
+    }
+  const vector<float>& mark_samples = need_resampler ? resampled : chunk.in_samples;
+
+  /* watermark signal at Params::mark_sample_rate, starting at chunk.first_frame */
+  vector<float> wm_samples;
+  wm_gen.seek (chunk.first_frame);
+  for (size_t f = chunk.first_frame; f < chunk.end_frame; f++)
+    {
+      const size_t offset = (f - chunk.first_frame) * frame_values;
+      assert (offset + frame_values <= mark_samples.size());
+
+      vector<float> frame (mark_samples.begin() + offset, mark_samples.begin() + offset + frame_values);
+      Spectrum spectrum = analyze_frame (fft_analyzer, frame, n_channels);
+
+      /* count each frame of the input once (the chunks overlap) */
+      const uint64_t frame_start = uint64_t (f * Params::frame_size) * sample_rate;
+      if (frame_start >= uint64_t (chunk.out_start) * Params::mark_sample_rate && frame_start < uint64_t (chunk.out_end) * Params::mark_sample_rate)
+        {
+          chunk.frames++;
+          chunk.silent_frames += spectrum.empty();
+        }
+      /* the watermark for frame f - 1 is generated while analyzing frame f */
+      vector<float> samples = wm_gen.run (key, spectrum);
+      wm_samples.insert (wm_samples.end(), samples.begin(), samples.end());
+    }
+  size_t wm_pos = chunk.first_frame * Params::frame_size; /* position of wm_samples (input frames) */
+  if (need_resampler)
+    {
+      std::unique_ptr<ResamplerImpl> out_resampler (create_resampler (n_channels, Params::mark_sample_rate, sample_rate));
+
+      out_resampler->write_frames (vector<float> (wm_samples.begin() + (chunk.wm_start - wm_pos) * n_channels, wm_samples.end()));
+      wm_samples = out_resampler->read_frames (out_resampler->can_read_frames());
+      wm_pos = mark_to_in (chunk.wm_start, sample_rate);
+    }
+
+  /* mix watermark to the original signal and apply the limiter, output frames start at chunk.limiter_start */
+  size_t out_pos = chunk.limiter_start;
+  for (size_t pos = chunk.limiter_start; out_pos < chunk.out_end; pos += Params::frame_size)
+    {
+      assert (pos < chunk.mix_end);
+
+      const size_t n_values  = min (chunk.mix_end - pos, Params::frame_size) * n_channels;
+      const size_t wm_offset = (pos - wm_pos) * n_channels;
+      const size_t in_offset = (pos - chunk.in_start) * n_channels;
+      assert (wm_offset + n_values <= wm_samples.size());
+      assert (in_offset + n_values <= chunk.in_samples.size());
+
+      vector<float> samples (wm_samples.begin() + wm_offset, wm_samples.begin() + wm_offset + n_values);
+
+      const float *orig_samples = &chunk.in_samples[in_offset];
+      for (size_t i = 0; i < samples.size(); i++)
+        {
+          if (Params::snr && pos + i / n_channels >= chunk.out_start && (pos + i / n_channels < chunk.out_end || chunk.last))
+            {
+              const double orig  = orig_samples[i]; // original sample
+              const double delta = samples[i];      // watermark
+
+              chunk.snr_delta_power += delta * delta;
+              chunk.snr_signal_power += orig * orig;
+            }
+          samples[i] += orig_samples[i];
+        }
+
+      if (!Params::test_no_limiter)
+        samples = limiter.process (samples);
+
+      for (size_t i = 0; i < samples.size(); i += n_channels)
+        {
+          if (out_pos >= chunk.out_start && out_pos < chunk.out_end)
+            chunk.out_samples.insert (chunk.out_samples.end(), samples.begin() + i, samples.begin() + i + n_channels);
+          out_pos++;
+        }
+    }
+}
+
+static int
+add_stream_watermark_jobs (const Key& key, const vector<int>& bitvec, AudioInputStream *in_stream, AudioOutputStream *out_stream)
+{
+  const int    n_channels  = in_stream->n_channels();
+  const int    sample_rate = in_stream->sample_rate();
+  const size_t n_frames    = in_stream->n_frames();
+
+  Limiter limiter (n_channels, sample_rate);
+  limiter.set_block_size_ms (Params::limiter_block_size_ms);
+  const size_t limiter_block = limiter.get_block_size();
+  const size_t chunk_frames  = 30 * limiter_block;
+
+  /* resamplers restart at multiples of the period and discard the warm-up output (longer than the resampler filter) */
+  const bool   need_resampler = sample_rate != Params::mark_sample_rate;
+  const size_t period         = need_resampler ? resampler_period (sample_rate, Params::mark_sample_rate) : 1;
+  const size_t mark_period    = in_to_mark (period, sample_rate);
+  const size_t warmup         = need_resampler ? Params::frame_size : 0;
+  assert (period > 0);
+
+  /* compute which input is necessary to produce the output for [out_start, out_end) */
+  auto setup_chunk = [&] (size_t out_start)
+    {
+      AddChunk chunk;
+      chunk.out_start = out_start;
+      chunk.out_end   = min (out_start + chunk_frames, n_frames);
+      chunk.last      = (chunk.out_end == n_frames);
+
+      /* range of frames for mixing: limiter needs one block before and after the output */
+      if (Params::test_no_limiter)
+        {
+          chunk.limiter_start = chunk.out_start;
+          chunk.mix_end = chunk.out_end;
+        }
+      else
+        {
+          chunk.limiter_start = chunk.out_start >= limiter_block ? chunk.out_start - limiter_block : 0;
+          chunk.mix_end = ((chunk.out_end + limiter_block - 1) / limiter_block + 1) * limiter_block;
+        }
+      /* watermark signal (at mark sample rate) */
+      if (chunk.limiter_start >= warmup)
+        chunk.wm_start = (chunk.limiter_start - warmup) / period * mark_period;
+      chunk.first_frame = chunk.wm_start / Params::frame_size;
+      if (chunk.first_frame > 0)
+        chunk.first_frame--;
+
+      const size_t wm_end = (uint64_t (chunk.mix_end) * Params::mark_sample_rate + sample_rate - 1) / sample_rate + warmup;
+      chunk.end_frame = (wm_end + Params::frame_size - 1) / Params::frame_size + 1;
+
+      /* input frames */
+      const size_t mark_start = chunk.first_frame * Params::frame_size;
+      if (mark_start >= warmup)
+        chunk.in_start = (mark_start - warmup) / mark_period * period;
+
+      return chunk;
+    };
+  /* input frames needed for a chunk: [chunk.in_start, chunk_in_end (chunk)) */
+  auto chunk_in_end = [&] (const AddChunk& chunk)
+    {
+      const size_t mark_end = chunk.end_frame * Params::frame_size + warmup;
+      return mark_to_in ((mark_end + mark_period - 1) / mark_period * mark_period, sample_rate);
+    };
+
+  /* input data, starting at frame input_start */
+  vector<float> input;
+  size_t        input_start = 0;
+  bool          input_eof = false;
+
+  double      snr_delta_power = 0;
+  double      snr_signal_power = 0;
+  size_t      output_frames = 0;
+  size_t      total_calls = 0;
+  size_t      total_frames = 0;
+  size_t      silent_frames = 0;
+  ThreadPool& thread_pool = shared_thread_pool();
+  while (output_frames < n_frames)
+    {
+      /* setup chunks for the next Params::add_jobs threads */
+      vector<AddChunk> chunks;
+      for (size_t out_start = output_frames; out_start < n_frames && chunks.size() < size_t (Params::add_jobs); out_start += chunk_frames)
+        {
+          AddChunk chunk = setup_chunk (out_start);
+          if (chunk.last)
+            total_calls = chunk.end_frame;
+
+          const size_t in_start = chunk.in_start;
+          const size_t in_end   = chunk_in_end (chunk);
+          while (!input_eof && input_start + input.size() / n_channels < min (in_end, n_frames))
+            {
+              vector<float> samples;
+              Error err = in_stream->read_frames (samples, Params::frame_size);
+              if (err)
+                {
+                  error ("audiowmark: input stream read failed: %s\n", err.message());
+                  return 1;
+                }
+              if (samples.empty())
+                input_eof = true;
+              input.insert (input.end(), samples.begin(), samples.end());
+            }
+          if (input_start + input.size() / n_channels < min (in_end, n_frames))
+            {
+              error ("audiowmark: unexpected EOF; input frames (%zd) != expected frames (%zd)\n", input_start + input.size() / n_channels, n_frames);
+              return 1;
+            }
+
+          /* zero sample padding after the actual input */
+          chunk.in_samples.resize ((in_end - in_start) * n_channels);
+          const size_t copy_end = min (in_end, input_start + input.size() / n_channels);
+          std::copy (input.begin() + (in_start - input_start) * n_channels, input.begin() + (copy_end - input_start) * n_channels, chunk.in_samples.begin());
+
+          chunks.push_back (std::move (chunk));
+        }
+
+      /* watermark chunks in parallel */
+      thread_pool.parallel_for (0, chunks.size(), 1, [&] (size_t i)
+        {
+          add_chunk_watermark (key, bitvec, n_channels, sample_rate, chunks[i]);
+        });
+
+      for (auto& chunk : chunks)
+        {
+          assert (chunk.out_samples.size() == (chunk.out_end - chunk.out_start) * n_channels);
+
+          Error err = out_stream->write_frames (chunk.out_samples);
+          if (err)
+            {
+              error ("audiowmark output write failed: %s\n", err.message());
+              return 1;
+            }
+          output_frames = chunk.out_end;
+          snr_delta_power  += chunk.snr_delta_power;
+          snr_signal_power += chunk.snr_signal_power;
+          total_frames     += chunk.frames;
+          silent_frames    += chunk.silent_frames;
+        }
+
+      /* discard input that is no longer needed */
+      if (output_frames < n_frames)
+        {
+          const size_t keep_from = min (setup_chunk (output_frames).in_start, input_start + input.size() / n_channels);
+          if (keep_from > input_start)
+            {
+              input.erase (input.begin(), input.begin() + (keep_from - input_start) * n_channels);
+              input_start = keep_from;
+            }
+        }
+    }
+
+  if (Params::snr)
+    info ("SNR:          %f dB\n", 10 * log10 (snr_signal_power / snr_delta_power));
+
+  info ("Data Blocks:  %d\n", WatermarkGen::count_data_blocks (total_calls));
+  if (silent_frames)
+    info ("Silence:      %.1f%% of the frames skipped\n", 100.0 * silent_frames / total_frames);
+
+  return close_output (in_stream, out_stream, 0, output_frames);
+}
+
 int
 add_stream_watermark (const Key& key, AudioInputStream *in_stream, AudioOutputStream *out_stream, const string& bits, size_t zero_frames)
 {
@@ -612,153 +1064,195 @@ add_stream_watermark (const Key& key, AudioInputStream *in_stream, AudioOutputSt
   info ("Message:      %s\n", bit_vec_to_str (bitvec).c_str());
   info ("Strength:     %.6g\n\n", Params::water_delta * 1000);
 
-  if (in_stream->n_frames() == AudioInputStream::N_FRAMES_UNKNOWN)
-    {
-      info ("Time:         unknown\n");
-    }
-  else
+  info_input_stream (in_stream);
+
+  if (Params::add_jobs > 1)
     {
-      size_t orig_seconds = in_stream->n_frames() / in_stream->sample_rate();
-      info ("Time:         %zd:%02zd\n", orig_seconds / 60, orig_seconds % 60);
+      /* chunk parallel watermarking: chunks can only be resampled separately if the resampler phase is periodic */
+      const int  sample_rate = in_stream->sample_rate();
+      const bool rate_ok     = sample_rate == Params::mark_sample_rate ||
+                               (resampler_period (sample_rate, Params::mark_sample_rate) && resampler_period (Params::mark_sample_rate, sample_rate));
+
+      if (zero_frames != 0)
+        warning ("audiowmark: --jobs is not supported for HLS segments, using one job\n");
+      else if (in_stream->n_frames() == AudioInputStream::N_FRAMES_UNKNOWN || in_stream->n_frames() == 0)
+        warning ("audiowmark: --jobs needs input with known length, using one job\n");
+      else if (!rate_ok)
+        warning ("audiowmark: --jobs is not supported for sample rate %d, using one job\n", sample_rate);
+      else
+        return add_stream_watermark_jobs (key, bitvec, in_stream, out_stream);
     }
-  info ("Sample Rate:  %d\n", in_stream->sample_rate());
-  info ("Channels:     %d\n", in_stream->n_channels());
-
-  vector<float> samples;
 
   const int n_channels = in_stream->n_channels();
-  AudioBuffer audio_buffer (n_channels);
-  WatermarkResampler wm_resampler (n_channels, in_stream->sample_rate(), bitvec);
-  if (!wm_resampler.init_ok())
+  WatermarkAnalyzer wm_analyzer (n_channels, in_stream->sample_rate());
+  WatermarkOutput   wm_output (key, bitvec, out_stream, n_channels, in_stream->sample_rate(), zero_frames);
+  if (!wm_analyzer.init_ok() || !wm_output.init_ok())
     return 1;
 
-  Limiter limiter (n_channels, in_stream->sample_rate());
-  limiter.set_block_size_ms (Params::limiter_block_size_ms);
-  limiter.set_ceiling (Params::limiter_ceiling);
-
-  /* for signal to noise ratio */
-  double snr_delta_power = 0;
-  double snr_signal_power = 0;
-
   size_t total_input_frames = 0;
-  size_t total_output_frames = 0;
   size_t zero_frames_in  = zero_frames;
-  size_t zero_frames_out = zero_frames;
-  Error err;
   if (zero_frames_in >= Params::frame_size)
     {
       const size_t skip_frames = zero_frames_in - zero_frames_in % Params::frame_size;
 
       total_input_frames += skip_frames;
-      size_t out = wm_resampler.skip (skip_frames);
-
-      audio_buffer.write_frames (std::vector<float> ((skip_frames - out) * n_channels));
-
-      out = limiter.skip (out);
-      assert (out < zero_frames_out);
-
-      zero_frames_out -= out;
-      total_output_frames += out;
+      wm_output.skip (skip_frames, wm_analyzer.skip (skip_frames));
       zero_frames_in -= skip_frames;
     }
-  while (true)
+  Error read_err;
+  Error write_err;
+
+  /* reads one frame; zero sample padding after the actual input is done until the caller stops reading */
+  auto read_frame = [&] (PipelineFrame& frame)
     {
       if (zero_frames_in > 0)
         {
-          err = in_stream->read_frames (samples, Params::frame_size - zero_frames_in);
-          samples.insert (samples.begin(), zero_frames_in * n_channels, 0);
+          read_err = in_stream->read_frames (frame.samples, Params::frame_size - zero_frames_in);
+          frame.samples.insert (frame.samples.begin(), zero_frames_in * n_channels, 0);
           zero_frames_in = 0;
         }
       else
         {
-          err = in_stream->read_frames (samples, Params::frame_size);
+          read_err = in_stream->read_frames (frame.samples, Params::frame_size);
         }
-      if (err)
+      if (read_err)
+        return false;
+
+      frame.input_frames = frame.samples.size() / n_channels;
+      total_input_frames += frame.input_frames;
+      frame.total_input_frames = total_input_frames;
+      if (frame.samples.size() < Params::frame_size * n_channels)
         {
-          error ("audiowmark: input stream read failed: %s\n", err.message());
-          return 1;
+          frame.short_read = true;
+          frame.samples.resize (Params::frame_size * n_channels);
         }
-      total_input_frames += samples.size() / n_channels;
+      return true;
+    };
+  /* true if all output was written for this frame */
+  auto last_frame = [&] (const PipelineFrame& frame)
+    {
+      return frame.short_read && frame.total_input_frames == wm_output.output_frames();
+    };
 
-      if (samples.size() < Params::frame_size * n_channels)
+  if (shared_thread_pool().n_threads() == 1)
+    {
+      /* --threads 1: run all stages in this thread */
+      while (true)
         {
-          if (total_input_frames == total_output_frames)
+          PipelineFrame frame;
+          if (!read_frame (frame))
             break;
 
-          /* zero sample padding after the actual input */
-          samples.resize (Params::frame_size * n_channels);
+          frame.spectra = wm_analyzer.run (frame.samples, frame.input_frames);
+          frame.wm_samples = wm_output.generate (frame.spectra);
+          if (last_frame (frame))
+            break;
+
+          write_err = out_stream->write_frames (wm_output.mix (frame.samples, std::move (frame.wm_samples), frame.total_input_frames));
+          if (write_err)
+            break;
         }
-      audio_buffer.write_frames (samples);
-      samples = wm_resampler.run (key, samples);
-      size_t to_read = samples.size() / n_channels;
-      vector<float> orig_samples  = audio_buffer.read_frames (to_read);
-      assert (samples.size() == orig_samples.size());
+    }
+  else
+    {
+      /* watermarking pipeline: each stage runs in its own thread, stages are connected by queues
+       *
+       *   read -> analyze -> generate -> mix/limiter -> write
+       *
+       * the stage threads are not taken from the thread pool: they block on the
+       * queues most of the time, and only analyze and generate need much cpu
+       */
+      const size_t queue_size = 16;
+      BoundedQueue<PipelineFrame> read_queue (queue_size);
+      BoundedQueue<PipelineFrame> analyze_queue (queue_size);
+      BoundedQueue<PipelineFrame> generate_queue (queue_size);
+      BoundedQueue<vector<float>> write_queue (queue_size);
 
-      if (Params::snr)
+      std::thread read_thread ([&]()
         {
-          for (size_t i = 0; i < samples.size(); i++)
+          while (true)
             {
-              const double orig  = orig_samples[i]; // original sample
-              const double delta = samples[i];      // watermark
-
-              snr_delta_power += delta * delta;
-              snr_signal_power += orig * orig;
+              PipelineFrame frame;
+              if (!read_frame (frame) || !read_queue.push (std::move (frame)))
+                break;
             }
-        }
-      for (size_t i = 0; i < samples.size(); i++)
-        samples[i] += orig_samples[i];
-
-      if (!Params::test_no_limiter)
-        samples = limiter.process (samples);
-
-      size_t max_write_frames = total_input_frames - total_output_frames;
-      if (samples.size() > max_write_frames * n_channels)
-        samples.resize (max_write_frames * n_channels);
-
-      const size_t cut_frames = min (samples.size() / n_channels, zero_frames_out);
-      if (cut_frames > 0)
+          read_queue.close();
+        });
+      std::thread analyze_thread ([&]()
         {
-          samples.erase (samples.begin(), samples.begin() + cut_frames * n_channels);
-          total_output_frames += cut_frames;
-          zero_frames_out -= cut_frames;
-        }
-
-      err = out_stream->write_frames (samples);
-      if (err)
+          PipelineFrame frame;
+          while (read_queue.pop (frame))
+            {
+              frame.spectra = wm_analyzer.run (frame.samples, frame.input_frames);
+              if (!analyze_queue.push (std::move (frame)))
+                break;
+            }
+          read_queue.close();
+          analyze_queue.close();
+        });
+      std::thread generate_thread ([&]()
         {
-          error ("audiowmark output write failed: %s\n", err.message());
-          return 1;
-        }
-      total_output_frames += samples.size() / n_channels;
-    }
-
-  if (Params::snr)
-    info ("SNR:          %f dB\n", 10 * log10 (snr_signal_power / snr_delta_power));
-
-  info ("Data Blocks:  %d\n", wm_resampler.data_blocks());
-
-  if (in_stream->n_frames() != AudioInputStream::N_FRAMES_UNKNOWN)
-    {
-      const size_t expect_frames = in_stream->n_frames() + zero_frames;
-      if (total_output_frames != expect_frames)
+          PipelineFrame frame;
+          while (analyze_queue.pop (frame))
+            {
+              frame.wm_samples = wm_output.generate (frame.spectra);
+              frame.spectra.clear();
+              if (!generate_queue.push (std::move (frame)))
+                break;
+            }
+          analyze_queue.close();
+          generate_queue.close();
+        });
+      std::thread write_thread ([&]()
         {
-          auto msg = string_printf ("unexpected EOF; input frames (%zd) != output frames (%zd)", expect_frames, total_output_frames);
-          if (Params::strict)
+          vector<float> samples;
+          while (write_queue.pop (samples))
             {
-              error ("audiowmark: error: %s\n", msg.c_str());
-              return 1;
+              write_err = out_stream->write_frames (samples);
+              if (write_err)
+                break;
             }
-          warning ("audiowmark: warning: %s\n", msg.c_str());
+          write_queue.close();
+        });
+
+      PipelineFrame frame;
+      while (generate_queue.pop (frame))
+        {
+          if (last_frame (frame))
+            break;
+
+          if (!write_queue.push (wm_output.mix (frame.samples, std::move (frame.wm_samples), frame.total_input_frames)))
+            break;
         }
+      /* stop all stages */
+      generate_queue.close();
+      write_queue.close();
+
+      read_thread.join();
+      analyze_thread.join();
+      generate_thread.join();
+      write_thread.join();
     }
 
-  err = out_stream->close();
-  if (err)
+  if (read_err)
     {
-      error ("audiowmark: closing output stream failed: %s\n", err.message());
+      error ("audiowmark: input stream read failed: %s\n", read_err.message());
       return 1;
     }
-  return 0;
+  if (write_err)
+    {
+      error ("audiowmark output write failed: %s\n", write_err.message());
+      return 1;
+    }
+
+  if (Params::snr)
+    info ("SNR:          %f dB\n", wm_output.snr());
+
+  info ("Data Blocks:  %d\n", wm_output.data_blocks());
+  if (wm_analyzer.silent_fraction() > 0)
+    info ("Silence:      %.1f%% of the frames skipped\n", wm_analyzer.silent_fraction() * 100);
+
+  return close_output (in_stream, out_stream, zero_frames, wm_output.output_frames());
 }
 
 int
@@ -794,4 +1288,177 @@ add_watermark (const Key& key, const string& infile, const string& outfile, cons
   return add_stream_watermark (key, in_stream.get(), out_stream.get(), bits, 0);
 }
 
+int
+add_watermark_batch (const Key& key, const string& infile, const vector<string>& outfiles, const vector<string>& bits_list)
+{
+  assert (outfiles.size() == bits_list.size());
+
+  std::set<string> outfile_set;
+  for (const auto& outfile : outfiles)
+    {
+      if (!outfile_set.insert (outfile).second)
+        {
+          error ("audiowmark: output file '%s' is used more than once in batch\n", outfile.c_str());
+          return 1;
+        }
+    }
+  if (Params::add_jobs > 1)
+    warning ("audiowmark: --jobs has no effect for add-batch, outputs are generated in parallel\n");
+
+  struct BatchOutput
+  {
+    vector<int>                        bitvec;
+    std::unique_ptr<AudioOutputStream> out_stream;
+    std::unique_ptr<WatermarkOutput>   wm_output;
+    bool                               done = false;
+    Error                              err;
+  };
+  vector<BatchOutput> outputs (outfiles.size());
+  for (size_t i = 0; i < outputs.size(); i++)
+    {
+      outputs[i].bitvec = parse_payload (bits_list[i]);
+      if (outputs[i].bitvec.empty())
+        return 1;
+    }
+
+  /* open input stream */
+  Error err;
+  std::unique_ptr<AudioInputStream> in_stream = AudioInputStream::create (infile, err);
+  if (err)
+    {
+      error ("audiowmark: error opening %s: %s\n", infile.c_str(), err.message());
+      return 1;
+    }
+  info ("Input:        %s\n", Params::input_label.size() ? Params::input_label.c_str() : infile.c_str());
+  if (Params::input_format == Format::RAW)
+    info_format ("Raw Input", Params::raw_input_format);
+
+  /* open output streams */
+  const int n_channels    = in_stream->n_channels();
+  const int out_bit_depth = in_stream->bit_depth() > 16 ? 24 : 16;
+  for (size_t i = 0; i < outputs.size(); i++)
+    {
+      outputs[i].out_stream = AudioOutputStream::create (outfiles[i], n_channels, in_stream->sample_rate(), out_bit_depth, in_stream->n_frames(), err);
+      if (err)
+        {
+          error ("audiowmark: error writing to %s: %s\n", outfiles[i].c_str(), err.message());
+          return 1;
+        }
+      outputs[i].wm_output.reset (new WatermarkOutput (key, outputs[i].bitvec, outputs[i].out_stream.get(), n_channels, in_stream->sample_rate(), 0));
+      if (!outputs[i].wm_output->init_ok())
+        return 1;
 
+      info ("Output:       %s\n", outfiles[i].c_str());
+      info ("Message:      %s\n", bit_vec_to_str (outputs[i].bitvec).c_str());
+    }
+  info ("Strength:     %.6g\n\n", Params::water_delta * 1000);
+  info_input_stream (in_stream.get());
+
+  /* input decoding, resampling and analysis is done once, the outputs are generated in parallel */
+  WatermarkAnalyzer wm_analyzer (n_channels, in_stream->sample_rate());
+  if (!wm_analyzer.init_ok())
+    return 1;
+
+  struct BatchFrame
+  {
+    vector<float>         samples;
+    vector<Spectrum>      spectra;
+    size_t                total_input_frames = 0;
+    bool                  short_read = false;
+  };
+  const size_t frames_per_job = 64;
+
+  ThreadPool& thread_pool = shared_thread_pool();
+  size_t      total_input_frames = 0;
+  bool        done = false;
+  while (!done)
+    {
+      vector<BatchFrame> frames (frames_per_job);
+      for (auto& frame : frames)
+        {
+          err = in_stream->read_frames (frame.samples, Params::frame_size);
+          if (err)
+            {
+              error ("audiowmark: input stream read failed: %s\n", err.message());
+              return 1;
+            }
+          const size_t input_frames = frame.samples.size() / n_channels;
+          total_input_frames += input_frames;
+
+          frame.total_input_frames = total_input_frames;
+          if (frame.samples.size() < Params::frame_size * n_channels)
+            {
+              /* zero sample padding after the actual input */
+              frame.short_read = true;
+              frame.samples.resize (Params::frame_size * n_channels);
+            }
+          frame.spectra = wm_analyzer.run (frame.samples, input_frames);
+        }
+      thread_pool.parallel_for (0, outputs.size(), 1, [&] (size_t i)
+        {
+          auto& output = outputs[i];
+          if (output.done)
+            return;
+
+          for (const auto& frame : frames)
+            {
+              if (frame.short_read && frame.total_input_frames == output.wm_output->output_frames())
+                {
+                  output.done = true;
+                  break;
+                }
+              output.err = output.wm_output->process (frame.samples, frame.spectra, frame.total_input_frames);
+              if (output.err)
+                {
+                  output.done = true;
+                  break;
+                }
+            }
+        });
+
+      done = true;
+      for (size_t i = 0; i < outputs.size(); i++)
+        {
+          if (outputs[i].err)
+            {
+              error ("audiowmark: output write failed for %s: %s\n", outfiles[i].c_str(), outputs[i].err.message());
+              return 1;
+            }
+          done = done && outputs[i].done;
+        }
+    }
+
+  if (Params::snr)
+    {
+      for (size_t i = 0; i < outputs.size(); i++)
+        info ("SNR:          %f dB (%s)\n", outputs[i].wm_output->snr(), outfiles[i].c_str());
+    }
+  info ("Data Blocks:  %d\n", outputs[0].wm_output->data_blocks());
+  if (wm_analyzer.silent_fraction() > 0)
+    info ("Silence:      %.1f%% of the frames skipped\n", wm_analyzer.silent_fraction() * 100);
+
+  for (size_t i = 0; i < outputs.size(); i++)
+    {
+      if (in_stream->n_frames() != AudioInputStream::N_FRAMES_UNKNOWN)
+        {
+          const size_t output_frames = outputs[i].wm_output->output_frames();
+          if (output_frames != in_stream->n_frames())
+            {
+              auto msg = string_printf ("unexpected EOF; input frames (%zd) != output frames (%zd)", in_stream->n_frames(), output_frames);
+              if (Params::strict)
+                {
+                  error ("audiowmark: error: %s\n", msg.c_str());
+                  return 1;
+                }
+              warning ("audiowmark: warning: %s\n", msg.c_str());
+            }
+        }
+      err = outputs[i].out_stream->close();
+      if (err)
+        {
+          error ("audiowmark: closing output stream %s failed: %s\n", outfiles[i].c_str(), err.message());
+          return 1;
+        }
+    }
+  return 0;
+}
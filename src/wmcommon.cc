@@ -50,6 +50,12 @@ RawFormat Params::raw_output_format;
 
 int    Params::hls_bit_rate = 0;
 
+size_t Params::max_memory   = 0;
+bool   Params::compact_spectrogram = false;
+double Params::silence_floor = -INFINITY;
+int    Params::add_jobs     = 1;
+int    Params::threads      = 0;
+
 string Params::json_output;
 string Params::input_label;
 string Params::output_label;
@@ -85,80 +91,42 @@ FFTAnalyzer::gen_normalized_window (size_t n_values)
   return window;
 }
 
-vector<vector<complex<float>>>
-FFTAnalyzer::run_fft (const vector<float>& samples, size_t start_index)
+/* store the band window of the spectrum of the frame at start_index as frame of spectrum */
+void
+FFTAnalyzer::run_fft (const vector<float>& samples, size_t start_index, Spectrum& spectrum, size_t frame)
 {
   assert (samples.size() >= (Params::frame_size + start_index) * m_n_channels);
 
-  float *frame     = m_fft_processor.in();
+  run_fft (&samples[start_index * m_n_channels], spectrum, frame);
+}
+
+/* same as above, samples points to Params::frame_size interleaved sample frames */
+void
+FFTAnalyzer::run_fft (const float *samples, Spectrum& spectrum, size_t frame)
+{
+  assert (spectrum.n_channels() == m_n_channels && frame < spectrum.n_frames());
+  assert (spectrum.first_bin() >= 0 && spectrum.first_bin() + spectrum.n_bins() <= int (Params::frame_size / 2 + 1));
+
+  float *frame_in  = m_fft_processor.in();
   float *frame_fft = m_fft_processor.out();
 
-  vector<vector<complex<float>>> fft_out;
   for (int ch = 0; ch < m_n_channels; ch++)
     {
-      size_t pos = start_index * m_n_channels + ch;
-      assert (pos + (Params::frame_size - 1) * m_n_channels < samples.size());
+      size_t pos = ch;
 
       /* deinterleave frame data and apply window */
       for (size_t x = 0; x < Params::frame_size; x++)
         {
-          frame[x] = samples[pos] * m_window[x];
+          frame_in[x] = samples[pos] * m_window[x];
           pos += m_n_channels;
         }
       /* FFT transform */
       m_fft_processor.fft();
 
       /* complex<float> and frame_fft have the same layout in memory */
-      const complex<float> *first = (complex<float> *) frame_fft;
-      const complex<float> *last  = first + Params::frame_size / 2 + 1;
-      fft_out.emplace_back (first, last);
+      const complex<float> *first = (complex<float> *) frame_fft + spectrum.first_bin();
+      std::copy (first, first + spectrum.n_bins(), spectrum.bins (frame, ch));
     }
-
-  return fft_out;
-}
-
-vector<vector<complex<float>>>
-FFTAnalyzer::fft_range (const vector<float>& samples, size_t start_index, size_t frame_count)
-{
-  vector<vector<complex<float>>> fft_out;
-
-  /* if there is not enough space for frame_count values, return an error (empty vector) */
-  if (samples.size() < (start_index + frame_count * Params::frame_size) * m_n_channels)
-    return fft_out;
-
-  for (size_t f = 0; f < frame_count; f++)
-    {
-      const size_t frame_start = (f * Params::frame_size) + start_index;
-
-      vector<vector<complex<float>>> frame_result = run_fft (samples, frame_start);
-      for (auto& fr : frame_result)
-        fft_out.emplace_back (std::move (fr));
-    }
-  return fft_out;
-}
-
-BitPosGen::BitPosGen (const Key& key)
-{
-  int frame_count = mark_data_frame_count() + mark_sync_frame_count();
-  for (int i = 0; i < frame_count; i++)
-    pos_vec.push_back (i);
-
-  Random random (key, 0, Random::Stream::frame_position);
-  random.shuffle (pos_vec);
-}
-
-int
-BitPosGen::sync_frame (int f)
-{
-  assert (f >= 0 && size_t (f) < mark_sync_frame_count());
-  return pos_vec[f];
-}
-
-int
-BitPosGen::data_frame (int f)
-{
-  assert (f >= 0 && size_t (f) < mark_data_frame_count());
-  return pos_vec[f + mark_sync_frame_count()];
 }
 
 size_t
@@ -173,35 +141,38 @@ mark_sync_frame_count()
   return Params::sync_bits * Params::sync_frames_per_bit;
 }
 
-vector<MixEntry>
-gen_mix_entries (const Key& key)
+int
+frame_count (const WavData& wav_data)
 {
-  const int frame_count = mark_data_frame_count();
-  vector<MixEntry> mix_entries (frame_count * Params::bands_per_frame);
-
-  UpDownGen up_down_gen (key, Random::Stream::data_up_down);
-  BitPosGen bit_pos_gen (key);
-  int entry = 0;
-  for (int f = 0; f < frame_count; f++)
-    {
-      const int index = bit_pos_gen.data_frame (f);
-      UpDownArray up, down;
-      up_down_gen.get (f, up, down);
+  return wav_data.n_values() / wav_data.n_channels() / Params::frame_size;
+}
 
-      assert (up.size() == down.size());
-      for (size_t i = 0; i < up.size(); i++)
-        mix_entries[entry++] = { index, up[i], down[i] };
-    }
-  Random random (key, /* seed */ 0, Random::Stream::mix);
-  random.shuffle (mix_entries);
+int
+frame_count (const PaddedWavData& wav_data)
+{
+  return wav_data.n_frames() / Params::frame_size;
+}
 
-  return mix_entries;
+/*
+ * energy is the sum of the squares of the n_values samples of one frame (all
+ * channels); frames which are exactly silent or have a level below
+ * Params::silence_floor contain no watermark, so both, adding and getting the
+ * watermark can skip them
+ */
+bool
+silent_frame (double energy, size_t n_values)
+{
+  if (energy == 0)
+    return true;
+  return 10 * log10 (energy / n_values) < Params::silence_floor;
 }
 
-int
-frame_count (const WavData& wav_data)
+/* process wide thread pool, created on first use (so Params::threads must be set before) */
+ThreadPool&
+shared_thread_pool()
 {
-  return wav_data.n_values() / wav_data.n_channels() / Params::frame_size;
+  static ThreadPool thread_pool (Params::threads > 0 ? Params::threads : ThreadPool::default_thread_count());
+  return thread_pool;
 }
 
 vector<int>
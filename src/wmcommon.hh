@@ -18,6 +18,7 @@
 #ifndef AUDIOWMARK_WM_COMMON_HH
 #define AUDIOWMARK_WM_COMMON_HH
 
+#include <algorithm>
 #include <array>
 #include <complex>
 
@@ -25,6 +26,7 @@
 #include "rawinputstream.hh"
 #include "wavdata.hh"
 #include "fft.hh"
+#include "threadpool.hh"
 
 #include <assert.h>
 
@@ -80,6 +82,12 @@ public:
 
   static           int hls_bit_rate;
 
+  static           size_t max_memory;             // memory budget for get (in bytes, 0: unlimited)
+  static           bool   compact_spectrogram;    // store sync search spectrogram as 16 bit values
+  static           double silence_floor;          // frames below this level (dBFS) are skipped
+  static           int    add_jobs;               // number of chunks to watermark in parallel
+  static           int    threads;                // number of worker threads (0: auto detect)
+
   // input/output labels can be set for pretty output for videowmark add
   static           std::string input_label;
   static           std::string output_label;
@@ -119,14 +127,57 @@ public:
   }
 };
 
-class BitPosGen
+/*
+ * spectrum of n_frames frames, stored contiguously as [frame][channel][bin]
+ *
+ * only the bins [first_bin, first_bin + n_bins) are stored (band window), so
+ * code which only needs the watermark bands doesn't keep the full FFT output
+ */
+class Spectrum
 {
-  std::vector<int> pos_vec;
-
+  std::vector<std::complex<float>> m_bins;
+  size_t m_n_frames = 0;
+  int    m_n_channels = 0;
+  int    m_first_bin = 0;
+  int    m_n_bins = 0;
 public:
-  BitPosGen (const Key& key);
-  int sync_frame (int f);
-  int data_frame (int f);
+  Spectrum() = default;
+  Spectrum (size_t n_frames, int n_channels, int first_bin = 0, int n_bins = Params::frame_size / 2 + 1) :
+    m_bins (n_frames * n_channels * n_bins),
+    m_n_frames (n_frames),
+    m_n_channels (n_channels),
+    m_first_bin (first_bin),
+    m_n_bins (n_bins)
+  {
+  }
+  /* spectrum of one frame, restricted to the watermark bands */
+  static Spectrum
+  bands (int n_channels)
+  {
+    return Spectrum (1, n_channels, Params::min_band, Params::max_band - Params::min_band + 1);
+  }
+  bool   empty() const      { return m_bins.empty(); }
+  size_t n_frames() const   { return m_n_frames; }
+  int    n_channels() const { return m_n_channels; }
+  int    first_bin() const  { return m_first_bin; }
+  int    n_bins() const     { return m_n_bins; }
+
+  /* bins of one frame/channel: bins (frame, ch)[i] is bin first_bin + i */
+  std::complex<float> *
+  bins (size_t frame, int ch)
+  {
+    return &m_bins[(frame * m_n_channels + ch) * m_n_bins];
+  }
+  const std::complex<float> *
+  bins (size_t frame, int ch) const
+  {
+    return &m_bins[(frame * m_n_channels + ch) * m_n_bins];
+  }
+  void
+  clear_bins()
+  {
+    std::fill (m_bins.begin(), m_bins.end(), 0);
+  }
 };
 
 class FFTAnalyzer
@@ -137,8 +188,8 @@ class FFTAnalyzer
 public:
   FFTAnalyzer (int n_channels);
 
-  std::vector<std::vector<std::complex<float>>> run_fft (const std::vector<float>& samples, size_t start_index);
-  std::vector<std::vector<std::complex<float>>> fft_range (const std::vector<float>& samples, size_t start_index, size_t frame_count);
+  void run_fft (const std::vector<float>& samples, size_t start_index, Spectrum& spectrum, size_t frame = 0);
+  void run_fft (const float *samples, Spectrum& spectrum, size_t frame = 0);
 
   static std::vector<float> gen_normalized_window (size_t n_values);
 };
@@ -150,36 +201,17 @@ struct MixEntry
   int  down;
 };
 
-std::vector<MixEntry> gen_mix_entries (const Key& key);
-
 size_t mark_data_frame_count();
 size_t mark_sync_frame_count();
 
 int frame_count (const WavData& wav_data);
+int frame_count (const PaddedWavData& wav_data);
 
-std::vector<int> parse_payload (const std::string& str);
-
-template<class T> std::vector<T>
-randomize_bit_order (const Key& key, const std::vector<T>& bit_vec, bool encode)
-{
-  std::vector<unsigned int> order;
-
-  for (size_t i = 0; i < bit_vec.size(); i++)
-    order.push_back (i);
+bool silent_frame (double energy, size_t n_values);
 
-  Random random (key, /* seed */ 0, Random::Stream::bit_order);
-  random.shuffle (order);
+ThreadPool& shared_thread_pool();
 
-  std::vector<T> out_bits (bit_vec.size());
-  for (size_t i = 0; i < bit_vec.size(); i++)
-    {
-      if (encode)
-        out_bits[i] = bit_vec[order[i]];
-      else
-        out_bits[order[i]] = bit_vec[i];
-    }
-  return out_bits;
-}
+std::vector<int> parse_payload (const std::string& str);
 
 inline double
 window_cos (double x) /* von Hann window */
@@ -222,6 +254,7 @@ db_from_complex (std::complex<float> f, float min_dB)
 
 int add_stream_watermark (const Key& key, AudioInputStream *in_stream, AudioOutputStream *out_stream, const std::string& bits, size_t zero_frames);
 int add_watermark (const Key& key, const std::string& infile, const std::string& outfile, const std::string& bits);
+int add_watermark_batch (const Key& key, const std::string& infile, const std::vector<std::string>& outfiles, const std::vector<std::string>& bits_list);
 int get_watermark (const std::vector<Key>& key_list, const std::string& infile, const std::string& orig_pattern);
 
 #endif /* AUDIOWMARK_WM_COMMON_HH */
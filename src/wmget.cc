@@ -17,6 +17,7 @@
 
 #include <string>
 #include <algorithm>
+#include <future>
 
 #include "wavdata.hh"
 #include "wmcommon.hh"
@@ -24,6 +25,8 @@
 #include "convcode.hh"
 #include "shortcode.hh"
 #include "syncfinder.hh"
+#include "spectrogram.hh"
+#include "keyschedule.hh"
 #include "resample.hh"
 #include "fft.hh"
 #include "threadpool.hh"
@@ -61,102 +64,89 @@ normalize_soft_bits (const vector<float>& soft_bits)
   return norm_soft_bits;
 }
 
+/* 8 values, unaligned loads are allowed */
+typedef float DiffVec __attribute__ ((vector_size (32), aligned (4), may_alias));
+
+/*
+ * decode data bits of the block which starts at first_frame, neighbour frames are taken from the same block
+ *
+ * each dB value used for a bit is compared against the average of its two neighbour frames; we compute
+ * these differences once for all bands of every data frame (diff_db), so that accumulating a bit is just
+ * a gather of its up and down bands with precomputed offsets
+ */
 static vector<float>
-mix_decode (const Key& key, vector<vector<complex<float>>>& fft_out, int n_channels)
+mix_or_linear_decode (const KeySchedule& key_schedule, const Spectrogram::Frames& frames, size_t first_frame)
 {
-  vector<float> raw_bit_vec;
+  const vector<MixEntry>& entries = Params::mix ? key_schedule.mix_entries() : key_schedule.data_entries();
 
-  const int frame_count = mark_data_frame_count();
+  const int    frame_count = mark_data_frame_count();
+  const int    block_frames = mark_sync_frame_count() + mark_data_frame_count();
+  const size_t n_bands = Spectrogram::n_bands();
+  const size_t row_size = frames.n_channels * n_bands;
 
-  vector<MixEntry> mix_entries = gen_mix_entries (key);
-
-  double umag = 0, dmag = 0;
+  /* diff_db[data frame][channel][band - Params::min_band] */
+  vector<float> diff_db (frame_count * row_size);
+  vector<int>   frame_row (block_frames, -1);
+  vector<float> buffer (3 * row_size);
   for (int f = 0; f < frame_count; f++)
     {
-      for (int ch = 0; ch < n_channels; ch++)
-        {
-          for (size_t frame_b = 0; frame_b < Params::bands_per_frame; frame_b++)
-            {
-              int b = f * Params::bands_per_frame + frame_b;
-              const double min_db = -96;
+      const int frame = key_schedule.data_frame (f);
+      const int next_frame = (frame + 1) < block_frames ? frame + 1 : frame - 1;
+      const int prev_frame = (frame - 1) >= 0 ? frame - 1 : frame + 1;
 
-              const size_t index = mix_entries[b].frame * n_channels + ch;
-              const size_t next_index = (index + n_channels) < fft_out.size() ? index + n_channels : index - n_channels;
-              const size_t prev_index = (int (index) - n_channels) >= 0 ? index - n_channels : index + n_channels;
+      const float *db      = frames.frame_db (first_frame + frame, &buffer[0]);
+      const float *prev_db = frames.frame_db (first_frame + prev_frame, &buffer[row_size]);
+      const float *next_db = frames.frame_db (first_frame + next_frame, &buffer[2 * row_size]);
 
-              const int u = mix_entries[b].up;
-              const int d = mix_entries[b].down;
+      float *diff = &diff_db[f * row_size];
+      for (size_t i = 0; i < row_size; i++)
+        diff[i] = db[i] - 0.5f * (prev_db[i] + next_db[i]);
 
-              umag += db_from_complex (fft_out[index][u], min_db);
-              umag -= (db_from_complex (fft_out[prev_index][u], min_db) + db_from_complex (fft_out[next_index][u], min_db)) * 0.5;
-
-              dmag += db_from_complex (fft_out[index][d], min_db);
-              dmag -= (db_from_complex (fft_out[prev_index][d], min_db) + db_from_complex (fft_out[next_index][d], min_db)) * 0.5;
-            }
-        }
-      if ((f % Params::frames_per_bit) == (Params::frames_per_bit - 1))
-        {
-          raw_bit_vec.push_back (umag - dmag);
-          umag = 0;
-          dmag = 0;
-        }
+      frame_row[frame] = f;
     }
-  return raw_bit_vec;
-}
-
-static vector<float>
-linear_decode (const Key& key, vector<vector<complex<float>>>& fft_out, int n_channels)
-{
-  UpDownGen     up_down_gen (key, Random::Stream::data_up_down);
-  BitPosGen     bit_pos_gen (key);
-  vector<float> raw_bit_vec;
 
-  const int frame_count = mark_data_frame_count();
+  const size_t entries_per_bit = Params::frames_per_bit * Params::bands_per_frame;
+  vector<int> up_offset (entries_per_bit);
+  vector<int> down_offset (entries_per_bit);
 
-  double umag = 0, dmag = 0;
-  for (int f = 0; f < frame_count; f++)
+  vector<float> raw_bit_vec (entries.size() / entries_per_bit);
+  for (size_t bit = 0; bit < raw_bit_vec.size(); bit++)
     {
-      for (int ch = 0; ch < n_channels; ch++)
+      for (size_t i = 0; i < entries_per_bit; i++)
         {
-          const size_t index = bit_pos_gen.data_frame (f) * n_channels + ch;
-          const size_t next_index = (index + n_channels) < fft_out.size() ? index + n_channels : index - n_channels;
-          const size_t prev_index = (int (index) - n_channels) >= 0 ? index - n_channels : index + n_channels;
-
-          UpDownArray up, down;
-          up_down_gen.get (f, up, down);
+          const MixEntry& entry = entries[bit * entries_per_bit + i];
+          const int row_offset = frame_row[entry.frame] * int (row_size) - Params::min_band;
 
-          const double min_db = -96;
-          for (auto u : up)
-            {
-              umag += db_from_complex (fft_out[index][u], min_db);
-              umag -= 0.5 * (db_from_complex (fft_out[prev_index][u], min_db) + db_from_complex (fft_out[next_index][u], min_db));
-            }
+          up_offset[i]   = row_offset + entry.up;
+          down_offset[i] = row_offset + entry.down;
+        }
+      double mag = 0;
+      for (int ch = 0; ch < frames.n_channels; ch++)
+        {
+          const float *diff = &diff_db[ch * n_bands];
+          const int *up = &up_offset[0];
+          const int *down = &down_offset[0];
 
-          for (auto d : down)
+          DiffVec acc = { 0, };
+          size_t i = 0;
+          for (; i + 8 <= entries_per_bit; i += 8)
             {
-              dmag += db_from_complex (fft_out[index][d], min_db);
-              dmag -= 0.5 * (db_from_complex (fft_out[prev_index][d], min_db) + db_from_complex (fft_out[next_index][d], min_db));
+              DiffVec u = { diff[up[i]],     diff[up[i + 1]], diff[up[i + 2]], diff[up[i + 3]],
+                            diff[up[i + 4]], diff[up[i + 5]], diff[up[i + 6]], diff[up[i + 7]] };
+              DiffVec d = { diff[down[i]],     diff[down[i + 1]], diff[down[i + 2]], diff[down[i + 3]],
+                            diff[down[i + 4]], diff[down[i + 5]], diff[down[i + 6]], diff[down[i + 7]] };
+              acc += u - d;
             }
+          for (int k = 0; k < 8; k++)
+            mag += acc[k];
+          for (; i < entries_per_bit; i++)
+            mag += diff[up[i]] - diff[down[i]];
         }
-      if ((f % Params::frames_per_bit) == (Params::frames_per_bit - 1))
-        {
-          raw_bit_vec.push_back (umag - dmag);
-          umag = 0;
-          dmag = 0;
-        }
+      raw_bit_vec[bit] = mag;
     }
   return raw_bit_vec;
 }
 
-static vector<float>
-mix_or_linear_decode (const Key& key, vector<vector<complex<float>>>& fft_out, int n_channels)
-{
-  if (Params::mix)
-    return mix_decode (key, fft_out, n_channels);
-  else
-    return linear_decode (key, fft_out, n_channels);
-}
-
 class ResultSet
 {
 public:
@@ -172,16 +162,22 @@ public:
     double            speed = 0;
   };
 private:
-  std::mutex      pattern_mutex;
-  vector<Pattern> patterns;
+  ThreadPool&             thread_pool;
+  vector<vector<Pattern>> thread_patterns; // per thread (ThreadPool::thread_index), merged by sort()
+  vector<Pattern>         patterns;
 
 public:
+  ResultSet() :
+    thread_pool (shared_thread_pool()),
+    thread_patterns (thread_pool.n_threads() + 1)
+  {
+  }
   void
   add_pattern (const Key& key, double time, SyncFinder::Score sync_score, const vector<int>& bit_vec, float decode_error, Type pattern_type, double speed)
   {
-    /* add_pattern can be called by any thread (safe to use from ThreadPool jobs) */
-    std::lock_guard<std::mutex> lg (pattern_mutex);
-
+    /* add_pattern can be called from shared_thread_pool() jobs and the main thread:
+     * every thread appends to its own buffer, so no locking is needed
+     */
     Pattern p;
     p.key = key;
     p.time = time;
@@ -191,11 +187,16 @@ public:
     p.type = pattern_type;
     p.speed = speed;
 
-    patterns.push_back (p);
+    thread_patterns[thread_pool.thread_index()].push_back (p);
   }
   void
   sort()
   {
+    for (auto& tp : thread_patterns)
+      {
+        patterns.insert (patterns.end(), tp.begin(), tp.end());
+        tp.clear();
+      }
     std::sort (patterns.begin(), patterns.end(), [](const Pattern& p1, const Pattern& p2) {
       const int all1 = p1.type == Type::ALL;
       const int all2 = p2.type == Type::ALL;
@@ -248,7 +249,7 @@ public:
     return result;
   }
   void
-  print_json (const WavData& wav_data, const std::string &json_file)
+  print_json (size_t n_frames, int sample_rate, const std::string &json_file)
   {
     FILE *outfile = fopen (json_file == "-" ? "/dev/stdout" : json_file.c_str(), "w");
     if (!outfile)
@@ -256,7 +257,7 @@ public:
         perror (("audiowmark: failed to open \"" + json_file + "\":").c_str());
         exit (127);
       }
-    const size_t time_length = (wav_data.samples().size() / wav_data.n_channels() + wav_data.sample_rate()/2) / wav_data.sample_rate();
+    const size_t time_length = (n_frames + sample_rate / 2) / sample_rate;
     fprintf (outfile, "{ \"length\": \"%ld:%02ld\",\n", time_length / 60, time_length % 60);
     fprintf (outfile, "  \"matches\": [\n");
     int nth = 0;
@@ -382,118 +383,232 @@ public:
  * The basic algorithm is this:
  *
  *  - use sync finder to find start index for the blocks
- *  - decode the blocks
- *  - try to combine A + B blocks for better error correction (AB)
+ *  - decode the blocks (all blocks of all keys in parallel)
+ *  - try to combine A + B blocks for better error correction (AB), in input order
  *  - try to combine all available blocks for better error correction (all pattern)
  */
 class BlockDecoder
 {
+  /* decoder state for one key; in streaming mode this is kept while the input is processed window by window */
+  struct KeyState
+  {
+    Key                                key;
+    std::shared_ptr<const KeySchedule> key_schedule;
+    int                                total_count = 0;
+    vector<float>                      raw_bit_vec_all;
+    vector<int>                        raw_bit_vec_norm;
+    SyncFinder::Score                  score_all { 0, 0 };
+    ConvBlockType                      last_block_type = ConvBlockType::b;
+    vector<vector<float>>              ab_raw_bit_vec;
+    vector<float>                      ab_quality;
+    vector<SyncFinder::Score>          sync_scores; // stored here for sync debugging
+  };
   int debug_sync_frame_count = 0;
   const double speed = 0;
-  vector<SyncFinder::KeyResult> key_results; // stored here for sync debugging
-public:
-  BlockDecoder (double speed) :
-    speed (speed)
+  size_t total_frames = 0;
+  size_t silent_frames = 0;   /* frames skipped because they are silent (see Spectrogram) */
+  vector<KeyState>      key_states;
+  ThreadPool&           thread_pool;
+  ThreadPool::TaskGroup task_group;
+
+  /* one data block found by the sync finder */
+  struct Block
   {
-  }
+    KeyState                  *ks = nullptr;
+    SyncFinder::Score          sync_score;    // index is relative to the whole input
+    double                     time = 0;
+    const Spectrogram::Frames *frames = nullptr;
+    size_t                     first_frame = 0;
+    vector<float>              raw_bit_vec;
+  };
+
+  /* spectrum -> soft bits, then decode the block (can run in parallel for all blocks) */
   void
-  run (const vector<Key>& key_list, const WavData& wav_data, ResultSet& result_set)
+  decode_block (Block& block, ResultSet& result_set)
   {
-    ThreadPool thread_pool;
-    SyncFinder sync_finder;
-    FFTAnalyzer fft_analyzer (wav_data.n_channels());
-    key_results = sync_finder.search (key_list, wav_data, SyncFinder::Mode::BLOCK);
+    const KeySchedule& key_schedule = *block.ks->key_schedule;
 
-    for (const auto& key_result : key_results)
-      {
-        int total_count = 0;
+    /* ---- retrieve bits from watermark ---- */
+    vector<float> raw_bit_vec = mix_or_linear_decode (key_schedule, *block.frames, block.first_frame);
+    assert (raw_bit_vec.size() == code_size (ConvBlockType::a, Params::payload_size));
 
-        vector<float> raw_bit_vec_all (code_size (ConvBlockType::ab, Params::payload_size));
-        vector<int>   raw_bit_vec_norm (2);
+    block.raw_bit_vec = key_schedule.randomize_bit_order (raw_bit_vec, /* encode */ false);
 
-        const Key&  key = key_result.key;
-        SyncFinder::Score score_all { 0, 0 };
+    /* ---- deal with this pattern ---- */
+    const Key&              key = block.ks->key;
+    const SyncFinder::Score sync_score = block.sync_score;
+    const double            time = block.time;
+    task_group.add ([this, key, sync_score, soft_bit_vec = normalize_soft_bits (block.raw_bit_vec), time, &result_set]()
+      {
+        float decode_error = 0;
+        vector<int> bit_vec = code_decode_soft (sync_score.block_type, soft_bit_vec, &decode_error);
 
-        ConvBlockType last_block_type = ConvBlockType::b;
-        vector<vector<float>> ab_raw_bit_vec (2);
-        vector<float>         ab_quality (2);
-        for (auto sync_score : key_result.sync_scores)
-          {
-            const size_t count = mark_sync_frame_count() + mark_data_frame_count();
-            const size_t index = sync_score.index;
-            const int    ab = (sync_score.block_type == ConvBlockType::b); /* A -> 0, B -> 1 */
+        if (!bit_vec.empty())
+          result_set.add_pattern (key, time, sync_score, bit_vec, decode_error, ResultSet::Type::BLOCK, speed);
+      });
+  }
+  /* combine the soft bits of the blocks of one key (in input order): AB blocks and "all" pattern */
+  void
+  reduce_block (const Block& block, ResultSet& result_set)
+  {
+    KeyState&               ks = *block.ks;
+    const Key&              key = ks.key;
+    const SyncFinder::Score sync_score = block.sync_score;
+    const double            time = block.time;
+    const vector<float>&    raw_bit_vec = block.raw_bit_vec;
+    const int               ab = (sync_score.block_type == ConvBlockType::b); /* A -> 0, B -> 1 */
 
-            auto fft_range_out = fft_analyzer.fft_range (wav_data.samples(), index, count);
-            if (fft_range_out.size())
-              {
-                /* ---- retrieve bits from watermark ---- */
-                vector<float> raw_bit_vec = mix_or_linear_decode (key, fft_range_out, wav_data.n_channels());
-                assert (raw_bit_vec.size() == code_size (ConvBlockType::a, Params::payload_size));
+    ks.total_count += 1;
 
-                raw_bit_vec = randomize_bit_order (key, raw_bit_vec, /* encode */ false);
+    /* ---- update "all" pattern ---- */
+    ks.score_all.quality += sync_score.quality;
 
-                /* ---- deal with this pattern ---- */
-                const double time = double (sync_score.index) / wav_data.sample_rate();
-                thread_pool.add_job ([this, key, sync_score, raw_bit_vec, time, &result_set]()
-                  {
-                    float decode_error = 0;
-                    vector<int> bit_vec = code_decode_soft (sync_score.block_type, normalize_soft_bits (raw_bit_vec), &decode_error);
+    for (size_t i = 0; i < raw_bit_vec.size(); i++)
+      {
+        ks.raw_bit_vec_all[i * 2 + ab] += raw_bit_vec[i];
+      }
+    ks.raw_bit_vec_norm[ab]++;
 
-                    if (!bit_vec.empty())
-                      result_set.add_pattern (key, time, sync_score, bit_vec, decode_error, ResultSet::Type::BLOCK, speed);
-                  });
-                total_count += 1;
+    /* ---- if last block was A & this block is B => deal with combined AB block */
+    ks.ab_raw_bit_vec[ab] = raw_bit_vec;
+    ks.ab_quality[ab]     = sync_score.quality;
+    if (ks.last_block_type == ConvBlockType::a && sync_score.block_type == ConvBlockType::b)
+      {
+        /* join A and B block -> AB block */
+        vector<float> ab_bits (raw_bit_vec.size() * 2);
+        for (size_t i = 0; i <  raw_bit_vec.size(); i++)
+          {
+            ab_bits[i * 2] = ks.ab_raw_bit_vec[0][i];
+            ab_bits[i * 2 + 1] = ks.ab_raw_bit_vec[1][i];
+          }
+        const vector<float> ab_quality = ks.ab_quality;
+        task_group.add ([this, key, sync_score, ab_bits = std::move (ab_bits), ab_quality, time, &result_set]()
+          {
+            float decode_error = 0;
+            vector<int> bit_vec = code_decode_soft (ConvBlockType::ab, normalize_soft_bits (ab_bits), &decode_error);
+
+            if (!bit_vec.empty())
+              {
+                SyncFinder::Score score_ab  { 0, 0, ConvBlockType::ab };
+                score_ab.index = sync_score.index;
+                score_ab.quality = (ab_quality[0] + ab_quality[1]) / 2;
+                result_set.add_pattern (key, time, score_ab, bit_vec, decode_error, ResultSet::Type::BLOCK, speed);
+              }
+          });
+      }
+    ks.last_block_type = sync_score.block_type;
+  }
+public:
+  BlockDecoder (double speed, ThreadPool& thread_pool) :
+    speed (speed),
+    thread_pool (thread_pool),
+    task_group (thread_pool)
+  {
+  }
+  void
+  run (const vector<Key>& key_list, const WavData& wav_data, ResultSet& result_set)
+  {
+    start (key_list);
+    run_window (wav_data, 0, 0, wav_data.n_frames(), result_set);
+    finish (frame_count (wav_data), result_set);
+  }
+  /* streaming API: start(), run_window() for each part of the input, finish() */
+  void
+  start (const vector<Key>& key_list)
+  {
+    key_states.clear();
+    for (const auto& key : key_list)
+      {
+        KeyState ks;
+        ks.key = key;
+        ks.key_schedule = KeySchedule::get (key);
+        ks.raw_bit_vec_all.resize (code_size (ConvBlockType::ab, Params::payload_size));
+        ks.raw_bit_vec_norm.resize (2);
+        ks.ab_raw_bit_vec.resize (2);
+        ks.ab_quality.resize (2);
+        key_states.push_back (ks);
+      }
+  }
+  /* decode all blocks in wav_data which start at [first_index, last_index)
+   *
+   * offset is the position of wav_data in the whole input (in frames)
+   */
+  void
+  run_window (const WavData& wav_data, size_t offset, size_t first_index, size_t last_index, ResultSet& result_set)
+  {
+    SyncFinder  sync_finder (thread_pool);
+    Spectrogram spectrogram (thread_pool, PaddedWavData (wav_data));
+    vector<Key> key_list;
+    for (const auto& ks : key_states)
+      key_list.push_back (ks.key);
+
+    size_t n_frames, n_silent;
+    spectrogram.count_silent_frames (first_index, last_index, &n_frames, &n_silent);
+    total_frames  += n_frames;
+    silent_frames += n_silent;
+
+    auto key_results = sync_finder.search (key_list, spectrogram, SyncFinder::Mode::BLOCK);
+
+    /* compute the spectrogram frames of all blocks first (the spectrogram is not thread safe) */
+    const size_t  count = mark_sync_frame_count() + mark_data_frame_count();
+    vector<Block> blocks;
+    for (size_t k = 0; k < key_results.size(); k++)
+      {
+        KeyState& ks = key_states[k];
 
-                /* ---- update "all" pattern ---- */
-                score_all.quality += sync_score.quality;
+        for (auto sync_score : key_results[k].sync_scores)
+          {
+            if (sync_score.index < first_index || sync_score.index >= last_index)
+              continue;
 
-                for (size_t i = 0; i < raw_bit_vec.size(); i++)
-                  {
-                    raw_bit_vec_all[i * 2 + ab] += raw_bit_vec[i];
-                  }
-                raw_bit_vec_norm[ab]++;
+            SyncFinder::Score debug_score = sync_score;
+            debug_score.index += offset;
+            ks.sync_scores.push_back (debug_score);
 
-                /* ---- if last block was A & this block is B => deal with combined AB block */
-                ab_raw_bit_vec[ab] = raw_bit_vec;
-                ab_quality[ab]     = sync_score.quality;
-                if (last_block_type == ConvBlockType::a && sync_score.block_type == ConvBlockType::b)
-                  {
-                    /* join A and B block -> AB block */
-                    vector<float> ab_bits (raw_bit_vec.size() * 2);
-                    for (size_t i = 0; i <  raw_bit_vec.size(); i++)
-                      {
-                        ab_bits[i * 2] = ab_raw_bit_vec[0][i];
-                        ab_bits[i * 2 + 1] = ab_raw_bit_vec[1][i];
-                      }
-                    thread_pool.add_job ([this, key, sync_score, ab_bits, ab_quality, time, &result_set]()
-                      {
-                        float decode_error = 0;
-                        vector<int> bit_vec = code_decode_soft (ConvBlockType::ab, normalize_soft_bits (ab_bits), &decode_error);
-
-                        if (!bit_vec.empty())
-                          {
-                            SyncFinder::Score score_ab  { 0, 0, ConvBlockType::ab };
-                            score_ab.index = sync_score.index;
-                            score_ab.quality = (ab_quality[0] + ab_quality[1]) / 2;
-                            result_set.add_pattern (key, time, score_ab, bit_vec, decode_error, ResultSet::Type::BLOCK, speed);
-                          }
-                      });
-                  }
-                last_block_type = sync_score.block_type;
+            const size_t first_frame = sync_score.index / Params::frame_size;
+            const auto&  frames = spectrogram.frames (sync_score.index % Params::frame_size, first_frame, count);
+            if (first_frame + count <= frames.n_frames)
+              {
+                Block block;
+                block.ks          = &ks;
+                block.sync_score  = debug_score;
+                block.time        = double (debug_score.index) / wav_data.sample_rate();
+                block.frames      = &frames;
+                block.first_frame = first_frame;
+                blocks.push_back (std::move (block));
               }
           }
-        if (total_count > 1) /* all pattern: average soft bits of all watermarks and decode */
+      }
+
+    /* decode all blocks in parallel, the block results are added as soon as each block is done */
+    ThreadPool::TaskGroup block_group (thread_pool);
+    for (auto& block : blocks)
+      block_group.add ([this, &block, &result_set]() { decode_block (block, result_set); });
+    block_group.wait();
+
+    /* AB blocks and "all" pattern need the soft bits of the previous blocks of the same key */
+    for (const auto& block : blocks)
+      reduce_block (block, result_set);
+  }
+  void
+  finish (int n_frames, ResultSet& result_set)
+  {
+    for (auto& ks : key_states)
+      {
+        if (ks.total_count > 1) /* all pattern: average soft bits of all watermarks and decode */
           {
-            for (size_t i = 0; i < raw_bit_vec_all.size(); i += 2)
+            for (size_t i = 0; i < ks.raw_bit_vec_all.size(); i += 2)
               {
-                raw_bit_vec_all[i]     /= max (raw_bit_vec_norm[0], 1); /* normalize A soft bits with number of A blocks */
-                raw_bit_vec_all[i + 1] /= max (raw_bit_vec_norm[1], 1); /* normalize B soft bits with number of B blocks */
+                ks.raw_bit_vec_all[i]     /= max (ks.raw_bit_vec_norm[0], 1); /* normalize A soft bits with number of A blocks */
+                ks.raw_bit_vec_all[i + 1] /= max (ks.raw_bit_vec_norm[1], 1); /* normalize B soft bits with number of B blocks */
               }
-            score_all.quality /= raw_bit_vec_norm[0] + raw_bit_vec_norm[1];
+            ks.score_all.quality /= ks.raw_bit_vec_norm[0] + ks.raw_bit_vec_norm[1];
 
-            vector<float> soft_bit_vec = normalize_soft_bits (raw_bit_vec_all);
+            vector<float> soft_bit_vec = normalize_soft_bits (ks.raw_bit_vec_all);
 
-            thread_pool.add_job ([this, key, score_all, soft_bit_vec, &result_set]()
+            const Key&              key = ks.key;
+            const SyncFinder::Score score_all = ks.score_all;
+            task_group.add ([this, key, score_all, soft_bit_vec = std::move (soft_bit_vec), &result_set]()
               {
                 float decode_error = 0;
                 vector<int> bit_vec = code_decode_soft (ConvBlockType::ab, soft_bit_vec, &decode_error);
@@ -503,18 +618,18 @@ public:
               });
           }
       }
-    thread_pool.wait_all();
+    task_group.wait();
 
-    debug_sync_frame_count = frame_count (wav_data);
+    debug_sync_frame_count = n_frames;
   }
   void
   print_debug_sync()
   {
     /* this is really only useful for debugging, and should be used with exactly one key */
-    if (key_results.size() != 1)
+    if (key_states.size() != 1)
       return;
 
-    const auto& sync_scores = key_results[0].sync_scores;
+    const auto& sync_scores = key_states[0].sync_scores;
 
     /* search sync markers at typical positions */
     const int expect0 = Params::frames_pad_start * Params::frame_size;
@@ -535,6 +650,11 @@ public:
       }
     printf ("sync_match %d %zd\n", sync_match, sync_scores.size());
   }
+  double
+  silent_fraction() const
+  {
+    return total_frames ? double (silent_frames) / total_frames : 0;
+  }
 };
 
 /*
@@ -568,28 +688,30 @@ class ClipDecoder
 {
   const int frames_per_block = 0;
   const double speed = 0;
+  ThreadPool& thread_pool;
 
   void
-  run_padded (const vector<Key>& key_list, const WavData& wav_data, ResultSet& result_set, double time_offset_sec)
+  run_padded (const vector<Key>& key_list, const PaddedWavData& wav_data, ResultSet& result_set, double time_offset_sec)
   {
-    SyncFinder                    sync_finder;
-    vector<SyncFinder::KeyResult> key_results = sync_finder.search (key_list, wav_data, SyncFinder::Mode::CLIP);
-    FFTAnalyzer                   fft_analyzer (wav_data.n_channels());
-    ThreadPool                    thread_pool;
+    SyncFinder                    sync_finder (thread_pool);
+    Spectrogram                   spectrogram (thread_pool, wav_data);
+    vector<SyncFinder::KeyResult> key_results = sync_finder.search (key_list, spectrogram, SyncFinder::Mode::CLIP);
+    ThreadPool::TaskGroup         task_group (thread_pool);
 
     for (const auto& key_result : key_results)
       {
         const Key& key = key_result.key;
+        auto key_schedule = KeySchedule::get (key);
         for (const auto& sync_score : key_result.sync_scores)
           {
             const size_t count = mark_sync_frame_count() + mark_data_frame_count();
             const size_t index = sync_score.index;
-            auto fft_range_out1 = fft_analyzer.fft_range (wav_data.samples(), index, count);
-            auto fft_range_out2 = fft_analyzer.fft_range (wav_data.samples(), index + count * Params::frame_size, count);
-            if (fft_range_out1.size() && fft_range_out2.size())
+            const size_t first_frame = index / Params::frame_size;
+            const auto&  frames = spectrogram.frames (index % Params::frame_size, first_frame, 2 * count);
+            if (first_frame + 2 * count <= frames.n_frames)
               {
-                const auto raw_bit_vec1 = randomize_bit_order (key, mix_or_linear_decode (key, fft_range_out1, wav_data.n_channels()), /* encode */ false);
-                const auto raw_bit_vec2 = randomize_bit_order (key, mix_or_linear_decode (key, fft_range_out2, wav_data.n_channels()), /* encode */ false);
+                const auto raw_bit_vec1 = key_schedule->randomize_bit_order (mix_or_linear_decode (*key_schedule, frames, first_frame), /* encode */ false);
+                const auto raw_bit_vec2 = key_schedule->randomize_bit_order (mix_or_linear_decode (*key_schedule, frames, first_frame + count), /* encode */ false);
                 const size_t bits_per_block = raw_bit_vec1.size();
                 vector<float> raw_bit_vec;
                 for (size_t i = 0; i < bits_per_block; i++)
@@ -609,7 +731,7 @@ class ClipDecoder
                 SyncFinder::Score sync_score_nopad = sync_score;
                 sync_score_nopad.index = time_offset_sec * wav_data.sample_rate();
 
-                thread_pool.add_job ([this, key, raw_bit_vec, sync_score_nopad, time_offset_sec, &result_set]()
+                task_group.add ([this, key, raw_bit_vec = std::move (raw_bit_vec), sync_score_nopad, time_offset_sec, &result_set]()
                   {
                     float decode_error = 0;
                     vector<int> bit_vec = code_decode_soft (ConvBlockType::ab, normalize_soft_bits (raw_bit_vec), &decode_error);
@@ -620,58 +742,57 @@ class ClipDecoder
               }
           }
       }
-    thread_pool.wait_all();
+    task_group.wait();
   }
   enum class Pos { START, END };
   void
   run_block (const vector<Key>& key_list, const WavData& wav_data, ResultSet& result_set, Pos pos)
   {
-    const size_t n = (frames_per_block + 5) * Params::frame_size * wav_data.n_channels();
+    const size_t n = (frames_per_block + 5) * Params::frame_size;
 
-    // range of samples used by clip: [first_sample, last_sample)
-    size_t first_sample;
-    size_t last_sample;
-    size_t pad_samples_start = n;
-    size_t pad_samples_end   = n;
+    // range of sample frames used by clip: [first_frame, last_frame)
+    size_t first_frame;
+    size_t last_frame;
+    size_t pad_frames_start = n;
+    size_t pad_frames_end   = n;
 
     if (pos == Pos::START)
       {
-        first_sample = 0;
-        last_sample  = min (n, wav_data.n_values());
+        first_frame = 0;
+        last_frame  = min (n, wav_data.n_frames());
 
         // increase padding at start for small blocks
         //   -> (available samples + padding) must always be one L-block
-        if (last_sample < n)
-          pad_samples_start += n - last_sample;
+        if (last_frame < n)
+          pad_frames_start += n - last_frame;
       }
     else // (pos == Pos::END)
       {
-        if (wav_data.n_values() <= n)
+        if (wav_data.n_frames() <= n)
           return;
 
-        first_sample = wav_data.n_values() - n;
-        last_sample  = wav_data.n_values();
+        first_frame = wav_data.n_frames() - n;
+        last_frame  = wav_data.n_frames();
       }
-    const double time_offset = double (first_sample) / wav_data.sample_rate() / wav_data.n_channels();
-    vector<float> ext_samples (wav_data.samples().begin() + first_sample, wav_data.samples().begin() + last_sample);
+    const double time_offset = double (first_frame) / wav_data.sample_rate();
 
     if (0)
       {
-        printf ("%d: %f..%f\n", int (pos), time_offset, time_offset + double (ext_samples.size()) / wav_data.sample_rate() / wav_data.n_channels());
+        printf ("%d: %f..%f\n", int (pos), time_offset, time_offset + double (last_frame - first_frame) / wav_data.sample_rate());
         printf ("%f< >%f\n",
-          double (pad_samples_start) / wav_data.sample_rate() / wav_data.n_channels(),
-          double (pad_samples_end) / wav_data.sample_rate() / wav_data.n_channels());
+          double (pad_frames_start) / wav_data.sample_rate(),
+          double (pad_frames_end) / wav_data.sample_rate());
       }
-    ext_samples.insert (ext_samples.begin(), pad_samples_start, 0);
-    ext_samples.insert (ext_samples.end(),   pad_samples_end, 0);
+    /* neither the clip nor the zero padding is copied */
+    WavData clip_data = wav_data.slice (first_frame, last_frame - first_frame);
 
-    WavData l_wav_data (ext_samples, wav_data.n_channels(), wav_data.sample_rate(), wav_data.bit_depth());
-    run_padded (key_list, l_wav_data, result_set, time_offset);
-   }
+    run_padded (key_list, PaddedWavData (clip_data, pad_frames_start, pad_frames_end), result_set, time_offset);
+  }
 public:
-  ClipDecoder(double speed) :
+  ClipDecoder (double speed, ThreadPool& thread_pool) :
     frames_per_block (mark_sync_frame_count() + mark_data_frame_count()),
-    speed (speed)
+    speed (speed),
+    thread_pool (thread_pool)
   {
   }
   void
@@ -686,10 +807,47 @@ public:
   }
 };
 
+static int
+report (ResultSet& result_set, BlockDecoder& block_decoder, size_t n_frames, int sample_rate, const vector<int>& orig_bits)
+{
+  result_set.sort();
+
+  if (!Params::json_output.empty())
+    result_set.print_json (n_frames, sample_rate, Params::json_output);
+
+  if (Params::json_output != "-")
+    result_set.print();
+
+  if (block_decoder.silent_fraction() > 0)
+    info ("Silence:      %.1f%% of the frames skipped\n", block_decoder.silent_fraction() * 100);
+
+  if (!orig_bits.empty())
+    {
+      int match_count = result_set.print_match_count (orig_bits);
+
+      block_decoder.print_debug_sync();
+
+      if (Params::expect_matches >= 0)
+        {
+          printf ("expect_matches %d\n", Params::expect_matches);
+          if (match_count != Params::expect_matches)
+            return 1;
+        }
+      else
+        {
+          if (!match_count)
+            return 1;
+        }
+    }
+  return 0;
+}
+
+
 static int
 decode_and_report (const vector<Key>& key_list, const WavData& wav_data, const vector<int>& orig_bits)
 {
-  ResultSet result_set;
+  ResultSet   result_set;
+  ThreadPool& thread_pool = shared_thread_pool();
 
   /*
    * The strategy for integrating speed detection into decoding is this:
@@ -704,7 +862,7 @@ decode_and_report (const vector<Key>& key_list, const WavData& wav_data, const v
     {
       vector<DetectSpeedResult> speed_results;
       if (Params::detect_speed || Params::detect_speed_patient)
-        speed_results = detect_speed (key_list, wav_data, !orig_bits.empty());
+        speed_results = detect_speed (thread_pool, key_list, wav_data, !orig_bits.empty());
       else
         {
           for (const auto& key : key_list)
@@ -720,47 +878,234 @@ decode_and_report (const vector<Key>& key_list, const WavData& wav_data, const v
         {
           WavData wav_data_speed = resample (wav_data, Params::mark_sample_rate * speed_result.speed);
 
-          BlockDecoder block_decoder (speed_result.speed);
+          BlockDecoder block_decoder (speed_result.speed, thread_pool);
           block_decoder.run ({ speed_result.key }, wav_data_speed, result_set);
 
-          ClipDecoder clip_decoder (speed_result.speed);
+          ClipDecoder clip_decoder (speed_result.speed, thread_pool);
           clip_decoder.run ({ speed_result.key }, wav_data_speed, result_set);
         }
     }
 
-  BlockDecoder block_decoder (1);
+  BlockDecoder block_decoder (1, thread_pool);
   block_decoder.run (key_list, wav_data, result_set);
 
-  ClipDecoder clip_decoder (1) ;
+  ClipDecoder clip_decoder (1, thread_pool);
   clip_decoder.run (key_list, wav_data, result_set);
 
-  result_set.sort();
+  return report (result_set, block_decoder, wav_data.n_frames(), wav_data.sample_rate(), orig_bits);
+}
 
-  if (!Params::json_output.empty())
-    result_set.print_json (wav_data, Params::json_output);
+/* reads input frames, resampled to Params::mark_sample_rate if necessary */
+class MarkRateReader
+{
+  AudioInputStream              *in_stream = nullptr;
+  std::unique_ptr<ResamplerImpl> resampler;
+  size_t                         in_frames = 0;
+  size_t                         out_frames = 0;
+  bool                           eof = false;
+
+  Error
+  read_input (vector<float>& samples, size_t count)
+  {
+    vector<float> buffer;
+    while (!eof && samples.size() < count * in_stream->n_channels())
+      {
+        const size_t want = min<size_t> (count - samples.size() / in_stream->n_channels(), 1024);
+        Error err = in_stream->read_frames (buffer, want);
+        if (err)
+          return err;
+
+        if (buffer.empty())
+          eof = true;
+        samples.insert (samples.end(), buffer.begin(), buffer.end());
+      }
+    return Error::Code::NONE;
+  }
+public:
+  MarkRateReader (AudioInputStream *in_stream) :
+    in_stream (in_stream)
+  {
+    if (in_stream->sample_rate() != Params::mark_sample_rate)
+      resampler.reset (create_resampler (in_stream->n_channels(), in_stream->sample_rate(), Params::mark_sample_rate));
+  }
+  bool
+  init_ok() const
+  {
+    return in_stream->sample_rate() == Params::mark_sample_rate || resampler;
+  }
+  /* returns count frames, or less if the end of the input was reached */
+  Error
+  read_frames (vector<float>& samples, size_t count)
+  {
+    samples.clear();
+    if (!resampler)
+      return read_input (samples, count);
 
-  if (Params::json_output != "-")
-    result_set.print();
+    const int    n_channels = in_stream->n_channels();
+    const double ratio = double (Params::mark_sample_rate) / in_stream->sample_rate();
+    while (resampler->can_read_frames() < count && !eof)
+      {
+        vector<float> in_samples;
+        Error err = read_input (in_samples, Params::frame_size);
+        if (err)
+          return err;
+
+        in_frames += in_samples.size() / n_channels;
+        resampler->write_frames (in_samples);
+        if (eof)
+          resampler->flush();
+      }
+    size_t frames = min (count, resampler->can_read_frames());
+    if (eof) /* same output length as resample() */
+      {
+        const size_t total_frames = lrint (in_frames * ratio);
+        frames = min (count, total_frames > out_frames ? total_frames - out_frames : 0);
+      }
+    samples = resampler->read_frames (min (frames, resampler->can_read_frames()));
+    samples.resize (frames * n_channels);
+    out_frames += frames;
+    return Error::Code::NONE;
+  }
+};
 
-  if (!orig_bits.empty())
+/*
+ * Streaming block decoder: instead of loading the whole input into memory,
+ * the input is processed using overlapping windows of about two data blocks.
+ *
+ * INPUT:   AA|BBBBB|AAAAA|BBBBB|AAAAA|BBB
+ * WIN #1   AA|BBBBB|AAAAA
+ * WIN #2         BBBBB|AAAAA|BBBBB
+ * WIN #3               AAAAA|BBBBB|AAAAA
+ *
+ * Each window only decodes the blocks that start in its first block (hop), so
+ * the results are the same as for in-memory decoding. While one window is
+ * decoded, the input data for the next window is read in a separate thread.
+ */
+static int
+decode_and_report_stream (const vector<Key>& key_list, AudioInputStream *in_stream, const vector<int>& orig_bits)
+{
+  MarkRateReader reader (in_stream);
+  if (!reader.init_ok())
+    return 1;
+
+  const int    n_channels   = in_stream->n_channels();
+  const size_t block_frames = (mark_sync_frame_count() + mark_data_frame_count()) * Params::frame_size;
+  const size_t pad_frames   = 2 * Params::frame_size; /* sync search needs some context before the hop */
+  const size_t hop_frames   = block_frames;
+  const size_t ext_frames   = block_frames + 4 * Params::frame_size; /* context after the hop */
+
+  /* inputs which are too short for streaming are decoded in memory (also using the clip decoder) */
+  const size_t clip_frames  = (size_t (block_frames / Params::frame_size * 3.1) + 1) * Params::frame_size;
+
+  auto read_async = [&reader] (size_t count) {
+    return std::async (std::launch::async, [&reader, count]() {
+      vector<float> samples;
+      Error err = reader.read_frames (samples, count);
+      return std::make_pair (err, samples);
+    });
+  };
+
+  ResultSet     result_set;
+  BlockDecoder  block_decoder (1, shared_thread_pool());
+  vector<float> window;
+  size_t        window_start = 0;   /* position of window[0] in input frames */
+  size_t        total_frames = 0;
+  bool          eof = false;
+
+  size_t want_frames = max (hop_frames + ext_frames, clip_frames);
+  auto   next_read   = read_async (want_frames);
+  for (size_t hop_start = 0; !eof; hop_start += hop_frames)
     {
-      int match_count = result_set.print_match_count (orig_bits);
+      auto read_result = next_read.get();
+      Error& err = read_result.first;
+      const vector<float>& samples = read_result.second;
+      if (err)
+        {
+          error ("audiowmark: error reading input: %s\n", err.message());
+          return 1;
+        }
+      eof = samples.size() < want_frames * n_channels;
 
-      block_decoder.print_debug_sync();
+      total_frames += samples.size() / n_channels;
+      window.insert (window.end(), samples.begin(), samples.end());
 
-      if (Params::expect_matches >= 0)
+      WavData wav_data (window, n_channels, Params::mark_sample_rate, in_stream->bit_depth());
+      if (hop_start == 0 && eof)
         {
-          printf ("expect_matches %d\n", Params::expect_matches);
-          if (match_count != Params::expect_matches)
-            return 1;
+          /* short input: everything fits into the first window, use the normal code */
+          return decode_and_report (key_list, wav_data, orig_bits);
         }
-      else
+      if (hop_start == 0)
+        block_decoder.start (key_list);
+
+      /* read input for the next window while decoding this one */
+      if (!eof)
         {
-          if (!match_count)
-            return 1;
+          const size_t next_end = hop_start + 2 * hop_frames + ext_frames;
+          want_frames = next_end > total_frames ? next_end - total_frames : 0;
+          next_read   = read_async (want_frames);
         }
+
+      /* the last window decodes all remaining blocks */
+      const size_t first_index = hop_start - window_start;
+      const size_t last_index  = eof ? wav_data.n_frames() : first_index + hop_frames;
+      block_decoder.run_window (wav_data, window_start, first_index, last_index, result_set);
+
+      /* keep pad_frames before the next hop */
+      const size_t new_window_start = hop_start + hop_frames - pad_frames;
+      window.erase (window.begin(), window.begin() + (new_window_start - window_start) * n_channels);
+      window_start = new_window_start;
     }
-  return 0;
+  block_decoder.finish (total_frames / Params::frame_size, result_set);
+
+  return report (result_set, block_decoder, total_frames, Params::mark_sample_rate, orig_bits);
+}
+
+/* estimate memory usage of in-memory decoding */
+static size_t
+estimate_get_memory (AudioInputStream *in_stream)
+{
+  const size_t n_frames = in_stream->n_frames();
+  const size_t n_mark_frames = double (n_frames) * Params::mark_sample_rate / in_stream->sample_rate();
+
+  size_t bytes = n_frames * in_stream->n_channels() * sizeof (float);
+  if (in_stream->sample_rate() != Params::mark_sample_rate)
+    bytes += n_mark_frames * in_stream->n_channels() * sizeof (float);
+
+  /* sync search spectrum for each of the sync search shifts */
+  const int n_bands = Params::max_band - Params::min_band + 1;
+  const size_t n_shifts = Params::frame_size / Params::sync_search_step;
+  const size_t db_bytes = Params::compact_spectrogram ? sizeof (int16_t) : sizeof (float);
+  bytes += n_mark_frames / Params::frame_size * in_stream->n_channels() * n_bands * db_bytes * n_shifts;
+  return bytes;
+}
+
+static bool
+use_stream_decoder (AudioInputStream *in_stream)
+{
+  if (Params::max_memory == 0)
+    return false;
+
+  if (in_stream->n_frames() != AudioInputStream::N_FRAMES_UNKNOWN && estimate_get_memory (in_stream) <= Params::max_memory)
+    return false;
+
+  /* options that need the whole input in memory */
+  const char *option = nullptr;
+  if (Params::detect_speed_patient)
+    option = "--detect-speed-patient";
+  else if (Params::detect_speed)
+    option = "--detect-speed";
+  else if (Params::try_speed > 0)
+    option = "--try-speed";
+  else if (Params::test_truncate)
+    option = "--test-truncate";
+
+  if (option)
+    {
+      warning ("audiowmark: ignoring --max-memory: %s needs the whole input in memory\n", option);
+      return false;
+    }
+  return true;
 }
 
 int
@@ -774,8 +1119,18 @@ get_watermark (const vector<Key>& key_list, const string& infile, const string&
         return 1;
     }
 
+  Error err;
+  std::unique_ptr<AudioInputStream> in_stream = AudioInputStream::create (infile, err);
+  if (err)
+    {
+      error ("audiowmark: error loading %s: %s\n", infile.c_str(), err.message());
+      return 1;
+    }
+  if (use_stream_decoder (in_stream.get()))
+    return decode_and_report_stream (key_list, in_stream.get(), orig_bitvec);
+
   WavData wav_data;
-  Error err = wav_data.load (infile);
+  err = wav_data.load (in_stream.get());
   if (err)
     {
       error ("audiowmark: error loading %s: %s\n", infile.c_str(), err.message());
@@ -784,14 +1139,10 @@ get_watermark (const vector<Key>& key_list, const string& infile, const string&
 
   if (Params::test_truncate)
     {
-      const size_t  want_n_samples = wav_data.sample_rate() * wav_data.n_channels() * Params::test_truncate;
-      vector<float> short_samples  = wav_data.samples();
+      const size_t want_n_frames = wav_data.sample_rate() * Params::test_truncate;
 
-      if (want_n_samples < short_samples.size())
-        {
-          short_samples.resize (want_n_samples);
-          wav_data.set_samples (short_samples);
-        }
+      if (want_n_frames < wav_data.n_frames())
+        wav_data = wav_data.slice (0, want_n_frames);
     }
   if (wav_data.sample_rate() == Params::mark_sample_rate)
     {
@@ -31,16 +31,9 @@ using std::max;
 static WavData
 truncate (const WavData& in_data, double seconds)
 {
-  WavData out_data = in_data;
-  vector<float> short_samples = in_data.samples();
+  const size_t want_n_frames = lrint (in_data.sample_rate() * seconds);
 
-  const size_t want_n_samples = lrint (in_data.sample_rate() * seconds) * in_data.n_channels();
-  if (short_samples.size() > want_n_samples)
-    {
-      short_samples.resize (want_n_samples);
-      out_data.set_samples (short_samples);
-    }
-  return out_data;
+  return in_data.slice (0, std::min (want_n_frames, in_data.n_frames()));
 }
 
 static WavData
@@ -57,10 +50,7 @@ get_speed_clip (double location, const WavData& in_data, double clip_seconds)
   printf ("[%f %f] l%f\n", double (start_point) / in_data.sample_rate(), double (end_point) / in_data.sample_rate(),
                            double (end_point - start_point) / in_data.sample_rate());
 #endif
-  vector<float> out_signal (in_data.samples().begin() + start_point * in_data.n_channels(),
-                            in_data.samples().begin() + end_point * in_data.n_channels());
-  WavData clip_data (out_signal, in_data.n_channels(), in_data.sample_rate(), in_data.bit_depth());
-  return clip_data;
+  return in_data.slice (start_point, end_point - start_point);
 }
 
 struct SpeedScanParams
@@ -116,13 +106,6 @@ public:
     double speed = 0;
     double quality = 0;
   };
-  struct SyncBit
-  {
-    int bit = 0;
-    int frame = 0;
-    std::vector<int> up;
-    std::vector<int> down;
-  };
   struct BitValue
   {
     float umag = 0;
@@ -137,15 +120,15 @@ public:
 private:
   static constexpr int OFFSET_SHIFT = 16;
 
-  vector<SyncBit> sync_bits;
+  SyncFinder::SyncPattern sync_pattern;
+  vector<int>             sync_entries; // sync pattern entries sorted by frame
   MagMatrix sync_matrix;
 
   void prepare_mags (const SpeedScanParams& scan_params);
-  void compare (double relative_speed);
+  Score compare (double relative_speed);
   template<int BLOCK>
   void compare_bits (vector<CmpState>& cmp_states, double relative_speed);
 
-  std::mutex mutex;
   vector<Score> result_scores;
   const WavData& in_data;
   const double center;
@@ -158,39 +141,29 @@ public:
     frames_per_block (mark_sync_frame_count() + mark_data_frame_count())
   {
     // constructor is run in the main thread; everything that is not thread-safe must happen here
-    auto sync_finder_bits = SyncFinder::get_sync_bits (key, in_data, SyncFinder::Mode::BLOCK);
-    for (size_t bit = 0; bit < sync_finder_bits.size(); bit++)
-      {
-        for (const auto& frame_bit : sync_finder_bits[bit])
-          {
-            SyncBit sb;
-
-            sb.bit    = bit;
-            sb.frame  = frame_bit.frame;
-            sb.up     = frame_bit.up;
-            sb.down   = frame_bit.down;
-
-            sync_bits.push_back (sb);
-          }
-      }
-    std::sort (sync_bits.begin(), sync_bits.end(), [](const auto& s1, const auto& s2) { return s1.frame < s2.frame; });
+    sync_pattern = SyncFinder::get_sync_pattern (key, in_data.n_channels(), SyncFinder::Mode::BLOCK);
+    for (size_t e = 0; e < sync_pattern.size(); e++)
+      sync_entries.push_back (e);
+    std::sort (sync_entries.begin(), sync_entries.end(), [this] (int e1, int e2) { return sync_pattern.frame[e1] < sync_pattern.frame[e2]; });
   }
   void
-  start_prepare_job (ThreadPool& thread_pool, const SpeedScanParams& scan_params)
+  start_prepare_job (ThreadPool::TaskGroup& task_group, const SpeedScanParams& scan_params)
   {
-    thread_pool.add_job ([this, &scan_params]() { prepare_mags (scan_params); });
+    task_group.add ([this, &scan_params]() { prepare_mags (scan_params); });
   }
 
   void
-  start_search_jobs (ThreadPool& thread_pool, const SpeedScanParams& scan_params, double speed)
+  start_search_jobs (ThreadPool::TaskGroup& task_group, const SpeedScanParams& scan_params, double speed)
   {
-    result_scores.clear();
+    /* each job stores its score in its own slot, so no locking is needed */
+    result_scores.assign (2 * scan_params.n_steps + 1, Score());
 
     for (int p = -scan_params.n_steps; p <= scan_params.n_steps; p++)
       {
         const double relative_speed = pow (scan_params.step, p) * speed / center;
+        Score *score = &result_scores[p + scan_params.n_steps];
 
-        thread_pool.add_job ([relative_speed, this]() { compare (relative_speed); });
+        task_group.add ([relative_speed, score, this]() { *score = compare (relative_speed); });
       }
   }
 
@@ -226,7 +199,7 @@ SpeedSync::prepare_mags (const SpeedScanParams& scan_params)
 
   /* set mag matrix size */
   int n_sync_rows = 0;
-  int n_sync_cols = sync_bits.size();
+  int n_sync_cols = sync_entries.size();
   for (size_t ppos = 0; ppos + sub_frame_size < in_data_sub.n_frames(); ppos += sub_sync_search_step)
     n_sync_rows++;
   sync_matrix.resize (n_sync_rows, n_sync_cols);
@@ -236,7 +209,7 @@ SpeedSync::prepare_mags (const SpeedScanParams& scan_params)
   while (pos + sub_frame_size < in_data_sub.n_frames())
     {
       int col = 0;
-      const std::vector<float>& samples = in_data_sub.samples();
+      const WavData::Samples samples = in_data_sub.samples();
       vector<float> fft_out_db;
 
       for (int ch = 0; ch < in_data_sub.n_channels(); ch++)
@@ -254,14 +227,17 @@ SpeedSync::prepare_mags (const SpeedScanParams& scan_params)
               fft_out_db.push_back (db_from_complex (out[i * 2], out[i * 2 + 1], min_db));
             }
         }
-      for (const auto& sync_bit : sync_bits)
+      const size_t n_up_down = sync_pattern.n_up_down;
+      for (auto e : sync_entries)
         {
+          const int *up   = &sync_pattern.up[e * n_up_down];
+          const int *down = &sync_pattern.down[e * n_up_down];
           float umag = 0, dmag = 0;
 
-          for (size_t i = 0; i < sync_bit.up.size(); i++)
+          for (size_t i = 0; i < n_up_down; i++)
             {
-              umag += fft_out_db[sync_bit.up[i]];
-              dmag += fft_out_db[sync_bit.down[i]];
+              umag += fft_out_db[up[i]];
+              dmag += fft_out_db[down[i]];
             }
           sync_matrix (row, col++) = MagMatrix::Mags {umag, dmag};
         }
@@ -280,9 +256,10 @@ SpeedSync::compare_bits (vector<CmpState>& cmp_states, double relative_speed)
 
   auto begin = cmp_states.end();
   auto end = cmp_states.end();
-  for (size_t mi = 0; mi < sync_bits.size(); mi++)
+  for (size_t mi = 0; mi < sync_entries.size(); mi++)
     {
-      const int frame_offset = ((BLOCK * frames_per_block + sync_bits[mi].frame) * steps_per_frame * relative_speed_inv + 0.5) * (1 << OFFSET_SHIFT);
+      const int e = sync_entries[mi];
+      const int frame_offset = ((BLOCK * frames_per_block + sync_pattern.frame[e]) * steps_per_frame * relative_speed_inv + 0.5) * (1 << OFFSET_SHIFT);
 
       while (begin > cmp_states.begin())
         {
@@ -314,7 +291,7 @@ SpeedSync::compare_bits (vector<CmpState>& cmp_states, double relative_speed)
         {
           int index = (it->offset + frame_offset) >> OFFSET_SHIFT;
 
-          auto& bv = it->bit_values[sync_bits[mi].bit];
+          auto& bv = it->bit_values[sync_pattern.bit[e]];
           auto mags = sync_matrix (index, mi);
           if (BLOCK & 1)
             {
@@ -331,7 +308,7 @@ SpeedSync::compare_bits (vector<CmpState>& cmp_states, double relative_speed)
     }
 }
 
-void
+SpeedSync::Score
 SpeedSync::compare (double relative_speed)
 {
   const int steps_per_frame = Params::frame_size / Params::sync_search_step;
@@ -382,8 +359,7 @@ SpeedSync::compare (double relative_speed)
             }
         }
     }
-  std::lock_guard<std::mutex> lg (mutex);
-  result_scores.push_back (best_score);
+  return best_score;
 }
 
 /*
@@ -428,11 +404,11 @@ score_smooth_find_best (const vector<SpeedSync::Score>& in_scores, double step,
 class SpeedSearch
 {
   vector<std::unique_ptr<SpeedSync>> speed_sync;
-  SpeedSync      *center_speed_sync = nullptr;
-  ThreadPool&     thread_pool;
-  const WavData&  in_data;
-  WavData         clipped_in_data;
-  double          clip_location;
+  SpeedSync             *center_speed_sync = nullptr;
+  ThreadPool::TaskGroup& task_group;
+  const WavData&         in_data;
+  WavData                clipped_in_data;
+  double                 clip_location;
 
   SpeedSync *
   find_closest_speed_sync (double speed)
@@ -444,8 +420,8 @@ class SpeedSearch
     return (*it).get();
   }
 public:
-  SpeedSearch (ThreadPool& thread_pool, const WavData& in_data, double clip_location) :
-    thread_pool (thread_pool),
+  SpeedSearch (ThreadPool::TaskGroup& task_group, const WavData& in_data, double clip_location) :
+    task_group (task_group),
     in_data (in_data),
     clip_location (clip_location)
   {
@@ -485,14 +461,14 @@ SpeedSearch::start_prepare_jobs (const Key& key, const SpeedScanParams& scan_par
     }
 
   for (auto& s : speed_sync)
-    s->start_prepare_job (thread_pool, scan_params);
+    s->start_prepare_job (task_group, scan_params);
 }
 
 void
 SpeedSearch::start_search_jobs (const SpeedScanParams& scan_params)
 {
   for (auto& s : speed_sync)
-    s->start_search_jobs (thread_pool, scan_params, s->center_speed());
+    s->start_search_jobs (task_group, scan_params, s->center_speed());
 }
 
 vector<SpeedSync::Score>
@@ -511,7 +487,7 @@ void
 SpeedSearch::start_refine_jobs (const SpeedScanParams& scan_params, double speed)
 {
   center_speed_sync = find_closest_speed_sync (speed);
-  center_speed_sync->start_search_jobs (thread_pool, scan_params, speed);
+  center_speed_sync->start_search_jobs (task_group, scan_params, speed);
 }
 
 vector<SpeedSync::Score>
@@ -564,7 +540,7 @@ get_clip_locations (const Key& key, const WavData& in_data, int n)
   Random rng (key, 0, Random::Stream::speed_clip);
 
   /* to improve performance, we don't hash all samples but just a few */
-  const vector<float>& samples = in_data.samples();
+  const WavData::Samples samples = in_data.samples();
   vector<float> xsamples;
   for (size_t p = 0; p < samples.size(); p += rng() % 1000)
     xsamples.push_back (samples[p]);
@@ -602,7 +578,7 @@ get_best_clip_location (const Key& key, const WavData& in_data, double seconds,
 }
 
 vector<DetectSpeedResult>
-detect_speed (const vector<Key>& key_list, const WavData& in_data, bool print_results)
+detect_speed (ThreadPool& thread_pool, const vector<Key>& key_list, const WavData& in_data, bool print_results)
 {
   vector<DetectSpeedResult> results;
 
@@ -665,18 +641,18 @@ detect_speed (const vector<Key>& key_list, const WavData& in_data, bool print_re
     vector<SpeedSync::Score>      scores;
   };
   vector<KeySpeedSearch> key_speed_search_vec;
-  ThreadPool thread_pool;
+  ThreadPool::TaskGroup  task_group (thread_pool);
 
   auto run_search = [&] (const SpeedScanParams& scan_params, auto get_speeds) {
     for (auto& key_speed_search : key_speed_search_vec)
       key_speed_search.speed_search->start_prepare_jobs (key_speed_search.key, scan_params, get_speeds (key_speed_search));
 
-    thread_pool.wait_all();
+    task_group.wait();
 
     for (auto& key_speed_search : key_speed_search_vec)
       key_speed_search.speed_search->start_search_jobs (scan_params);
 
-    thread_pool.wait_all();
+    task_group.wait();
 
     for (auto& key_speed_search : key_speed_search_vec)
       key_speed_search.scores = key_speed_search.speed_search->get_results();
@@ -687,7 +663,7 @@ detect_speed (const vector<Key>& key_list, const WavData& in_data, bool print_re
     {
       const double clip_location = get_best_clip_location (key, in_data, scan1.seconds, clip_candidates);
 
-      key_speed_search_vec.push_back ({key, std::make_unique<SpeedSearch> (thread_pool, in_data, clip_location), {}});
+      key_speed_search_vec.push_back ({key, std::make_unique<SpeedSearch> (task_group, in_data, clip_location), {}});
     }
   run_search (scan1, [] (auto& key_speed_search) -> vector<double>
     {
@@ -724,7 +700,7 @@ detect_speed (const vector<Key>& key_list, const WavData& in_data, bool print_re
       for (auto& key_speed_search : key_speed_search_vec)
         key_speed_search.speed_search->start_refine_jobs (scan3, key_speed_search.scores[0].speed);
 
-      thread_pool.wait_all();
+      task_group.wait();
 
       for (auto& key_speed_search : key_speed_search_vec)
         key_speed_search.scores = key_speed_search.speed_search->get_refine_results();
@@ -20,6 +20,7 @@
 
 #include "wavdata.hh"
 #include "random.hh"
+#include "threadpool.hh"
 
 struct DetectSpeedResult
 {
@@ -27,6 +28,6 @@ struct DetectSpeedResult
   double speed = 0;
 };
 
-std::vector<DetectSpeedResult> detect_speed (const std::vector<Key>& key_list, const WavData& in_data, bool print_results);
+std::vector<DetectSpeedResult> detect_speed (ThreadPool& thread_pool, const std::vector<Key>& key_list, const WavData& in_data, bool print_results);
 
 #endif /* AUDIOWMARK_WM_SPEED_HH */
@@ -0,0 +1,28 @@
+#!/bin/bash
+
+source test-common.sh
+
+IN_WAV=add-batch-test.wav
+OUT_WAV=add-batch-test-out.wav
+BATCH_OUT1_WAV=add-batch-test-out1.wav
+BATCH_OUT2_WAV=add-batch-test-out2.wav
+BATCH_FILE=add-batch-test.txt
+TEST_MSG2=0123456789abcdef0011223344556677
+
+audiowmark test-gen-noise $IN_WAV 200 44100
+echo "$BATCH_OUT1_WAV $TEST_MSG" > $BATCH_FILE
+echo "$BATCH_OUT2_WAV $TEST_MSG2" >> $BATCH_FILE
+audiowmark add-batch $IN_WAV $BATCH_FILE
+audiowmark_cmp --expect-matches 5 $BATCH_OUT1_WAV $TEST_MSG
+audiowmark_cmp --expect-matches 5 $BATCH_OUT2_WAV $TEST_MSG2
+
+# batch output must be identical to regular add output
+audiowmark_add $IN_WAV $OUT_WAV $TEST_MSG2
+cmp $OUT_WAV $BATCH_OUT2_WAV || die "add-batch output differs from add output"
+
+# duplicate output file names must be rejected
+echo "$BATCH_OUT1_WAV $TEST_MSG2" >> $BATCH_FILE
+$AUDIOWMARK -q add-batch $IN_WAV $BATCH_FILE 2>/dev/null && die "add-batch accepted duplicate output file"
+
+rm $IN_WAV $OUT_WAV $BATCH_OUT1_WAV $BATCH_OUT2_WAV $BATCH_FILE
+exit 0
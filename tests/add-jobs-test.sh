@@ -0,0 +1,30 @@
+#!/bin/bash
+
+source test-common.sh
+
+IN_WAV=add-jobs-test.wav
+OUT_WAV=add-jobs-test-out.wav
+JOBS_OUT_WAV=add-jobs-test-out-jobs.wav
+
+audiowmark test-gen-noise $IN_WAV 200 44100
+audiowmark_add $IN_WAV $OUT_WAV $TEST_MSG
+
+# chunk parallel output must be identical to regular add output
+for JOBS in 2 3 8
+do
+  audiowmark_add --jobs $JOBS $IN_WAV $JOBS_OUT_WAV $TEST_MSG
+  cmp $OUT_WAV $JOBS_OUT_WAV || die "add --jobs $JOBS output differs from add output"
+done
+audiowmark_cmp --expect-matches 5 $JOBS_OUT_WAV $TEST_MSG
+
+# same for input that needs to be resampled
+for RATE in 48000 32000
+do
+  audiowmark test-gen-noise $IN_WAV 100 $RATE
+  audiowmark_add $IN_WAV $OUT_WAV $TEST_MSG
+  audiowmark_add --jobs 3 $IN_WAV $JOBS_OUT_WAV $TEST_MSG
+  cmp $OUT_WAV $JOBS_OUT_WAV || die "add --jobs 3 output differs from add output (sample rate $RATE)"
+done
+
+rm $IN_WAV $OUT_WAV $JOBS_OUT_WAV
+exit 0
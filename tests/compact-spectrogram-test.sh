@@ -0,0 +1,26 @@
+#!/bin/bash
+
+source test-common.sh
+
+IN_WAV=compact-spectrogram-test.wav
+OUT_WAV=compact-spectrogram-test-out.wav
+CLIP_WAV=compact-spectrogram-test-clip.wav
+GET_OUT=compact-spectrogram-test-get.txt
+COMPACT_GET_OUT=compact-spectrogram-test-get-compact.txt
+
+audiowmark test-gen-noise $IN_WAV 200 44100
+audiowmark_add $IN_WAV $OUT_WAV $TEST_MSG
+audiowmark test-clip $OUT_WAV $CLIP_WAV 42 20
+
+# detection results must be the same for both spectrogram representations
+for WAV in $OUT_WAV $CLIP_WAV
+do
+  audiowmark get $WAV > $GET_OUT
+  audiowmark get --compact-spectrogram $WAV > $COMPACT_GET_OUT
+  cmp $GET_OUT $COMPACT_GET_OUT || die "get --compact-spectrogram results differ for $WAV"
+done
+audiowmark_cmp --compact-spectrogram --expect-matches 5 $OUT_WAV $TEST_MSG
+audiowmark_cmp --compact-spectrogram --max-memory 1 --expect-matches 5 $OUT_WAV $TEST_MSG
+
+rm $IN_WAV $OUT_WAV $CLIP_WAV $GET_OUT $COMPACT_GET_OUT
+exit 0
@@ -0,0 +1,24 @@
+#!/bin/bash
+
+source test-common.sh
+
+IN_WAV=silence-test.wav
+IN_RAW=silence-test.raw
+SILENCE_RAW=silence-test-silence.raw
+OUT_WAV=silence-test-out.wav
+RAW_OPTS="--raw-rate 44100 --raw-channels 2 --raw-bits 16"
+
+# noise without watermark (strength 0) as raw stream
+audiowmark test-gen-noise $IN_WAV 100 44100
+audiowmark_add --strength 0 --output-format raw $RAW_OPTS $IN_WAV $IN_RAW $TEST_MSG
+
+# digital silence at the start, in the middle and at the end of the input
+head -c $((30 * 44100 * 4)) /dev/zero > $SILENCE_RAW
+cat $SILENCE_RAW $IN_RAW $SILENCE_RAW $IN_RAW $SILENCE_RAW | audiowmark_add --input-format raw $RAW_OPTS - $OUT_WAV $TEST_MSG
+
+# silent frames are skipped, this must not affect the detection results
+audiowmark_cmp --expect-matches 8 $OUT_WAV $TEST_MSG
+audiowmark_cmp --silence-floor -60 --expect-matches 8 $OUT_WAV $TEST_MSG
+
+rm $IN_WAV $IN_RAW $SILENCE_RAW $OUT_WAV
+exit 0
@@ -0,0 +1,17 @@
+#!/bin/bash
+
+source test-common.sh
+
+IN_WAV=stream-decoder-test.wav
+OUT_WAV=stream-decoder-test-out.wav
+OUT_48000_WAV=stream-decoder-test-out-48000.wav
+
+audiowmark test-gen-noise $IN_WAV 200 44100
+audiowmark_add $IN_WAV $OUT_WAV $TEST_MSG
+audiowmark_cmp --max-memory 1 --expect-matches 5 $OUT_WAV $TEST_MSG
+cat $OUT_WAV | audiowmark_cmp --max-memory 1 --expect-matches 5 - $TEST_MSG || die "streaming watermark detection from pipe failed"
+audiowmark test-resample $OUT_WAV $OUT_48000_WAV 48000
+audiowmark_cmp --max-memory 1 --expect-matches 5 $OUT_48000_WAV $TEST_MSG
+
+rm $IN_WAV $OUT_WAV $OUT_48000_WAV
+exit 0